@@ -18,13 +18,11 @@ void parse_args(int argc, const char **argv, client_info client) {
     int nusers = 0;
     char buff[DGRAM_SIZE];
     char *user_name, *user_pass;
-    char token[50];
-
     printf("\nIngrese token de verificación:");
-    scanf( "%49s", token);
+    scanf( "%" TOKEN_SCANF_WIDTH "s", client->token);
 
     while (true && client->count_commans < MAX_COMMANDS) {
-        c = getopt(argc, (char *const *) argv, "hvA:mM:dD:pcb");
+        c = getopt(argc, (char *const *) argv, "hvA:mM:dD:pcbeslLPU:W:");
 
         if (c == -1) {
             break;
@@ -43,45 +41,78 @@ void parse_args(int argc, const char **argv, client_info client) {
                     exit(1);
                 }
                 nusers++;
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n%s\n%s\n\n",
-                             client->name_protocol, client->version, token, client->count_commans, client->command_names[ADD_USER], user_name, user_pass);
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n%s\n%s\n\n",
+                             client->count_commans, client->command_names[ADD_USER], user_name, user_pass);
                 client->list_command[client->count_commans].name_command = ADD_USER;
                 break;
             case 'm':
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n\n",
-                         client->name_protocol, client->version, token,client->count_commans, client->command_names[GET_MAX_MAILS]);
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[GET_MAX_MAILS]);
                 client->list_command[client->count_commans].name_command = GET_MAX_MAILS;
                 break;
             case 'M':
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n%ld\n\n",
-                         client->name_protocol, client->version, token, client->count_commans, client->command_names[SET_MAX_MAILS], number( optarg));
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n%ld\n\n",
+                         client->count_commans, client->command_names[SET_MAX_MAILS], number( optarg));
                 client->list_command[client->count_commans].name_command = SET_MAX_MAILS;
                 break;
             case 'd':
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n\n",
-                         client->name_protocol, client->version, token, client->count_commans, client->command_names[GET_MAILDIR]);
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[GET_MAILDIR]);
                 client->list_command[client->count_commans].name_command = GET_MAILDIR;
                 break;
             case 'D':
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n%s\n\n",
-                         client->name_protocol, client->version, token, client->count_commans, client->command_names[SET_MAILDIR], optarg);
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n%s\n\n",
+                         client->count_commans, client->command_names[SET_MAILDIR], optarg);
                 client->list_command[client->count_commans].name_command = SET_MAILDIR;
                 break;
             case 'p':
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n\n",
-                         client->name_protocol, client->version, token, client->count_commans, client->command_names[STAT_PREVIOUS_CONNECTIONS]);
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_PREVIOUS_CONNECTIONS]);
                 client->list_command[client->count_commans].name_command = STAT_PREVIOUS_CONNECTIONS;
                 break;
             case 'c':
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n\n",
-                         client->name_protocol, client->version, token, client->count_commans, client->command_names[STAT_CURRENT_CONNECTIONS]);
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_CURRENT_CONNECTIONS]);
                 client->list_command[client->count_commans].name_command = STAT_CURRENT_CONNECTIONS;
                 break;
             case 'b':
-                snprintf(buff, DGRAM_SIZE, "%s\n%s\n%s\n%d\n%s\n\n",
-                         client->name_protocol, client->version, token, client->count_commans, client->command_names[STAT_BYTES_TRANSFERRED]);
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_BYTES_TRANSFERRED]);
                 client->list_command[client->count_commans].name_command = STAT_BYTES_TRANSFERRED;
                 break;
+            case 'e':
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_EXPUNGE_LATENCY]);
+                client->list_command[client->count_commans].name_command = STAT_EXPUNGE_LATENCY;
+                break;
+            case 's':
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_MAILDIR_SCAN]);
+                client->list_command[client->count_commans].name_command = STAT_MAILDIR_SCAN;
+                break;
+            case 'l':
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_LOGGER]);
+                client->list_command[client->count_commans].name_command = STAT_LOGGER;
+                break;
+            case 'L':
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_LATENCY]);
+                client->list_command[client->count_commans].name_command = STAT_LATENCY;
+                break;
+            case 'P':
+                snprintf(buff, DGRAM_SIZE, "%d\n%s\n\n",
+                         client->count_commans, client->command_names[STAT_LOOP]);
+                client->list_command[client->count_commans].name_command = STAT_LOOP;
+                break;
+            case 'U':
+                //no es un comando del datagrama, se manda aparte con varios round trips
+                client->bulk_file = optarg;
+                continue;
+            case 'W':
+                //tampoco: queda suscripto por TCP al final
+                client->watch_interval = number(optarg);
+                continue;
             default:
                 printf("Invalid state\n");
                 exit(1);
@@ -144,6 +175,13 @@ static void help(const char *progname) {
             "   -p               Recibir el número de conexiones previas.\n"
             "   -c               Recibir el número de conexiones actuales.\n"
             "   -b               Recibir el número de bytes transferidos.\n"
+            "   -e               Recibir la latencia del borrado de mails al hacer QUIT.\n"
+            "   -s               Recibir estadisticas de la lectura del maildir (mails leidos, stat evitados, mails nuevos movidos).\n"
+            "   -l               Recibir estadisticas del logger (lineas descartadas, bytes sin escribir, rotaciones).\n"
+            "   -L               Recibir percentiles de latencia por comando y de la lectura del maildir.\n"
+            "   -P               Recibir el tiempo del loop del servidor por handler y por estado (si corre con -P).\n"
+            "   -W <ms>          Al final, quedarse recibiendo estadisticas del servidor cada <ms> milisegundos (canal TCP).\n"
+            "   -U <file>        Aplicar en una sola operacion los cambios de usuarios del archivo (lineas 'ADD <name>:<pass>' o 'PASS <name>:<pass>').\n"
             "\n",
             progname);
     exit(0);
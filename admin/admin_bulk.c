@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include "admin_bulk.h"
+#include "admin_resp.h"
+
+#define BULK_ARG_SIZE 128 //lo maximo que guarda el servidor por argumento
+#define BULK_RETRIES 3
+
+struct bulk_op{
+    char * type;
+    char * name;
+    char * pass;
+    unsigned int line;
+};
+
+/*
+ * Lee el archivo de cambios. Cada linea es 'ADD <name>:<pass>' o 'PASS <name>:<pass>'; se ignoran las vacias y las que empiezan con #
+ * Retorna la cantidad de operaciones o -1 si hubo un error (ya informado)
+ */
+static long read_bulk_file(const char * path, struct bulk_op ** ops){
+    FILE * file = fopen(path, "r");
+    if(file == NULL){
+        perror("Error opening bulk file");
+        return -1;
+    }
+    char * line = NULL;
+    size_t line_size = 0;
+    size_t count = 0, length = 0;
+    unsigned int line_number = 0;
+    *ops = NULL;
+    while(getline(&line, &line_size, file) != -1){
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0' || line[0] == '#'){
+            continue;
+        }
+        char * type = strtok(line, " ");
+        char * name = strtok(NULL, ":");
+        char * pass = strtok(NULL, "");
+        if(type == NULL || name == NULL || pass == NULL || (strcmp(type, "ADD") != 0 && strcmp(type, "PASS") != 0)
+           || strlen(name) >= BULK_ARG_SIZE || strlen(pass) >= BULK_ARG_SIZE){
+            fprintf(stderr, "%s:%u: invalid line, expected 'ADD <name>:<pass>' or 'PASS <name>:<pass>'\n", path, line_number);
+            goto fail;
+        }
+        if(count == length){
+            length = length == 0 ? 256 : length * 2;
+            struct bulk_op * aux = realloc(*ops, length * sizeof(struct bulk_op));
+            if(aux == NULL){
+                fprintf(stderr, "Out of memory reading bulk file\n");
+                goto fail;
+            }
+            *ops = aux;
+        }
+        (*ops)[count].type = strdup(type);
+        (*ops)[count].name = strdup(name);
+        (*ops)[count].pass = strdup(pass);
+        (*ops)[count].line = line_number;
+        count++;
+        if((*ops)[count - 1].type == NULL || (*ops)[count - 1].name == NULL || (*ops)[count - 1].pass == NULL){
+            fprintf(stderr, "Out of memory reading bulk file\n");
+            goto fail;
+        }
+    }
+    free(line);
+    fclose(file);
+    return (long) count;
+
+fail:
+    free(line);
+    fclose(file);
+    for(size_t i = 0; i < count; i++){
+        free((*ops)[i].type);
+        free((*ops)[i].name);
+        free((*ops)[i].pass);
+    }
+    free(*ops);
+    *ops = NULL;
+    return -1;
+}
+
+/*
+ * Manda el request y espera la respuesta cuyo primer bloque sea first_id (descarta respuestas viejas)
+ * Si no llega, lo reenvia: todos los comandos de la operacion masiva se pueden repetir
+ * Deja en *blocks el primer bloque de la respuesta. Retorna false si no hubo respuesta
+ */
+static bool exchange(int server, struct sockaddr_in * addr, unsigned int addrlen, const char * request, size_t len,
+                     long first_id, char * resp, char ** blocks){
+    for(int attempt = 0; attempt < BULK_RETRIES; attempt++){
+        if(sendto(server, request, len, MSG_NOSIGNAL, (struct sockaddr *) addr, addrlen) < 0){
+            perror("Error sending request to server");
+            return false;
+        }
+        ssize_t read_count;
+        while((read_count = recv(server, resp, BATCH_DGRAM_SIZE, 0)) > 0){
+            resp[read_count] = '\0';
+            char * buff = resp;
+            char * protocol = next_line(&buff);
+            char * version = next_line(&buff);
+            if(protocol == NULL || version == NULL || strcmp(protocol, NAME) != 0){
+                continue;
+            }
+            *blocks = buff;
+            if(*buff != '\0' && strtol(buff, NULL, 10) == first_id){
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Lee el proximo bloque de la respuesta. Retorna false si no quedan
+ */
+static bool next_block(char ** blocks, long * id, bool * ok, char ** data){
+    char * line;
+    while((line = next_line(blocks)) != NULL && *line == '\0');
+    if(line == NULL){
+        return false;
+    }
+    *id = strtol(line, NULL, 10);
+    line = next_line(blocks);
+    *ok = line != NULL && strcmp(line, OK_TEXT) == 0;
+    //los datos siguen hasta la linea vacia, los dejamos separados por \n
+    *data = *blocks;
+    char * end = strstr(*blocks, "\n\n");
+    if(end == NULL){
+        *blocks += strlen(*blocks);
+    }else{
+        end[1] = '\0';
+        *blocks = end + 2;
+    }
+    return true;
+}
+
+int run_bulk(int server, struct sockaddr_in * addr, unsigned int addrlen, client_info client){
+    struct bulk_op * ops;
+    long count = read_bulk_file(client->bulk_file, &ops);
+    if(count < 0){
+        return 1;
+    }
+    int ret = 1;
+    char request[BATCH_DGRAM_SIZE];
+    char resp[BATCH_DGRAM_SIZE + 1];
+    char * blocks;
+    long id;
+    bool ok;
+    char * data;
+    int header_len = snprintf(request, BATCH_DGRAM_SIZE, "%s\n%s\n%s\n", client->name_protocol, client->version, client->token);
+
+    //El id de cada comando: 0 el BEGIN, seq + 1 cada operacion y count + 1 el COMMIT
+    int len = header_len + snprintf(request + header_len, BATCH_DGRAM_SIZE - header_len, "0\n%s\n\n", client->command_names[BULK_BEGIN]);
+    if(!exchange(server, addr, addrlen, request, len, 0, resp, &blocks) || !next_block(&blocks, &id, &ok, &data)){
+        printf("Timeout en el comando %s\n", client->command_names[BULK_BEGIN]);
+        goto finally;
+    }
+    if(!ok){
+        printf("%s -> -ERR\n- %s", client->command_names[BULK_BEGIN], data);
+        goto finally;
+    }
+    unsigned long bulk_id = strtoul(data, NULL, 10);
+
+    long sent = 0;
+    while(sent < count){
+        len = header_len;
+        long first = sent;
+        while(sent < count){
+            int block_len = snprintf(request + len, BATCH_DGRAM_SIZE - len, "%ld\n%s\n%lu\n%ld\n%s\n%s\n%s\n\n", sent + 1,
+                                     client->command_names[BULK_ADD], bulk_id, sent, ops[sent].type, ops[sent].name, ops[sent].pass);
+            if(len + block_len >= BATCH_DGRAM_SIZE){
+                break;
+            }
+            len += block_len;
+            sent++;
+        }
+        if(!exchange(server, addr, addrlen, request, len, first + 1, resp, &blocks)){
+            printf("Timeout en el comando %s\n", client->command_names[BULK_ADD]);
+            goto finally;
+        }
+        while(next_block(&blocks, &id, &ok, &data)){
+            if(!ok){
+                long seq = id - 1;
+                printf("%s -> -ERR (line %u)\n- %s", client->command_names[BULK_ADD], seq >= 0 && seq < count ? ops[seq].line : 0, data);
+                goto finally;
+            }
+        }
+    }
+
+    len = header_len + snprintf(request + header_len, BATCH_DGRAM_SIZE - header_len, "%ld\n%s\n%lu\n%ld\n\n", count + 1,
+                                client->command_names[BULK_COMMIT], bulk_id, count);
+    if(!exchange(server, addr, addrlen, request, len, count + 1, resp, &blocks) || !next_block(&blocks, &id, &ok, &data)){
+        printf("Timeout en el comando %s\n", client->command_names[BULK_COMMIT]);
+        goto finally;
+    }
+    printf("%s -> %s\n", client->command_names[BULK_COMMIT], ok ? "+OK" : "-ERR");
+    char * line;
+    while((line = next_line(&data)) != NULL){
+        printf("- %s\n", line);
+    }
+    ret = ok ? 0 : 1;
+
+finally:
+    for(long i = 0; i < count; i++){
+        free(ops[i].type);
+        free(ops[i].name);
+        free(ops[i].pass);
+    }
+    free(ops);
+    return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef TP_ADMIN_BULK_H
+#define TP_ADMIN_BULK_H
+
+#include <netinet/in.h>
+#include "utils.h"
+
+/*
+ * Aplica los cambios de usuarios de client->bulk_file en una sola operacion del servidor
+ * (BULK_BEGIN, los BULK_ADD en la menor cantidad de datagramas y BULK_COMMIT) e imprime el resumen
+ * Retorna 0 si se pudo confirmar, 1 si no
+ */
+int run_bulk(int server, struct sockaddr_in * addr, unsigned int addrlen, client_info client);
+
+#endif //TP_ADMIN_BULK_H
@@ -5,45 +5,64 @@
 #include <string.h>
 #include <stdlib.h>
 
-#define SEPARATOR_STRING "\n"
+#define SEPARATOR '\n'
 
+char * next_line(char ** buff){
+    char * line = *buff;
+    if(*line == '\0'){
+        return NULL;
+    }
+    char * end = strchr(line, SEPARATOR);
+    if(end == NULL){
+        *buff = line + strlen(line);
+    }else{
+        *end = '\0';
+        *buff = end + 1;
+    }
+    return line;
+}
+
+static bool has_data(int cmd){
+    return cmd == GET_MAX_MAILS || cmd == GET_MAILDIR || cmd == STAT_PREVIOUS_CONNECTIONS || cmd == STAT_CURRENT_CONNECTIONS || cmd == STAT_BYTES_TRANSFERRED
+        || cmd == STAT_EXPUNGE_LATENCY || cmd == STAT_MAILDIR_SCAN || cmd == STAT_LOGGER || cmd == STAT_LATENCY || cmd == STAT_LOOP;
+}
+
+/*
+ * Interpreta una respuesta: PROTOS, version y despues un bloque por comando (id, +/-, datos), separados por una linea vacia
+ * Con la version 1 hay un solo bloque
+ */
 void parse_resp(char * buff, client_info version){
-    char *token;
-    bool status = true;
-    int req_id = 0;
-    token = strtok(buff, SEPARATOR_STRING);
-    int cmd = 0;
-    for(int i=0; token != NULL && i<MAX_LINES_RESP;  i++) {
-        switch (i) {
-            case 0:
-                status = (strcmp(token, version->name_protocol) == 0) && status;
-                break;
-            case 1:
-                status = (strcmp(token, version->version) == 0) && status;
-                break;
-            case 2:
-                req_id = atoi(token);
-                cmd = version->list_command[req_id].name_command;
-                printf("%s -> ", version->command_names[version->list_command[req_id].name_command]);
-                version->list_command[req_id].timeout=false;
-                break;
-            case 3:
-                status = (strcmp(token, OK_TEXT) == 0) && status;
-                if (status) {
-                    printf("+OK\n");
-                } else {
-                    printf("-ERR\n");
-                    i = MAX_LINES_RESP + 1;
-                }
-                break;
-            case 4:
-                if(status && (cmd == GET_MAX_MAILS || cmd == GET_MAILDIR || cmd == STAT_PREVIOUS_CONNECTIONS || cmd == STAT_CURRENT_CONNECTIONS || cmd == STAT_BYTES_TRANSFERRED)){
-                    //solo imprimimos si nos manda informacion
-                    printf("- %s\n", token);
-                }
-                break;
+    char * line = next_line(&buff);
+    if(line == NULL || strcmp(line, version->name_protocol) != 0){
+        printf("Invalid response\n");
+        return;
+    }
+    line = next_line(&buff);
+    if(line == NULL){
+        printf("Invalid response\n");
+        return;
+    }
+    while((line = next_line(&buff)) != NULL){
+        if(*line == '\0'){
+            continue;
+        }
+        int req_id = atoi(line);
+        bool known = req_id >= 0 && req_id < version->count_commans;
+        int cmd = known ? version->list_command[req_id].name_command : -1;
+        if(known){
+            printf("%s -> ", version->command_names[cmd]);
+            version->list_command[req_id].timeout = false;
+        }
+        char * status_line = next_line(&buff);
+        bool status = status_line != NULL && strcmp(status_line, OK_TEXT) == 0;
+        if(known){
+            printf(status ? "+OK\n" : "-ERR\n");
+        }
+        //los datos siguen hasta la linea vacia
+        while((line = next_line(&buff)) != NULL && *line != '\0'){
+            if(known && (!status || has_data(cmd))){
+                printf("- %s\n", line);
+            }
         }
-        version->list_command[req_id].timeout = false;
-        token = strtok(NULL, SEPARATOR_STRING);
     }
 }
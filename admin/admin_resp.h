@@ -6,4 +6,9 @@
 
 void parse_resp(char * buff, client_info version);
 
+/*
+ * Devuelve la proxima linea de *buff (sin el \n) y avanza *buff, NULL si no quedan
+ */
+char * next_line(char ** buff);
+
 #endif //TP_ADMIN_RESP_H
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "admin_watch.h"
+
+#define WATCH_PORT 1101
+
+int run_watch(client_info client){
+    const int server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(server < 0){
+        perror("Unable to create TCP socket");
+        return 1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(WATCH_PORT);
+    if(connect(server, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+        perror("Unable to connect to the admin TCP port");
+        close(server);
+        return 1;
+    }
+    FILE * in = fdopen(server, "r");
+    if(in == NULL){
+        perror("Unable to read from server");
+        close(server);
+        return 1;
+    }
+    char request[TOKEN_SIZE + 64];
+    int len = snprintf(request, sizeof(request), "AUTH %s\nSUBSCRIBE %ld\n", client->token, client->watch_interval);
+    if(send(server, request, len, MSG_NOSIGNAL) != len){
+        perror("Error sending request to server");
+        fclose(in);
+        return 1;
+    }
+
+    int ret = 0;
+    char * line = NULL;
+    size_t line_size = 0;
+    //primero las respuestas a AUTH y SUBSCRIBE, despues las lineas STATS
+    int pending_answers = 2;
+    while(getline(&line, &line_size, in) != -1){
+        if(pending_answers > 0){
+            pending_answers--;
+            if(line[0] == '-'){
+                printf("%s", line);
+                ret = 1;
+                break;
+            }
+            continue;
+        }
+        printf("%s", line);
+        fflush(stdout);
+    }
+    free(line);
+    fclose(in);
+    return ret;
+}
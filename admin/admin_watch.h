@@ -0,0 +1,13 @@
+#ifndef TP_ADMIN_WATCH_H
+#define TP_ADMIN_WATCH_H
+
+#include "utils.h"
+
+/*
+ * Se conecta al canal TCP de administracion, se suscribe a las estadisticas cada client->watch_interval
+ * milisegundos e imprime cada linea hasta que el servidor cierre la conexion
+ * Retorna 0 si termino normalmente, 1 si hubo un error
+ */
+int run_watch(client_info client);
+
+#endif //TP_ADMIN_WATCH_H
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include "admin_args.h"
 #include "admin_resp.h"
+#include "admin_bulk.h"
+#include "admin_watch.h"
 #include <netinet/in.h>
 #include <string.h>
 #include <sys/time.h>
@@ -9,9 +11,24 @@
 
 #define PORT 1024
 
-char * commands_names_mio[STAT_BYTES_TRANSFERRED+1] = {"ADD_USER", "CHANGE_PASS", "REMOVE_USER", "GET_MAX_MAILS", "SET_MAX_MAILS", "GET_MAILDIR", "SET_MAILDIR","STAT_HISTORIC_CONNECTIONS", "STAT_CURRENT_CONNECTIONS", "STAT_BYTES_TRANSFERRED"};
+char * commands_names_mio[STAT_LOOP+1] = {"ADD_USER", "CHANGE_PASS", "REMOVE_USER", "GET_MAX_MAILS", "SET_MAX_MAILS", "GET_MAILDIR", "SET_MAILDIR","STAT_HISTORIC_CONNECTIONS", "STAT_CURRENT_CONNECTIONS", "STAT_BYTES_TRANSFERRED", "STAT_EXPUNGE_LATENCY", "STAT_MAILDIR_SCAN", "STAT_LOGGER", "STAT_LATENCY", "BULK_BEGIN", "BULK_ADD", "BULK_COMMIT", "STAT_LOOP"};
 
 
+static void send_request(int server, const char * request, size_t len, struct sockaddr_in * addr, unsigned int addrlen){
+    if (sendto(server, request, len, MSG_NOSIGNAL, (struct sockaddr*) addr, addrlen) < 0){
+        perror("Error sending request to server");
+    }
+}
+
+static bool pending_commands(client_info client){
+    for(int i=0; i < client->count_commans; i++){
+        if(client->list_command[i].timeout){
+            return true;
+        }
+    }
+    return false;
+}
+
 int main(int argc, const char* argv[]){
     client_info client = malloc(sizeof(struct status_client));
     if(client == NULL || errno == ENOMEM){
@@ -39,11 +56,21 @@ int main(int argc, const char* argv[]){
 
     parse_args(argc, argv, client);
 
+    //Mandamos todos los comandos en la menor cantidad de datagramas (version 2 del protocolo)
+    char request[BATCH_DGRAM_SIZE];
+    int header_len = snprintf(request, BATCH_DGRAM_SIZE, "%s\n%s\n%s\n", client->name_protocol, client->version, client->token);
+    size_t len = header_len;
     for(int i=0; i < client->count_commans; i++ ){
-        //Logica de enviar las cosas
-        if (sendto(server, (const char*) client->list_command[i].request, DGRAM_SIZE, MSG_NOSIGNAL, (struct sockaddr*) &addr, addrlen) < 0){
-            perror("Error sending request %d to server");
+        size_t command_len = strlen(client->list_command[i].request);
+        if(len + command_len >= BATCH_DGRAM_SIZE){
+            send_request(server, request, len, &addr, addrlen);
+            len = header_len;
         }
+        memcpy(request + len, client->list_command[i].request, command_len);
+        len += command_len;
+    }
+    if(len > (size_t) header_len){
+        send_request(server, request, len, &addr, addrlen);
     }
 
     struct sockaddr_storage fromAddr; // Source address of server
@@ -57,10 +84,14 @@ int main(int argc, const char* argv[]){
     }
     //PROTOS 1 0 + 123
     //char buff[4][DGRAM_SIZE] = {"PROTOS\n1\n3\n+\n123\n\n", "PROTOS\n1\n1\n+\n\n", "PROTOX\n1\n3\n+\nSalida\n\n", "PROTOS\n1\n3\n-\n\n"};
-    char buff[DGRAM_SIZE];
-    for(int i=0; i<client->count_commans ; i++){
-        //Logica de recibir cosas
-        recvfrom(server, (char *) buff, DGRAM_SIZE, 0, (struct sockaddr *) &fromAddr, &fromAddrLen);
+    char buff[BATCH_DGRAM_SIZE + 1];
+    while(pending_commands(client)){
+        //Logica de recibir cosas, cada datagrama puede responder varios comandos
+        ssize_t read_count = recvfrom(server, (char *) buff, BATCH_DGRAM_SIZE, 0, (struct sockaddr *) &fromAddr, &fromAddrLen);
+        if(read_count <= 0){
+            break;
+        }
+        buff[read_count] = '\0';
         parse_resp(buff, client);
     }
     for(int i=0; i<client->count_commans ; i++){
@@ -70,7 +101,16 @@ int main(int argc, const char* argv[]){
         }
     }
 
+    int ret = 0;
+    if(client->bulk_file != NULL){
+        ret = run_bulk(server, &addr, addrlen, client);
+    }
+    if(ret == 0 && client->watch_interval > 0){
+        ret = run_watch(client);
+    }
+
     free(client);
+    return ret;
 }
 
 
@@ -78,5 +118,7 @@ void version_init( client_info client){
     client->version = VERSION;
     client->name_protocol = NAME;
     client->command_names = commands_names_mio;
+    client->bulk_file = NULL;
+    client->watch_interval = 0;
 }
 
@@ -6,10 +6,12 @@
 
 #define MAX_COMMANDS 50
 #define DGRAM_SIZE 1024
+#define BATCH_DGRAM_SIZE 8192 //en la version 2 del protocolo van todos los comandos en un datagrama
 #define MAX_LINES 10
-#define MAX_LINES_RESP 7
 #define OK_TEXT "+"
-#define VERSION "1"
+#define VERSION "2"
+#define TOKEN_SIZE 50
+#define TOKEN_SCANF_WIDTH "49"
 #define NAME "PROTOS"
 
 typedef enum{
@@ -23,6 +25,14 @@ typedef enum{
     STAT_PREVIOUS_CONNECTIONS,
     STAT_CURRENT_CONNECTIONS,
     STAT_BYTES_TRANSFERRED,
+    STAT_EXPUNGE_LATENCY,
+    STAT_MAILDIR_SCAN,
+    STAT_LOGGER,
+    STAT_LATENCY,
+    BULK_BEGIN,
+    BULK_ADD,
+    BULK_COMMIT,
+    STAT_LOOP,
 }admin_command;
 
 struct command{
@@ -39,6 +49,9 @@ struct status_client{
     char ** command_names;
     struct command list_command[MAX_COMMANDS];
     int count_commans;
+    char token[TOKEN_SIZE];
+    const char * bulk_file;
+    long watch_interval; //en milisegundos, 0 si no se pidio -W
 };
 
 typedef struct status_client * client_info;
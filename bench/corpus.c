@@ -0,0 +1,391 @@
+/*
+ * maildir_corpus - genera un arbol de maildirs sinteticos con una forma controlada
+ *
+ * Crea <dir>/<usuario>/{cur,new,tmp} para cada usuario (el layout que espera usersADT_get_user_mail_path),
+ * con una cantidad de mails y tamaños sacados de distribuciones configurables y una fraccion de mails con
+ * lineas que empiezan con '.' (para ejercitar el byte stuffing de RETR). Con la misma semilla el arbol
+ * generado es identico, incluidos los nombres de los archivos
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "../server/timing.h"
+#include "rng.h"
+
+#define DEFAULT_USERS 10
+#define DEFAULT_MAILS "20-200"
+#define DEFAULT_SIZES "log:8K:1.5"
+#define DEFAULT_MIN_SIZE "1K"
+#define DEFAULT_MAX_SIZE "50M"
+#define DEFAULT_DOT_FRACTION 0.1
+#define DEFAULT_PASS "pass"
+#define BASE_TIME 1700000000L // fijo para que los nombres no dependan de cuando se genera
+#define WRITE_BUFFER_SIZE 65536
+#define PATH_SIZE 4096
+#define MAX_LINE 76
+#define DOT_LINE_PROBABILITY 0.05 // de cada linea del cuerpo, en los mails con lineas con '.'
+#define PI 3.14159265358979323846
+
+typedef enum {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_EXPONENTIAL,
+    DIST_LOGNORMAL
+} distribution_type;
+
+/*
+ * N fijo, A-B uniforme, exp:MEDIA exponencial, log:MEDIANA:SIGMA lognormal
+ * Los tamaños aceptan sufijos K, M y G (potencias de 1024)
+ */
+struct distribution {
+    distribution_type type;
+    double a, b;
+};
+
+struct writer {
+    int fd;
+    char buff[WRITE_BUFFER_SIZE];
+    size_t len;
+    bool error;
+};
+
+static const char * words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+    "incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua", "enim", "ad", "minim", "veniam", "quis", "nostrud",
+    "exercitation", "ullamco", "laboris", "nisi", "aliquip", "ex", "ea", "commodo", "consequat", "mail", "server",
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+// Lineas con '.' al principio: la que sola terminaria el mail, una que ya parece escapada y una comun
+static const char * dot_lines[] = {".", "..", ".signature follows", "...and then"};
+#define DOT_LINE_COUNT (sizeof(dot_lines) / sizeof(dot_lines[0]))
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Argumentos
+ * --------------------------------------------------------------------------------------
+ */
+static double size_value(const char * s, const char * spec) {
+    char * end;
+    errno = 0;
+    double value = strtod(s, &end);
+    if(end == s || errno != 0 || value < 0) {
+        fprintf(stderr, "Invalid number in '%s'\n", spec);
+        exit(1);
+    }
+    switch(*end) {
+        case 'K': case 'k': value *= 1024; end++; break;
+        case 'M': case 'm': value *= 1024 * 1024; end++; break;
+        case 'G': case 'g': value *= 1024.0 * 1024 * 1024; end++; break;
+        default: break;
+    }
+    if(*end != '\0' && *end != ':' && *end != '-') {
+        fprintf(stderr, "Invalid number in '%s'\n", spec);
+        exit(1);
+    }
+    return value;
+}
+
+static struct distribution parse_distribution(const char * spec) {
+    struct distribution d = {0};
+    const char * dash = strchr(spec, '-');
+    if(strncasecmp(spec, "exp:", 4) == 0) {
+        d.type = DIST_EXPONENTIAL;
+        d.a = size_value(spec + 4, spec);
+    } else if(strncasecmp(spec, "log:", 4) == 0) {
+        const char * sigma = strchr(spec + 4, ':');
+        if(sigma == NULL) {
+            fprintf(stderr, "Expected log:<median>:<sigma>, got '%s'\n", spec);
+            exit(1);
+        }
+        d.type = DIST_LOGNORMAL;
+        d.a = size_value(spec + 4, spec);
+        d.b = size_value(sigma + 1, spec);
+        if(d.a <= 0) {
+            fprintf(stderr, "The median must be positive: '%s'\n", spec);
+            exit(1);
+        }
+    } else if(dash != NULL) {
+        d.type = DIST_UNIFORM;
+        d.a = size_value(spec, spec);
+        d.b = size_value(dash + 1, spec);
+        if(d.b < d.a) {
+            fprintf(stderr, "Invalid range '%s'\n", spec);
+            exit(1);
+        }
+    } else {
+        d.type = DIST_FIXED;
+        d.a = size_value(spec, spec);
+    }
+    return d;
+}
+
+static double sample(const struct distribution * d, uint64_t * rng) {
+    switch(d->type) {
+        case DIST_UNIFORM:
+            return d->a + floor(rng_double(rng) * (d->b - d->a + 1));
+        case DIST_EXPONENTIAL:
+            return -log1p(-rng_double(rng)) * d->a;
+        case DIST_LOGNORMAL: {
+            // Box-Muller; 1 - u para no tomar log(0)
+            double u1 = 1 - rng_double(rng), u2 = rng_double(rng);
+            double normal = sqrt(-2 * log(u1)) * cos(2 * PI * u2);
+            return d->a * exp(d->b * normal);
+        }
+        default:
+            return d->a;
+    }
+}
+
+static double fraction(const char * s) {
+    char * end;
+    double value = strtod(s, &end);
+    if(end == s || *end != '\0' || value < 0 || value > 1) {
+        fprintf(stderr, "Expected a fraction between 0 and 1: '%s'\n", s);
+        exit(1);
+    }
+    return value;
+}
+
+static unsigned long number(const char * s) {
+    char * end = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+    if(end == s || '\0' != *end || ((LONG_MIN == sl || LONG_MAX == sl) && ERANGE == errno) || sl < 0) {
+        fprintf(stderr, "Expected a non negative number: '%s'\n", s);
+        exit(1);
+    }
+    return (unsigned long) sl;
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Escritura de los mails
+ * --------------------------------------------------------------------------------------
+ */
+static void writer_flush(struct writer * w) {
+    size_t written = 0;
+    while(written < w->len && !w->error) {
+        ssize_t n = write(w->fd, w->buff + written, w->len - written);
+        if(n <= 0) {
+            w->error = true;
+        } else {
+            written += n;
+        }
+    }
+    w->len = 0;
+}
+
+static void writer_put(struct writer * w, const char * data, size_t len) {
+    while(len > 0) {
+        size_t chunk = WRITE_BUFFER_SIZE - w->len < len ? WRITE_BUFFER_SIZE - w->len : len;
+        memcpy(w->buff + w->len, data, chunk);
+        w->len += chunk;
+        data += chunk;
+        len -= chunk;
+        if(w->len == WRITE_BUFFER_SIZE) {
+            writer_flush(w);
+        }
+    }
+}
+
+/*
+ * Arma una linea de texto (sin \r\n) de a lo sumo max caracteres
+ */
+static size_t body_line(char * line, size_t max, uint64_t * rng) {
+    size_t len = 0;
+    size_t target = 20 + rng_next(rng) % (MAX_LINE - 20);
+    if(target > max) {
+        target = max;
+    }
+    while(len < target) {
+        const char * word = words[rng_next(rng) % WORD_COUNT];
+        size_t word_len = strlen(word);
+        if(len > 0) {
+            line[len++] = ' ';
+        }
+        for(size_t i = 0; i < word_len && len < target; i++) {
+            line[len++] = word[i];
+        }
+    }
+    return len;
+}
+
+/*
+ * Escribe un mail de exactamente size bytes (encabezados, lineas de texto y \r\n al final de cada una)
+ */
+static void write_mail(struct writer * w, size_t size, size_t number, const char * user, bool dot_lines_enabled, uint64_t * rng) {
+    char line[PATH_SIZE];
+    int header_len = snprintf(line, sizeof(line),
+        "From: sender%zu@example.com\r\nTo: %s@example.com\r\nSubject: Synthetic mail %zu\r\n"
+        "Date: Tue, 14 Nov 2023 22:13:20 +0000\r\nMessage-ID: <%zu.%s@popcorpus>\r\n\r\n",
+        number % 97, user, number, number, user);
+    size_t remaining = size;
+    if((size_t) header_len <= remaining) {
+        writer_put(w, line, header_len);
+        remaining -= header_len;
+    }
+    while(remaining > 0) {
+        if(remaining <= 2) {
+            writer_put(w, "\r\n", remaining);
+            break;
+        }
+        size_t len;
+        if(dot_lines_enabled && rng_double(rng) < DOT_LINE_PROBABILITY) {
+            const char * dot = dot_lines[rng_next(rng) % DOT_LINE_COUNT];
+            len = strlen(dot) < remaining - 2 ? strlen(dot) : remaining - 2;
+            memcpy(line, dot, len);
+        } else {
+            len = body_line(line, remaining - 2, rng);
+        }
+        line[len++] = '\r';
+        line[len++] = '\n';
+        writer_put(w, line, len);
+        remaining -= len;
+    }
+    writer_flush(w);
+}
+
+static bool make_dir(const char * path) {
+    if(mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char * progname) {
+    fprintf(stderr,
+        "Usage: %s [OPTION]... -o <dir>\n"
+        "\n"
+        "   -h               Ayuda.\n"
+        "   -o <dir>         Directorio donde se crean los maildirs (se pasa al servidor con -d).\n"
+        "   -u <users>       Cantidad de usuarios (user0, user1, ...). Default: %d.\n"
+        "   -p <pass>        Contraseña de todos los usuarios. Default: %s.\n"
+        "   -m <dist>        Mails por usuario. Default: %s.\n"
+        "   -s <dist>        Tamaño de cada mail. Default: %s.\n"
+        "   -l <size>        Tamaño minimo de un mail. Default: %s.\n"
+        "   -L <size>        Tamaño maximo de un mail. Default: %s.\n"
+        "   -D <fraction>    Fraccion de mails con lineas que empiezan con '.'. Default: %g.\n"
+        "   -n <fraction>    Fraccion de mails que van en new/ en lugar de cur/. Default: 0.\n"
+        "   -U <file>        Escribir los usuarios (<name>:<pass> por linea) en el archivo.\n"
+        "   -r <seed>        Semilla. Default: 1.\n"
+        "\n"
+        "Distribuciones: N (fijo), A-B (uniforme), exp:MEDIA (exponencial), log:MEDIANA:SIGMA (lognormal).\n"
+        "Los tamaños aceptan los sufijos K, M y G.\n"
+        "\n",
+        progname, DEFAULT_USERS, DEFAULT_PASS, DEFAULT_MAILS, DEFAULT_SIZES, DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE, DEFAULT_DOT_FRACTION);
+}
+
+int main(int argc, char * const argv[]) {
+    const char * dir = NULL, * pass = DEFAULT_PASS, * users_file = NULL;
+    unsigned long users = DEFAULT_USERS, seed = 1;
+    struct distribution mails = parse_distribution(DEFAULT_MAILS), sizes = parse_distribution(DEFAULT_SIZES);
+    double min_size = size_value(DEFAULT_MIN_SIZE, DEFAULT_MIN_SIZE), max_size = size_value(DEFAULT_MAX_SIZE, DEFAULT_MAX_SIZE);
+    double dot_fraction = DEFAULT_DOT_FRACTION, new_fraction = 0;
+    int c;
+    while((c = getopt(argc, argv, "ho:u:p:m:s:l:L:D:n:U:r:")) != -1) {
+        switch(c) {
+            case 'o': dir = optarg; break;
+            case 'u': users = number(optarg); break;
+            case 'p': pass = optarg; break;
+            case 'm': mails = parse_distribution(optarg); break;
+            case 's': sizes = parse_distribution(optarg); break;
+            case 'l': min_size = size_value(optarg, optarg); break;
+            case 'L': max_size = size_value(optarg, optarg); break;
+            case 'D': dot_fraction = fraction(optarg); break;
+            case 'n': new_fraction = fraction(optarg); break;
+            case 'U': users_file = optarg; break;
+            case 'r': seed = number(optarg); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(dir == NULL || max_size < min_size) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(!make_dir(dir)) {
+        return 1;
+    }
+    FILE * users_out = NULL;
+    if(users_file != NULL && (users_out = fopen(users_file, "w")) == NULL) {
+        perror(users_file);
+        return 1;
+    }
+    struct writer * w = malloc(sizeof(struct writer));
+    if(w == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    uint64_t start = timing_now_us();
+    unsigned long long total_mails = 0, total_bytes = 0, dot_mails = 0, new_mails = 0;
+    size_t biggest = 0;
+    char path[PATH_SIZE], user[64];
+    int ret = 0;
+    for(unsigned long u = 0; u < users && ret == 0; u++) {
+        // Cada usuario tiene su propio generador, asi cambiar -u no cambia los mails de los primeros usuarios
+        uint64_t rng;
+        rng_seed(&rng, seed * 1000003u + u);
+        snprintf(user, sizeof(user), "user%lu", u);
+        if(users_out != NULL) {
+            fprintf(users_out, "%s:%s\n", user, pass);
+        }
+        static const char * subdirs[] = {"", "/cur", "/new", "/tmp"};
+        for(size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]) && ret == 0; i++) {
+            snprintf(path, sizeof(path), "%s/%s%s", dir, user, subdirs[i]);
+            ret = make_dir(path) ? 0 : 1;
+        }
+        double count = sample(&mails, &rng);
+        size_t mail_count = count < 0 ? 0 : (size_t) count;
+        for(size_t m = 0; m < mail_count && ret == 0; m++) {
+            double s = sample(&sizes, &rng);
+            size_t size = (size_t) (s < min_size ? min_size : s > max_size ? max_size : s);
+            bool dots = rng_double(&rng) < dot_fraction;
+            bool is_new = rng_double(&rng) < new_fraction;
+            // Maildir++: en new/ no va la parte de flags
+            snprintf(path, sizeof(path), "%s/%s/%s/%ld.M%zuP0.popcorpus,S=%zu%s", dir, user, is_new ? "new" : "cur",
+                     BASE_TIME + (long) m, m, size, is_new ? "" : ":2,");
+            w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(w->fd == -1) {
+                perror(path);
+                ret = 1;
+                break;
+            }
+            w->len = 0;
+            w->error = false;
+            write_mail(w, size, m, user, dots, &rng);
+            close(w->fd);
+            if(w->error) {
+                perror(path);
+                ret = 1;
+            }
+            total_mails++;
+            total_bytes += size;
+            dot_mails += dots;
+            new_mails += is_new;
+            biggest = size > biggest ? size : biggest;
+        }
+    }
+    double elapsed = (timing_now_us() - start) / 1e6;
+    printf("%lu users, %llu mails (%llu with dot lines, %llu in new/), %.2f MiB, biggest %zu bytes, %.2f s\n",
+           users, total_mails, dot_mails, new_mails, total_bytes / 1048576.0, biggest, elapsed);
+
+    free(w);
+    if(users_out != NULL) {
+        fclose(users_out);
+    }
+    return ret;
+}
@@ -0,0 +1,591 @@
+/*
+ * loadgen - generador de carga POP3 de lazo cerrado
+ *
+ * Cada hilo abre una sesion, se autentica, manda una mezcla configurable de STAT/LIST/RETR/DELE/NOOP
+ * (de a varios comandos juntos si se pide pipelining), espera las respuestas y recien ahi sigue; al final
+ * hace RSET (para no borrar el maildir) y QUIT, y abre otra. Mide la latencia de cada comando desde que
+ * se manda hasta que llega el final de su respuesta, y la del login desde el connect hasta el +OK del PASS
+ *
+ * El servidor no deja que un usuario tenga dos sesiones a la vez, asi que cada hilo usa siempre el mismo
+ * usuario (el hilo i usa el usuario i modulo la cantidad de usuarios)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../server/histogram.h"
+#include "../server/timing.h"
+#include "rng.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "1100"
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION 10
+#define DEFAULT_COMMANDS 10
+#define DEFAULT_PIPELINE 1
+#define DEFAULT_MIX "stat=1,list=1,retr=4,dele=1"
+#define MAX_USERS 4096
+#define MAX_PIPELINE 64
+#define READ_BUFFER_SIZE 65536
+#define COMMAND_LINE_SIZE 64
+
+typedef enum {
+    CMD_STAT,
+    CMD_LIST,
+    CMD_RETR,
+    CMD_DELE,
+    CMD_NOOP,
+    CMD_COUNT
+} command_type;
+
+static const char * command_names[CMD_COUNT] = {"STAT", "LIST", "RETR", "DELE", "NOOP"};
+// LIST sin argumento y RETR responden en varias lineas (si dan +OK)
+static const bool command_multiline[CMD_COUNT] = {false, true, true, false, false};
+
+struct user {
+    char * name;
+    char * pass;
+};
+
+struct config {
+    const char * host;
+    const char * port;
+    size_t threads;
+    unsigned long duration;       // segundos, 0 si se limita por sesiones
+    unsigned long sessions;       // total de sesiones, 0 si se limita por tiempo
+    unsigned long commands;       // comandos por sesion
+    unsigned long pipeline;
+    unsigned long think_ms;       // promedio de la espera entre tandas de comandos
+    unsigned long seed;
+    bool keep_deletes;            // no mandar RSET antes del QUIT
+    unsigned weights[CMD_COUNT];
+    unsigned total_weight;
+    struct user users[MAX_USERS];
+    size_t user_count;
+    struct addrinfo * addr;
+};
+
+struct worker {
+    pthread_t thread;
+    size_t id;
+    const struct config * config;
+    uint64_t rng;
+    struct histogram latency[CMD_COUNT];
+    struct histogram login;
+    unsigned long sessions;
+    unsigned long commands;
+    unsigned long err_responses;
+    unsigned long failures;
+    unsigned long long bytes;
+};
+
+// Lector con buffer de una conexion
+struct connection {
+    int fd;
+    char buff[READ_BUFFER_SIZE];
+    size_t start, end;
+    bool partial; // la ultima linea devuelta no termino (no puede ser el "." final)
+    unsigned long long bytes;
+};
+
+static atomic_ulong started_sessions;
+static atomic_bool stop = false;
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Utilidades
+ * --------------------------------------------------------------------------------------
+ */
+static unsigned long number(const char * s, bool allow_zero) {
+    char * end = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+    if(end == s || '\0' != *end || ((LONG_MIN == sl || LONG_MAX == sl) && ERANGE == errno) || sl < 0 || (sl == 0 && !allow_zero)) {
+        fprintf(stderr, "Expected a %s number: '%s'\n", allow_zero ? "non negative" : "positive", s);
+        exit(1);
+    }
+    return (unsigned long) sl;
+}
+
+static void sleep_ms(double ms) {
+    if(ms <= 0) {
+        return;
+    }
+    struct timespec ts = {.tv_sec = (time_t) (ms / 1000), .tv_nsec = (long) ((ms - (time_t) (ms / 1000) * 1000) * 1e6)};
+    while(nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static void add_user(struct config * config, const char * spec) {
+    if(config->user_count == MAX_USERS) {
+        fprintf(stderr, "Too many users, maximum is %d\n", MAX_USERS);
+        exit(1);
+    }
+    const char * sep = strchr(spec, ':');
+    if(sep == NULL || sep == spec) {
+        fprintf(stderr, "Invalid user '%s', expected <name>:<pass>\n", spec);
+        exit(1);
+    }
+    struct user * user = config->users + config->user_count++;
+    user->name = strndup(spec, sep - spec);
+    user->pass = strdup(sep + 1);
+    if(user->name == NULL || user->pass == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+static void read_users_file(struct config * config, const char * path) {
+    FILE * file = fopen(path, "r");
+    if(file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char * line = NULL;
+    size_t size = 0;
+    while(getline(&line, &size, file) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] != '\0' && line[0] != '#') {
+            add_user(config, line);
+        }
+    }
+    free(line);
+    fclose(file);
+}
+
+static void parse_mix(struct config * config, const char * spec) {
+    char * copy = strdup(spec);
+    if(copy == NULL) {
+        exit(1);
+    }
+    memset(config->weights, 0, sizeof(config->weights));
+    config->total_weight = 0;
+    char * save;
+    for(char * item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char * value = strchr(item, '=');
+        if(value == NULL) {
+            fprintf(stderr, "Invalid mix entry '%s', expected <command>=<weight>\n", item);
+            exit(1);
+        }
+        *value++ = '\0';
+        size_t cmd;
+        for(cmd = 0; cmd < CMD_COUNT && strcasecmp(item, command_names[cmd]) != 0; cmd++);
+        if(cmd == CMD_COUNT) {
+            fprintf(stderr, "Unknown command in mix: '%s'\n", item);
+            exit(1);
+        }
+        config->weights[cmd] = (unsigned) number(value, true);
+        config->total_weight += config->weights[cmd];
+    }
+    free(copy);
+    if(config->total_weight == 0) {
+        fprintf(stderr, "The command mix has no weight\n");
+        exit(1);
+    }
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Conexion
+ * --------------------------------------------------------------------------------------
+ */
+static int connect_server(const struct config * config) {
+    for(struct addrinfo * a = config->addr; a != NULL; a = a->ai_next) {
+        int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if(fd == -1) {
+            continue;
+        }
+        if(connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+static bool send_all(struct connection * conn, const char * data, size_t len) {
+    while(len > 0) {
+        ssize_t sent = send(conn->fd, data, len, MSG_NOSIGNAL);
+        if(sent <= 0) {
+            if(sent == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+/*
+ * Devuelve la proxima linea (sin \r\n) en *line. Si no entra en el buffer, devuelve un pedazo y marca partial
+ * Retorna false si se cerro la conexion o hubo un error
+ */
+static bool read_line(struct connection * conn, char ** line, size_t * len, bool * line_start) {
+    *line_start = !conn->partial;
+    while(true) {
+        char * begin = conn->buff + conn->start;
+        char * nl = memchr(begin, '\n', conn->end - conn->start);
+        if(nl != NULL) {
+            *line = begin;
+            *len = nl - begin;
+            if(*len > 0 && begin[*len - 1] == '\r') {
+                (*len)--;
+            }
+            conn->start = nl - conn->buff + 1;
+            conn->partial = false;
+            return true;
+        }
+        if(conn->start > 0) {
+            memmove(conn->buff, begin, conn->end - conn->start);
+            conn->end -= conn->start;
+            conn->start = 0;
+        }
+        if(conn->end == READ_BUFFER_SIZE) {
+            *line = conn->buff;
+            *len = conn->end;
+            conn->start = conn->end = 0;
+            conn->partial = true;
+            return true;
+        }
+        ssize_t n = recv(conn->fd, conn->buff + conn->end, READ_BUFFER_SIZE - conn->end, 0);
+        if(n <= 0) {
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        conn->end += n;
+        conn->bytes += n;
+    }
+}
+
+/*
+ * Lee una respuesta completa. Retorna 1 si fue +OK, 0 si fue -ERR y -1 si se corto la conexion
+ */
+static int read_response(struct connection * conn, bool multiline) {
+    char * line;
+    size_t len;
+    bool line_start;
+    if(!read_line(conn, &line, &len, &line_start)) {
+        return -1;
+    }
+    if(len < 3 || strncmp(line, "+OK", 3) != 0) {
+        return 0;
+    }
+    if(multiline) {
+        do {
+            if(!read_line(conn, &line, &len, &line_start)) {
+                return -1;
+            }
+        } while(!(line_start && !conn->partial && len == 1 && line[0] == '.'));
+    }
+    return 1;
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Sesiones
+ * --------------------------------------------------------------------------------------
+ */
+static command_type pick_command(struct worker * w) {
+    unsigned r = (unsigned) (rng_next(&w->rng) % w->config->total_weight);
+    for(size_t cmd = 0; cmd < CMD_COUNT; cmd++) {
+        if(r < w->config->weights[cmd]) {
+            return (command_type) cmd;
+        }
+        r -= w->config->weights[cmd];
+    }
+    return CMD_NOOP;
+}
+
+static bool simple_command(struct worker * w, struct connection * conn, const char * command, bool multiline, int * status) {
+    if(!send_all(conn, command, strlen(command))) {
+        return false;
+    }
+    *status = read_response(conn, multiline);
+    return *status != -1;
+}
+
+static void run_session(struct worker * w, struct connection * conn) {
+    const struct config * config = w->config;
+    const struct user * user = config->users + w->id % config->user_count;
+    char line[COMMAND_LINE_SIZE * MAX_PIPELINE];
+    int status;
+
+    uint64_t start = timing_now_us();
+    conn->fd = connect_server(config);
+    conn->start = conn->end = 0;
+    conn->partial = false;
+    if(conn->fd == -1) {
+        w->failures++;
+        sleep_ms(10);
+        return;
+    }
+    if(read_response(conn, false) != 1) {
+        goto fail;
+    }
+    snprintf(line, sizeof(line), "USER %s\r\n", user->name);
+    if(!simple_command(w, conn, line, false, &status) || status != 1) {
+        goto fail;
+    }
+    snprintf(line, sizeof(line), "PASS %s\r\n", user->pass);
+    if(!simple_command(w, conn, line, false, &status) || status != 1) {
+        goto fail;
+    }
+    histogram_record(&w->login, timing_now_us() - start);
+
+    // Hace falta la cantidad de mails para elegir a cual hacerle RETR/DELE
+    if(!send_all(conn, "STAT\r\n", 6)) {
+        goto fail;
+    }
+    char * stat_line;
+    size_t stat_len;
+    bool line_start;
+    if(!read_line(conn, &stat_line, &stat_len, &line_start) || stat_len < 4 || strncmp(stat_line, "+OK", 3) != 0) {
+        goto fail;
+    }
+    unsigned long mails = strtoul(stat_line + 4, NULL, 10);
+
+    unsigned long remaining = config->commands;
+    command_type batch[MAX_PIPELINE];
+    while(remaining > 0 && !stop) {
+        size_t count = remaining < config->pipeline ? remaining : config->pipeline;
+        size_t len = 0;
+        for(size_t i = 0; i < count; i++) {
+            command_type cmd = pick_command(w);
+            if(mails == 0 && (cmd == CMD_RETR || cmd == CMD_DELE)) {
+                cmd = CMD_STAT;
+            }
+            batch[i] = cmd;
+            if(cmd == CMD_RETR || cmd == CMD_DELE) {
+                len += snprintf(line + len, sizeof(line) - len, "%s %lu\r\n", command_names[cmd],
+                                (unsigned long) (rng_next(&w->rng) % mails) + 1);
+            } else {
+                len += snprintf(line + len, sizeof(line) - len, "%s\r\n", command_names[cmd]);
+            }
+        }
+        uint64_t sent_at = timing_now_us();
+        if(!send_all(conn, line, len)) {
+            goto fail;
+        }
+        for(size_t i = 0; i < count; i++) {
+            // Un -ERR de LIST/RETR es una sola linea
+            status = read_response(conn, command_multiline[batch[i]]);
+            if(status == -1) {
+                goto fail;
+            }
+            histogram_record(&w->latency[batch[i]], timing_now_us() - sent_at);
+            w->commands++;
+            w->err_responses += status == 0;
+        }
+        remaining -= count;
+        if(config->think_ms > 0 && remaining > 0) {
+            // Exponencial con el promedio pedido, como llegadas de Poisson
+            sleep_ms(-log1p(-rng_double(&w->rng)) * config->think_ms);
+        }
+    }
+    if(!config->keep_deletes && (!simple_command(w, conn, "RSET\r\n", false, &status) || status != 1)) {
+        goto fail;
+    }
+    if(!simple_command(w, conn, "QUIT\r\n", false, &status)) {
+        goto fail;
+    }
+    w->sessions++;
+    w->bytes += conn->bytes;
+    conn->bytes = 0;
+    close(conn->fd);
+    return;
+
+fail:
+    w->failures++;
+    w->bytes += conn->bytes;
+    conn->bytes = 0;
+    close(conn->fd);
+    // Para no ciclar sin parar si el servidor rechaza todo
+    sleep_ms(1);
+}
+
+static void * worker_run(void * arg) {
+    struct worker * w = arg;
+    struct connection * conn = calloc(1, sizeof(struct connection));
+    if(conn == NULL) {
+        return NULL;
+    }
+    while(!stop) {
+        if(w->config->sessions != 0 && atomic_fetch_add(&started_sessions, 1) >= w->config->sessions) {
+            break;
+        }
+        run_session(w, conn);
+    }
+    free(conn);
+    return NULL;
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Reporte
+ * --------------------------------------------------------------------------------------
+ */
+static void print_row(const char * name, const struct histogram * h) {
+    if(h->count == 0) {
+        return;
+    }
+    printf("%-6s %10lu %10lu %10lu %10lu %10lu %10lu\n", name, (unsigned long) h->count, (unsigned long) histogram_mean(h),
+           (unsigned long) histogram_percentile(h, 50), (unsigned long) histogram_percentile(h, 90),
+           (unsigned long) histogram_percentile(h, 99), (unsigned long) h->max);
+}
+
+static void report(struct worker * workers, size_t threads, double elapsed) {
+    static struct histogram latency[CMD_COUNT], login, all;
+    unsigned long sessions = 0, commands = 0, err_responses = 0, failures = 0;
+    unsigned long long bytes = 0;
+    for(size_t i = 0; i < threads; i++) {
+        for(size_t cmd = 0; cmd < CMD_COUNT; cmd++) {
+            histogram_merge(&latency[cmd], &workers[i].latency[cmd]);
+            histogram_merge(&all, &workers[i].latency[cmd]);
+        }
+        histogram_merge(&login, &workers[i].login);
+        sessions += workers[i].sessions;
+        commands += workers[i].commands;
+        err_responses += workers[i].err_responses;
+        failures += workers[i].failures;
+        bytes += workers[i].bytes;
+    }
+    printf("duration: %.2f s, threads: %zu\n", elapsed, threads);
+    printf("sessions: %lu (%.1f/s), failed sessions: %lu\n", sessions, sessions / elapsed, failures);
+    printf("commands: %lu (%.1f/s), -ERR responses: %lu\n", commands, commands / elapsed, err_responses);
+    printf("received: %.2f MiB (%.2f MiB/s)\n\n", bytes / 1048576.0, bytes / 1048576.0 / elapsed);
+    printf("%-6s %10s %10s %10s %10s %10s %10s\n", "us", "count", "mean", "p50", "p90", "p99", "max");
+    print_row("LOGIN", &login);
+    for(size_t cmd = 0; cmd < CMD_COUNT; cmd++) {
+        print_row(command_names[cmd], &latency[cmd]);
+    }
+    print_row("ALL", &all);
+}
+
+static void usage(const char * progname) {
+    fprintf(stderr,
+        "Usage: %s [OPTION]... -u <name>:<pass> | -f <users file>\n"
+        "\n"
+        "   -h               Ayuda.\n"
+        "   -H <host>        Servidor. Default: %s.\n"
+        "   -p <port>        Puerto POP3. Default: %s.\n"
+        "   -u <name>:<pass> Usuario para las sesiones (se puede repetir; hace falta uno por hilo).\n"
+        "   -f <file>        Archivo con un <name>:<pass> por linea.\n"
+        "   -c <threads>     Sesiones concurrentes (un hilo cada una). Default: %d.\n"
+        "   -d <seconds>     Duracion de la prueba. Default: %d.\n"
+        "   -n <sessions>    Cantidad total de sesiones (en lugar de -d).\n"
+        "   -k <commands>    Comandos por sesion, sin contar login, STAT inicial, RSET y QUIT. Default: %d.\n"
+        "   -m <mix>         Pesos de cada comando. Default: %s (tambien noop).\n"
+        "   -P <depth>       Comandos que se mandan juntos antes de leer las respuestas. Default: %d.\n"
+        "   -t <ms>          Espera promedio (exponencial) entre tandas de comandos. Default: 0.\n"
+        "   -s <seed>        Semilla de los numeros al azar. Default: 1.\n"
+        "   -D               No mandar RSET antes del QUIT (los DELE borran mails de verdad).\n"
+        "\n",
+        progname, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_THREADS, DEFAULT_DURATION, DEFAULT_COMMANDS, DEFAULT_MIX, DEFAULT_PIPELINE);
+}
+
+int main(int argc, char * const argv[]) {
+    static struct config config = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .threads = DEFAULT_THREADS,
+        .duration = DEFAULT_DURATION,
+        .commands = DEFAULT_COMMANDS,
+        .pipeline = DEFAULT_PIPELINE,
+        .seed = 1,
+    };
+    parse_mix(&config, DEFAULT_MIX);
+    int c;
+    while((c = getopt(argc, argv, "hH:p:u:f:c:d:n:k:m:P:t:s:D")) != -1) {
+        switch(c) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = optarg; break;
+            case 'u': add_user(&config, optarg); break;
+            case 'f': read_users_file(&config, optarg); break;
+            case 'c': config.threads = number(optarg, false); break;
+            case 'd': config.duration = number(optarg, false); config.sessions = 0; break;
+            case 'n': config.sessions = number(optarg, false); config.duration = 0; break;
+            case 'k': config.commands = number(optarg, true); break;
+            case 'm': parse_mix(&config, optarg); break;
+            case 'P': config.pipeline = number(optarg, false); break;
+            case 't': config.think_ms = number(optarg, true); break;
+            case 's': config.seed = number(optarg, true); break;
+            case 'D': config.keep_deletes = true; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(config.user_count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(config.threads > config.user_count) {
+        fprintf(stderr, "Warning: %zu threads but %zu users, sessions of the same user will be rejected\n", config.threads, config.user_count);
+    }
+    if(config.pipeline > MAX_PIPELINE) {
+        fprintf(stderr, "Pipeline depth must be at most %d\n", MAX_PIPELINE);
+        return 1;
+    }
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int gai = getaddrinfo(config.host, config.port, &hints, &config.addr);
+    if(gai != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s: %s\n", config.host, config.port, gai_strerror(gai));
+        return 1;
+    }
+
+    struct worker * workers = calloc(config.threads, sizeof(struct worker));
+    if(workers == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    uint64_t start = timing_now_us();
+    size_t started = 0;
+    for(; started < config.threads; started++) {
+        struct worker * w = workers + started;
+        w->id = started;
+        w->config = &config;
+        rng_seed(&w->rng, config.seed * 1000003u + started);
+        if(pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+            fprintf(stderr, "Cannot create thread %zu\n", started);
+            stop = true;
+            break;
+        }
+    }
+    if(config.duration > 0) {
+        while(!stop && timing_now_us() - start < config.duration * 1000000u) {
+            sleep_ms(50);
+        }
+        stop = true;
+    }
+    for(size_t i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = (timing_now_us() - start) / 1e6;
+    report(workers, started, elapsed);
+
+    free(workers);
+    freeaddrinfo(config.addr);
+    for(size_t i = 0; i < config.user_count; i++) {
+        free(config.users[i].name);
+        free(config.users[i].pass);
+    }
+    return 0;
+}
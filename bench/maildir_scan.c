@@ -0,0 +1,123 @@
+/*
+ * maildir_scan - mide cuantas entradas por segundo lee el scanner de maildir del servidor
+ *
+ * Crea un maildir sintetico (por defecto de 100k mails) y lo lee varias veces con
+ * maildir_scan_open/step/finish, de a partes como lo hace el servidor en LOADING_MAILDIR
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../server/maidir_reader.h"
+#include "../server/timing.h"
+#include "synth.h"
+
+#define DEFAULT_ENTRIES 100000
+#define DEFAULT_SIZE 512
+#define DEFAULT_RUNS 5
+#define DEFAULT_CHUNK 256
+#define TMP_TEMPLATE "/tmp/popbench-XXXXXX"
+
+static size_t number(const char * s) {
+    char * end = 0;
+    const long sl = strtol(s, &end, 10);
+    if(end == s || '\0' != *end || ((LONG_MIN == sl || LONG_MAX == sl) && ERANGE == errno) || sl <= 0) {
+        fprintf(stderr, "Expected a positive number: '%s'\n", s);
+        exit(1);
+    }
+    return (size_t) sl;
+}
+
+static void usage(const char * progname) {
+    fprintf(stderr,
+        "Usage: %s [OPTION]...\n"
+        "\n"
+        "   -h               Ayuda.\n"
+        "   -n <entries>     Cantidad de mails del maildir sintetico. Default: %d.\n"
+        "   -s <bytes>       Tamaño de cada mail. Default: %d.\n"
+        "   -r <runs>        Cantidad de lecturas a medir. Default: %d.\n"
+        "   -c <chunk>       Entradas por paso del scanner. Default: %d.\n"
+        "   -d <path>        Usar un directorio existente en lugar de crear uno sintetico.\n"
+        "   -S               No usar el tamaño del nombre de los mails (,S=<size>), hacer siempre stat.\n"
+        "\n",
+        progname, DEFAULT_ENTRIES, DEFAULT_SIZE, DEFAULT_RUNS, DEFAULT_CHUNK);
+}
+
+int main(int argc, char * const argv[]) {
+    size_t entries = DEFAULT_ENTRIES, size = DEFAULT_SIZE, runs = DEFAULT_RUNS, chunk = DEFAULT_CHUNK;
+    const char * dir = NULL;
+    bool size_hints = true;
+    int c;
+    while((c = getopt(argc, argv, "hn:s:r:c:d:S")) != -1) {
+        switch(c) {
+            case 'n': entries = number(optarg); break;
+            case 's': size = number(optarg); break;
+            case 'r': runs = number(optarg); break;
+            case 'c': chunk = number(optarg); break;
+            case 'd': dir = optarg; break;
+            case 'S': size_hints = false; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    char tmp_dir[] = TMP_TEMPLATE;
+    bool synthetic = dir == NULL;
+    if(synthetic) {
+        if(mkdtemp(tmp_dir) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+        dir = tmp_dir;
+        printf("Creating %zu mails of %zu bytes in %s\n", entries, size, dir);
+        if(synth_create_mails(dir, entries, size) != 0) {
+            perror("Cannot create synthetic maildir");
+            synth_remove_dir(dir);
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    double best = 0, total = 0;
+    for(size_t run = 1; run <= runs; run++) {
+        uint64_t start = timing_now_us();
+        maildir_scanner * scanner = maildir_scan_open(dir, SIZE_MAX, size_hints);
+        if(scanner == NULL) {
+            fprintf(stderr, "Cannot open %s\n", dir);
+            ret = 1;
+            break;
+        }
+        maildir_scan_status status;
+        while((status = maildir_scan_step(scanner, chunk)) == MAILDIR_SCAN_PENDING);
+        if(status == MAILDIR_SCAN_ERROR) {
+            fprintf(stderr, "Error scanning %s\n", dir);
+            maildir_scan_close(scanner);
+            ret = 1;
+            break;
+        }
+        size_t hinted = maildir_scan_hinted(scanner);
+        size_t count = 0;
+        email * emails = maildir_scan_finish(scanner, &count);
+        uint64_t elapsed = timing_now_us() - start;
+        free_emails(emails, count);
+
+        double rate = elapsed == 0 ? 0 : count * 1e6 / elapsed;
+        best = rate > best ? rate : best;
+        total += rate;
+        printf("run %zu: %zu entries in %.3f ms (%.0f entries/s, %zu stats avoided)\n", run, count, elapsed / 1e3, rate, hinted);
+    }
+    if(ret == 0) {
+        printf("best: %.0f entries/s, avg: %.0f entries/s\n", best, total / runs);
+    }
+
+    if(synthetic) {
+        synth_remove_dir(dir);
+    }
+    return ret;
+}
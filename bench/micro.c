@@ -0,0 +1,370 @@
+/*
+ * micro - mide por separado las partes del camino caliente del servidor
+ *
+ *   parser     parser_feed con pop3_parser_definition, sobre un pipeline de comandos
+ *   stuffing   byte_stuffing_copy (el loop de RETR) sobre un mail con lineas que empiezan con '.'
+ *   buffer     buffer_write_ptr/write_adv/read_adv/compact como los usa el servidor entre recv y send
+ *   maildir    read_maildir sobre un maildir sintetico
+ *
+ * Cada benchmark se corre varias veces y se reporta la mejor y la mediana, en nanosegundos y en ciclos por
+ * operacion. En x86 los ciclos son del TSC (frecuencia nominal, no la real si hay turbo o escalado); en el resto
+ * de las arquitecturas no hay contador de ciclos y las columnas de ciclos quedan en nanosegundos
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include "../server/parser/parserADT.h"
+#include "../server/parser/parser_definition/pop3_parser_definition.h"
+#include "../server/stuffing.h"
+#include "../server/buffer.h"
+#include "../server/maidir_reader.h"
+#include "synth.h"
+
+#define DEFAULT_RUNS 7
+#define DEFAULT_SCALE 1
+#define DEFAULT_ENTRIES 1000
+#define MAX_RUNS 100
+#define CHUNK_SIZE 4096 //igual que BUFFER_SIZE del servidor
+#define PARSER_BYTES (1 << 20)
+#define STUFFING_BYTES (16 << 20)
+#define BUFFER_ROUNDS (1 << 20)
+#define MAILDIR_ROUNDS 20
+#define MAIL_SIZE 512
+#define TMP_TEMPLATE "/tmp/popmicro-XXXXXX"
+#define NS_PER_SECOND 1000000000ull
+
+#define PIPELINE "USER alice\r\nPASS secret\r\nSTAT\r\nLIST 3\r\nRETR 12\r\nDELE 12\r\nNOOP\r\nUIDL\r\n"
+#define MAIL_LINE "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\r\n"
+#define MAIL_DOT_LINE ".. escaped by the sender\r\n"
+#define MAIL_DOT_EVERY 8 //una de cada tantas lineas empieza con '.'
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Reloj
+ * --------------------------------------------------------------------------------------
+ */
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SECOND + (uint64_t) ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLES_SOURCE "rdtsc"
+static inline uint64_t now_cycles(void) {
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define CYCLES_SOURCE "clock_gettime"
+static inline uint64_t now_cycles(void) {
+    return now_ns();
+}
+#endif
+
+static double cycles_per_ns = 1.0;
+
+// Compara el contador de ciclos con el reloj durante un rato para poder pasar de uno al otro
+static void calibrate(void) {
+    uint64_t ns_start = now_ns(), cycles_start = now_cycles();
+    while(now_ns() - ns_start < NS_PER_SECOND / 10) {
+        ;
+    }
+    uint64_t ns = now_ns() - ns_start, cycles = now_cycles() - cycles_start;
+    cycles_per_ns = (double) cycles / (double) ns;
+}
+
+// Para que el compilador no descarte los resultados de lo que se mide
+static volatile uint64_t sink;
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Benchmarks
+ * --------------------------------------------------------------------------------------
+ */
+struct bench {
+    const char * name;
+    const char * unit;
+    bool (*setup)(size_t scale);
+    uint64_t (*run)(void); // retorna la cantidad de operaciones (unit) que hizo
+    void (*teardown)(void);
+};
+
+static uint8_t * parser_input;
+static size_t parser_input_len;
+static parserADT parser;
+
+static bool parser_setup(size_t scale) {
+    extern const parser_definition pop3_parser_definition;
+    size_t pipeline_len = strlen(PIPELINE);
+    parser_input_len = PARSER_BYTES * scale / pipeline_len * pipeline_len;
+    parser_input = malloc(parser_input_len);
+    parser = parser_init(&pop3_parser_definition);
+    if(parser_input == NULL || parser == NULL) {
+        return false;
+    }
+    for(size_t i = 0; i < parser_input_len; i += pipeline_len) {
+        memcpy(parser_input + i, PIPELINE, pipeline_len);
+    }
+    return true;
+}
+
+static uint64_t parser_run(void) {
+    uint64_t commands = 0;
+    for(size_t i = 0; i < parser_input_len; i++) {
+        parser_state state = parser_feed(parser, parser_input[i]);
+        if(state == PARSER_FINISHED || state == PARSER_ERROR) {
+            commands++;
+            parser_reset(parser);
+        }
+    }
+    sink += commands;
+    return parser_input_len;
+}
+
+static void parser_teardown(void) {
+    free(parser_input);
+    if(parser != NULL) {
+        parser_destroy(parser);
+    }
+}
+
+static uint8_t * mail;
+static size_t mail_len;
+static uint8_t stuffing_out[CHUNK_SIZE];
+
+static bool stuffing_setup(size_t scale) {
+    size_t line_len = strlen(MAIL_LINE), dot_len = strlen(MAIL_DOT_LINE);
+    mail_len = STUFFING_BYTES * scale;
+    mail = malloc(mail_len);
+    if(mail == NULL) {
+        return false;
+    }
+    size_t len = 0;
+    for(unsigned line = 0; len < mail_len; line++) {
+        const char * text = line % MAIL_DOT_EVERY == 0 ? MAIL_DOT_LINE : MAIL_LINE;
+        size_t text_len = line % MAIL_DOT_EVERY == 0 ? dot_len : line_len;
+        if(text_len > mail_len - len) {
+            text_len = mail_len - len;
+        }
+        memcpy(mail + len, text, text_len);
+        len += text_len;
+    }
+    return true;
+}
+
+// Como en RETR: el mail se lee de a CHUNK_SIZE y la salida se vacia cada vez que se llena
+static uint64_t stuffing_run(void) {
+    byte_stuffing_state flag = BYTE_STUFFING_LF;
+    uint64_t written = 0;
+    for(size_t offset = 0; offset < mail_len;) {
+        size_t chunk = mail_len - offset < CHUNK_SIZE ? mail_len - offset : CHUNK_SIZE;
+        size_t consumed = 0;
+        while(consumed < chunk) {
+            size_t used;
+            written += byte_stuffing_copy(stuffing_out, sizeof(stuffing_out), mail + offset + consumed,
+                                          chunk - consumed, &used, &flag);
+            consumed += used;
+        }
+        offset += chunk;
+    }
+    sink += written + stuffing_out[0];
+    return mail_len;
+}
+
+static void stuffing_teardown(void) {
+    free(mail);
+}
+
+static uint8_t buffer_data[CHUNK_SIZE];
+static buffer buffer_bench;
+
+static bool buffer_setup(size_t scale) {
+    buffer_init(&buffer_bench, sizeof(buffer_data), buffer_data);
+    return true;
+}
+
+/*
+ * Una ronda: se pide lugar, se "reciben" algunos bytes, se consume una parte (un comando) y se compacta,
+ * asi el memmove de buffer_compact mueve lo que quedo sin leer
+ */
+static uint64_t buffer_run(void) {
+    static const size_t received[] = {64, 1448, 7, 512, 2896, 33};
+    static const size_t consumed[] = {12, 700, 6, 900, 2000, 100};
+    const size_t n = sizeof(received) / sizeof(received[0]);
+    uint64_t total = 0;
+    buffer_reset(&buffer_bench);
+    for(size_t i = 0; i < BUFFER_ROUNDS; i++) {
+        size_t space;
+        uint8_t * ptr = buffer_write_ptr(&buffer_bench, &space);
+        size_t count = received[i % n] < space ? received[i % n] : space;
+        if(count > 0) {
+            ptr[0] = (uint8_t) i;
+        }
+        buffer_write_adv(&buffer_bench, (ssize_t) count);
+        size_t available;
+        buffer_read_ptr(&buffer_bench, &available);
+        size_t used = consumed[i % n] < available ? consumed[i % n] : available;
+        buffer_read_adv(&buffer_bench, (ssize_t) used);
+        buffer_compact(&buffer_bench);
+        total += used;
+    }
+    sink += total;
+    return BUFFER_ROUNDS;
+}
+
+static char maildir[] = TMP_TEMPLATE;
+static bool maildir_created = false;
+static size_t maildir_entries;
+
+static bool maildir_setup(size_t scale) {
+    maildir_entries = DEFAULT_ENTRIES * scale;
+    if(mkdtemp(maildir) == NULL) {
+        return false;
+    }
+    maildir_created = true;
+    return synth_create_mails(maildir, maildir_entries, MAIL_SIZE) == 0;
+}
+
+static uint64_t maildir_run(void) {
+    uint64_t read = 0;
+    for(int i = 0; i < MAILDIR_ROUNDS; i++) {
+        size_t size = maildir_entries;
+        email * emails = read_maildir(maildir, &size);
+        if(emails != NULL) {
+            read += size;
+            free_emails(emails, size);
+        }
+    }
+    sink += read;
+    return read;
+}
+
+static void maildir_teardown(void) {
+    if(maildir_created) {
+        synth_remove_dir(maildir);
+    }
+}
+
+static const struct bench benches[] = {
+    {"parser", "byte", parser_setup, parser_run, parser_teardown},
+    {"stuffing", "byte", stuffing_setup, stuffing_run, stuffing_teardown},
+    {"buffer", "round", buffer_setup, buffer_run, NULL},
+    {"maildir", "entry", maildir_setup, maildir_run, maildir_teardown},
+};
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Main
+ * --------------------------------------------------------------------------------------
+ */
+struct sample {
+    double ns;
+    double cycles;
+};
+
+static int compare_samples(const void * a, const void * b) {
+    double x = ((const struct sample *) a)->cycles, y = ((const struct sample *) b)->cycles;
+    return x < y ? -1 : x > y;
+}
+
+static bool run_bench(const struct bench * bench, size_t runs, size_t scale) {
+    struct sample samples[MAX_RUNS];
+    bool ok = bench->setup(scale);
+    if(!ok) {
+        fprintf(stderr, "%s: setup failed: %s\n", bench->name, strerror(errno));
+        goto finally;
+    }
+    bench->run(); // calienta caches y predictores
+    for(size_t i = 0; i < runs; i++) {
+        uint64_t ns_start = now_ns(), cycles_start = now_cycles();
+        uint64_t ops = bench->run();
+        uint64_t cycles = now_cycles() - cycles_start, ns = now_ns() - ns_start;
+        if(ops == 0) {
+            fprintf(stderr, "%s: nothing was measured\n", bench->name);
+            ok = false;
+            goto finally;
+        }
+        samples[i].ns = (double) ns / (double) ops;
+        samples[i].cycles = (double) cycles / (double) ops;
+    }
+    qsort(samples, runs, sizeof(samples[0]), compare_samples);
+    struct sample best = samples[0], median = samples[runs / 2];
+    printf("%-10s %-6s %12.2f %12.2f %12.2f %12.2f\n", bench->name, bench->unit,
+           best.ns, median.ns, best.cycles, median.cycles);
+
+finally:
+    if(bench->teardown != NULL) {
+        bench->teardown();
+    }
+    return ok;
+}
+
+static size_t number(const char * s, size_t max) {
+    char * end = 0;
+    const long sl = strtol(s, &end, 10);
+    if(end == s || '\0' != *end || ((LONG_MIN == sl || LONG_MAX == sl) && ERANGE == errno) || sl <= 0
+       || (size_t) sl > max) {
+        fprintf(stderr, "Expected a number between 1 and %zu: '%s'\n", max, s);
+        exit(1);
+    }
+    return (size_t) sl;
+}
+
+static void usage(const char * progname) {
+    fprintf(stderr,
+        "Usage: %s [OPTION]... [BENCH]...\n"
+        "\n"
+        "Benchmarks: parser, stuffing, buffer, maildir. Sin argumentos se corren todos.\n"
+        "\n"
+        "   -h               Ayuda.\n"
+        "   -r <runs>        Corridas medidas de cada benchmark (se reporta la mejor y la mediana). Default: %d.\n"
+        "   -s <scale>       Multiplica el tamaño de cada corrida. Default: %d.\n"
+        "\n",
+        progname, DEFAULT_RUNS, DEFAULT_SCALE);
+}
+
+int main(int argc, char * const argv[]) {
+    size_t runs = DEFAULT_RUNS, scale = DEFAULT_SCALE;
+    int c;
+    while((c = getopt(argc, argv, "hr:s:")) != -1) {
+        switch(c) {
+            case 'r': runs = number(optarg, MAX_RUNS); break;
+            case 's': scale = number(optarg, 1000); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    const size_t count = sizeof(benches) / sizeof(benches[0]);
+    for(int i = optind; i < argc; i++) {
+        size_t j = 0;
+        while(j < count && strcmp(argv[i], benches[j].name) != 0) {
+            j++;
+        }
+        if(j == count) {
+            fprintf(stderr, "Unknown benchmark '%s'\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    calibrate();
+    printf("cycles: %s, %.3f cycles/ns\n", CYCLES_SOURCE, cycles_per_ns);
+    printf("%-10s %-6s %12s %12s %12s %12s\n", "bench", "unit", "best ns", "median ns", "best cyc", "median cyc");
+    bool ok = true;
+    for(size_t j = 0; j < count; j++) {
+        bool selected = optind == argc;
+        for(int i = optind; i < argc && !selected; i++) {
+            selected = strcmp(argv[i], benches[j].name) == 0;
+        }
+        if(selected) {
+            ok &= run_bench(&benches[j], runs, scale);
+        }
+    }
+    return ok ? 0 : 1;
+}
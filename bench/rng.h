@@ -0,0 +1,32 @@
+#ifndef BENCH_RNG_H
+#define BENCH_RNG_H
+
+#include <stdint.h>
+
+/*
+ * Generador pseudoaleatorio xorshift64* para las herramientas de medicion
+ * Cada hilo usa su propio estado, asi una corrida se repite igual con la misma semilla
+ */
+static inline void rng_seed(uint64_t * state, uint64_t seed) {
+    // el estado no puede ser 0
+    *state = (seed + 1) * UINT64_C(0x9E3779B97F4A7C15);
+    if(*state == 0) {
+        *state = 1;
+    }
+}
+
+static inline uint64_t rng_next(uint64_t * state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * UINT64_C(2685821657736338717);
+}
+
+// Uniforme en [0, 1)
+static inline double rng_double(uint64_t * state) {
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "synth.h"
+
+#define SYNTH_NAME_SIZE 128
+#define SYNTH_LINE "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\r\n"
+
+// Llena buff con lineas de texto, terminando en \r\n
+static void fill_body(char * buff, size_t size) {
+    size_t line_len = strlen(SYNTH_LINE);
+    for(size_t i = 0; i < size; i++) {
+        buff[i] = SYNTH_LINE[i % line_len];
+    }
+    if(size >= 2) {
+        buff[size - 2] = '\r';
+        buff[size - 1] = '\n';
+    }
+}
+
+int synth_create_mails(const char * dir, size_t count, size_t size) {
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(dir_fd == -1) {
+        return -1;
+    }
+    char * body = malloc(size + 1);
+    if(body == NULL) {
+        close(dir_fd);
+        return -1;
+    }
+    fill_body(body, size);
+
+    int ret = 0;
+    long now = (long) time(NULL);
+    char name[SYNTH_NAME_SIZE];
+    for(size_t i = 0; i < count && ret == 0; i++) {
+        snprintf(name, SYNTH_NAME_SIZE, "%ld.M%zuP%d.popbench,S=%zu:2,", now, i, (int) getpid(), size);
+        int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1) {
+            ret = -1;
+            break;
+        }
+        if(write(fd, body, size) != (ssize_t) size) {
+            ret = -1;
+        }
+        close(fd);
+    }
+    free(body);
+    close(dir_fd);
+    return ret;
+}
+
+void synth_remove_dir(const char * dir) {
+    DIR * d = opendir(dir);
+    if(d == NULL) {
+        return;
+    }
+    struct dirent * entry;
+    while((entry = readdir(d)) != NULL) {
+        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            unlinkat(dirfd(d), entry->d_name, 0);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
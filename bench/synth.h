@@ -0,0 +1,19 @@
+#ifndef BENCH_SYNTH_H
+#define BENCH_SYNTH_H
+
+#include <stddef.h>
+
+/*
+ * Crea `count' mails de `size' bytes en el directorio `dir' (que debe existir),
+ * con nombres al estilo Maildir++ (<tiempo>.M<n>P<pid>.popbench,S=<size>:2,)
+ *
+ * Retorna 0 si pudo crearlos, -1 si no (y deja detalles en errno)
+ */
+int synth_create_mails(const char * dir, size_t count, size_t size);
+
+/*
+ * Borra los archivos de `dir' y luego el directorio (no es recursivo)
+ */
+void synth_remove_dir(const char * dir);
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * popserver-logdump - lee los logs binarios del servidor (popserver -B) y los muestra como texto
+ *
+ * Permite filtrar por nivel y por texto, o solo contar cuantas veces aparece cada formato
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <strings.h>
+#include "../server/logging/logger.h"
+#include "../server/logging/binary_log.h"
+
+#define MAX_RECORD_LENGTH (UINT16_MAX + 1)
+#define MAX_MESSAGE_LENGTH 1024
+#define MAX_SPEC_LENGTH 64
+#define FORMATS_CHUNK 64
+// El servidor tiene un formato por cada llamada a log en el codigo, un id mas grande es un archivo roto
+#define MAX_FORMAT_ID 65536
+
+struct format_entry {
+    char * format;
+    unsigned long count[MAX_LOG_LEVEL + 1];
+};
+
+struct dump_options {
+    log_level_t min_level;
+    const char * match;
+    bool summary;
+};
+
+static struct format_entry * formats = NULL;
+static uint32_t formats_capacity = 0;
+
+static void usage(const char * progname) {
+    fprintf(stderr,
+        "Usage: %s [OPTION]... [FILE]...\n"
+        "\n"
+        "Muestra los logs binarios de popserver (-B) como texto. Sin FILE, lee de entrada estandar.\n"
+        "\n"
+        "   -h               Ayuda.\n"
+        "   -l <log level>   Mostrar solo desde ese nivel. Valores posibles: DEBUG, INFO, WARNING, ERROR, FATAL.\n"
+        "   -m <text>        Mostrar solo los mensajes que contienen ese texto.\n"
+        "   -s               En lugar de los mensajes, mostrar cuantos hay de cada formato y nivel.\n"
+        "\n",
+        progname);
+}
+
+static log_level_t level(const char * s) {
+    for(log_level_t l = MIN_LOG_LEVEL; l <= MAX_LOG_LEVEL; l++) {
+        // logger_get_level_string devuelve " [NIVEL]"
+        const char * name = logger_get_level_string(l) + 2;
+        size_t len = strlen(s);
+        if(strncasecmp(s, name, len) == 0 && name[len] == ']') {
+            return l;
+        }
+    }
+    fprintf(stderr, "Invalid log level: '%s'\n", s);
+    exit(1);
+}
+
+static bool set_format(uint32_t id, const char * format, size_t len) {
+    if(id == 0 || id > MAX_FORMAT_ID) {
+        return false;
+    }
+    if(id > formats_capacity) {
+        size_t new_capacity = ((size_t) id / FORMATS_CHUNK + 1) * FORMATS_CHUNK;
+        if(new_capacity > SIZE_MAX / sizeof(*formats)) {
+            return false;
+        }
+        void * aux = realloc(formats, new_capacity * sizeof(*formats));
+        if(aux == NULL) {
+            return false;
+        }
+        formats = aux;
+        memset(formats + formats_capacity, 0, (new_capacity - formats_capacity) * sizeof(*formats));
+        formats_capacity = (uint32_t) new_capacity;
+    }
+    struct format_entry * entry = &formats[id - 1];
+    free(entry->format);
+    entry->format = malloc(len + 1);
+    if(entry->format == NULL) {
+        return false;
+    }
+    memcpy(entry->format, format, len);
+    entry->format[len] = '\0';
+    return true;
+}
+
+static struct format_entry * get_format(uint32_t id) {
+    if(id == 0 || id > formats_capacity || formats[id - 1].format == NULL) {
+        return NULL;
+    }
+    return &formats[id - 1];
+}
+
+/*
+ * Cursor sobre los argumentos de un registro
+ */
+struct args_cursor {
+    const char * data;
+    size_t len;
+    size_t pos;
+};
+
+static bool next_arg(struct args_cursor * args, char * type, const char ** value, size_t * value_len) {
+    if(args->pos >= args->len) {
+        return false;
+    }
+    *type = args->data[args->pos++];
+    size_t size;
+    if(*type == BINLOG_ARG_STRING) {
+        uint16_t str_len;
+        if(args->pos + sizeof(str_len) > args->len) {
+            return false;
+        }
+        memcpy(&str_len, args->data + args->pos, sizeof(str_len));
+        args->pos += sizeof(str_len);
+        size = str_len;
+    } else {
+        size = sizeof(uint64_t);
+    }
+    if(args->pos + size > args->len) {
+        return false;
+    }
+    *value = args->data + args->pos;
+    *value_len = size;
+    args->pos += size;
+    return true;
+}
+
+/*
+ * El formato viene del archivo, que puede estar roto: solo se le pasa a snprintf una conversion que
+ * corresponda al tipo del argumento guardado (nunca %n, ni %s con un numero)
+ */
+static bool valid_conversion(char type, char conversion) {
+    switch(type) {
+        case BINLOG_ARG_INT:
+        case BINLOG_ARG_UINT:
+            return strchr("diouxXc", conversion) != NULL;
+        case BINLOG_ARG_DOUBLE:
+            return strchr("eEfFgGaA", conversion) != NULL;
+        case BINLOG_ARG_STRING:
+            return conversion == 's';
+        case BINLOG_ARG_POINTER:
+            return conversion == 'p';
+        default:
+            return false;
+    }
+}
+
+// Los formatos vienen del archivo, no hay forma de que sean literales
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+
+/*
+ * Arma el mensaje como lo hubiera hecho snprintf en el servidor, conversion por conversion
+ * Los modificadores de largo se reemplazan por ll, porque los enteros se guardaron como 64 bits
+ */
+static void render(const char * format, struct args_cursor * args, char * out, size_t out_size) {
+    size_t written = 0;
+    char spec[MAX_SPEC_LENGTH];
+    for(const char * c = format; *c != '\0' && written + 1 < out_size; c++) {
+        if(*c != '%') {
+            out[written++] = *c;
+            continue;
+        }
+        c++;
+        if(*c == '%') {
+            out[written++] = '%';
+            continue;
+        }
+        size_t spec_len = 0;
+        spec[spec_len++] = '%';
+        bool ok = true;
+        // flags, ancho y precision. Los * se reemplazan por el valor guardado
+        for(; *c != '\0' && (strchr("-+ #0.", *c) != NULL || (*c >= '0' && *c <= '9') || *c == '*') && ok; c++) {
+            if(*c == '*') {
+                char type;
+                const char * value;
+                size_t value_len;
+                int64_t number = 0;
+                ok = next_arg(args, &type, &value, &value_len) && type == BINLOG_ARG_INT;
+                if(ok) {
+                    memcpy(&number, value, sizeof(number));
+                    int n = snprintf(spec + spec_len, MAX_SPEC_LENGTH - 4 - spec_len, "%d", (int) number);
+                    ok = n >= 0 && (size_t) n < MAX_SPEC_LENGTH - 4 - spec_len;
+                    spec_len += ok ? (size_t) n : 0;
+                }
+            } else if(spec_len < MAX_SPEC_LENGTH - 4) {
+                spec[spec_len++] = *c;
+            }
+        }
+        while(*c != '\0' && strchr("hlLqjzt", *c) != NULL) {
+            c++;
+        }
+        char conversion = *c;
+        char type = 0;
+        const char * value = NULL;
+        size_t value_len = 0;
+        if(!ok || conversion == '\0' || !next_arg(args, &type, &value, &value_len)) {
+            // El registro no tiene lo que pide el formato (se corto o no lo pudimos guardar)
+            int n = snprintf(out + written, out_size - written, "<?>");
+            written = n < 0 || (size_t) n >= out_size - written ? out_size - 1 : written + n;
+            break;
+        }
+        int n = -1;
+        if(!valid_conversion(type, conversion)) {
+            type = 0; // se muestra como <?>
+        }
+        switch(type) {
+            case BINLOG_ARG_INT: {
+                int64_t number;
+                memcpy(&number, value, sizeof(number));
+                if(conversion == 'c') {
+                    spec[spec_len++] = 'c';
+                    spec[spec_len] = '\0';
+                    n = snprintf(out + written, out_size - written, spec, (int) number);
+                } else {
+                    spec[spec_len++] = 'l';
+                    spec[spec_len++] = 'l';
+                    spec[spec_len++] = conversion;
+                    spec[spec_len] = '\0';
+                    n = snprintf(out + written, out_size - written, spec, (long long) number);
+                }
+                break;
+            }
+            case BINLOG_ARG_UINT: {
+                uint64_t number;
+                memcpy(&number, value, sizeof(number));
+                if(conversion == 'c') {
+                    spec[spec_len++] = 'c';
+                    spec[spec_len] = '\0';
+                    n = snprintf(out + written, out_size - written, spec, (int) number);
+                } else {
+                    spec[spec_len++] = 'l';
+                    spec[spec_len++] = 'l';
+                    spec[spec_len++] = conversion;
+                    spec[spec_len] = '\0';
+                    n = snprintf(out + written, out_size - written, spec, (unsigned long long) number);
+                }
+                break;
+            }
+            case BINLOG_ARG_DOUBLE: {
+                double number;
+                memcpy(&number, value, sizeof(number));
+                spec[spec_len++] = conversion;
+                spec[spec_len] = '\0';
+                n = snprintf(out + written, out_size - written, spec, number);
+                break;
+            }
+            case BINLOG_ARG_STRING:
+                // No viene con '\0', lo limitamos con la precision
+                spec[spec_len] = '\0';
+                if(strchr(spec, '.') == NULL) {
+                    n = snprintf(out + written, out_size - written, "%.*s", (int) value_len, value);
+                } else {
+                    char str[MAX_MESSAGE_LENGTH];
+                    size_t len = value_len < MAX_MESSAGE_LENGTH - 1 ? value_len : MAX_MESSAGE_LENGTH - 1;
+                    memcpy(str, value, len);
+                    str[len] = '\0';
+                    spec[spec_len++] = 's';
+                    spec[spec_len] = '\0';
+                    n = snprintf(out + written, out_size - written, spec, str);
+                }
+                break;
+            case BINLOG_ARG_POINTER: {
+                uint64_t number;
+                memcpy(&number, value, sizeof(number));
+                n = snprintf(out + written, out_size - written, "0x%llx", (unsigned long long) number);
+                break;
+            }
+            default:
+                n = snprintf(out + written, out_size - written, "<?>");
+                break;
+        }
+        if(n < 0) {
+            break;
+        }
+        written += (size_t) n;
+        if(written >= out_size) {
+            written = out_size - 1;
+        }
+    }
+    out[written] = '\0';
+}
+
+#pragma GCC diagnostic pop
+
+static void print_record(const char * record, size_t len, const struct dump_options * options) {
+    if(len < BINLOG_LOG_HEADER_LENGTH) {
+        return;
+    }
+    uint64_t micros;
+    uint32_t id;
+    memcpy(&micros, record, sizeof(micros));
+    log_level_t record_level = (log_level_t) (uint8_t) record[sizeof(micros)];
+    memcpy(&id, record + sizeof(micros) + 1, sizeof(id));
+    if(record_level < options->min_level) {
+        return;
+    }
+    struct format_entry * entry = get_format(id);
+    if(entry == NULL) {
+        fprintf(stderr, "Record with unknown format id %u\n", id);
+        return;
+    }
+    if(options->summary && options->match == NULL) {
+        if(record_level <= MAX_LOG_LEVEL) {
+            entry->count[record_level]++;
+        }
+        return;
+    }
+    struct args_cursor args = {
+        .data = record + BINLOG_LOG_HEADER_LENGTH,
+        .len = len - BINLOG_LOG_HEADER_LENGTH,
+        .pos = 0,
+    };
+    char message[MAX_MESSAGE_LENGTH];
+    render(entry->format, &args, message, MAX_MESSAGE_LENGTH);
+    if(options->match != NULL && strstr(message, options->match) == NULL) {
+        return;
+    }
+    if(options->summary) {
+        if(record_level <= MAX_LOG_LEVEL) {
+            entry->count[record_level]++;
+        }
+        return;
+    }
+    // Igual que las lineas de los logs de texto
+    time_t seconds = (time_t) (micros / 1000000u);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    printf("[%04d-%02d-%02d %02d:%02d:%02d]%s\t%s\n", tm.tm_year + 1900, tm.tm_mday, tm.tm_mon + 1,
+           tm.tm_hour, tm.tm_min, tm.tm_sec, logger_get_level_string(record_level), message);
+}
+
+static int dump(FILE * file, const char * name, const struct dump_options * options) {
+    char magic[BINLOG_MAGIC_LENGTH];
+    uint32_t endian_check;
+    if(fread(magic, 1, BINLOG_MAGIC_LENGTH, file) != BINLOG_MAGIC_LENGTH
+       || memcmp(magic, BINLOG_MAGIC, BINLOG_MAGIC_LENGTH) != 0
+       || fread(&endian_check, sizeof(endian_check), 1, file) != 1) {
+        fprintf(stderr, "%s: not a popserver binary log\n", name);
+        return 1;
+    }
+    if(endian_check != BINLOG_ENDIAN_CHECK) {
+        fprintf(stderr, "%s: written by a server with a different byte order\n", name);
+        return 1;
+    }
+    char * record = malloc(MAX_RECORD_LENGTH);
+    if(record == NULL) {
+        fprintf(stderr, "Cannot allocate memory\n");
+        return 1;
+    }
+    int ret = 0;
+    char header[BINLOG_RECORD_HEADER_LENGTH];
+    while(fread(header, 1, BINLOG_RECORD_HEADER_LENGTH, file) == BINLOG_RECORD_HEADER_LENGTH) {
+        uint16_t len;
+        memcpy(&len, header + 1, sizeof(len));
+        if(fread(record, 1, len, file) != len) {
+            fprintf(stderr, "%s: truncated record\n", name);
+            ret = 1;
+            break;
+        }
+        if(header[0] == BINLOG_RECORD_FORMAT && len >= sizeof(uint32_t)) {
+            uint32_t id;
+            memcpy(&id, record, sizeof(id));
+            if(!set_format(id, record + sizeof(id), len - sizeof(id))) {
+                fprintf(stderr, "%s: invalid format record\n", name);
+            }
+        } else if(header[0] == BINLOG_RECORD_LOG) {
+            print_record(record, len, options);
+        } else {
+            fprintf(stderr, "%s: unknown record type 0x%02x\n", name, (unsigned char) header[0]);
+            ret = 1;
+            break;
+        }
+    }
+    free(record);
+    return ret;
+}
+
+static void reset_formats(void) {
+    for(uint32_t i = 0; i < formats_capacity; i++) {
+        free(formats[i].format);
+    }
+    memset(formats, 0, formats_capacity * sizeof(*formats));
+}
+
+static void print_summary(void) {
+    for(uint32_t i = 0; i < formats_capacity; i++) {
+        if(formats[i].format == NULL) {
+            continue;
+        }
+        for(log_level_t l = MIN_LOG_LEVEL; l <= MAX_LOG_LEVEL; l++) {
+            if(formats[i].count[l] > 0) {
+                printf("%lu\t%s\t%s\n", formats[i].count[l], logger_get_level_string(l) + 1, formats[i].format);
+            }
+        }
+    }
+}
+
+int main(int argc, char * const argv[]) {
+    struct dump_options options = {
+        .min_level = MIN_LOG_LEVEL,
+        .match = NULL,
+        .summary = false,
+    };
+    int c;
+    while((c = getopt(argc, argv, "hl:m:s")) != -1) {
+        switch(c) {
+            case 'l': options.min_level = level(optarg); break;
+            case 'm': options.match = optarg; break;
+            case 's': options.summary = true; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    int ret = 0;
+    if(optind == argc) {
+        ret = dump(stdin, "stdin", &options);
+        if(options.summary) {
+            print_summary();
+        }
+    }
+    for(int i = optind; i < argc; i++) {
+        FILE * file = fopen(argv[i], "rb");
+        if(file == NULL) {
+            perror(argv[i]);
+            ret = 1;
+            continue;
+        }
+        ret |= dump(file, argv[i], &options);
+        fclose(file);
+        if(options.summary) {
+            if(argc - optind > 1) {
+                printf("%s:\n", argv[i]);
+            }
+            print_summary();
+        }
+        // Cada archivo tiene sus propios ids
+        reset_formats();
+    }
+    reset_formats();
+    free(formats);
+    return ret;
+}
@@ -8,20 +8,33 @@
 #include <strings.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+#include <stdarg.h>
 #include "args.h"
 #include "usersADT.h"
 #include "logging/logger.h"
+#include "pop3.h"
+#include "admin.h"
 
-#define MAX_LINES 10
 #define DGRAM_SIZE 1024 //10 lineas de las que soportamos
+#define BATCH_DGRAM_SIZE 8192 //en la version 2 van varios comandos (y sus respuestas) en un datagrama
+#define ADMIN_VERSION 1
+#define ADMIN_BATCH_VERSION 2
 #define DATA_SIZE 640
+#define LATENCY_DATA_SIZE (DGRAM_SIZE - 64) //una linea por comando, deja lugar para el encabezado de la respuesta
+#define LOOP_DATA_SIZE (DGRAM_SIZE - 64) //una linea por handler y por estado
+#define NS_PER_US 1000
 #define PROTOCOL_SIZE 6
 #define TOKEN_SIZE 128
 #define COMMAND_SIZE 128
 #define ARG_SIZE 128
 #define ARG_COUNT 5
 #define ADMIN_PROTOCOL "PROTOS"
-#define HEADER_LINES 5
+#define BATCH_TOO_LARGE_MESSAGE "Response does not fit in datagram\n"
+#define BULK_MAX_PENDING 4 //operaciones masivas abiertas a la vez
+#define BULK_MAX_ENTRIES (1 << 16) //operaciones recibidas por operacion masiva (contando reenvios)
+#define BULK_TIMEOUT 60 //segundos sin recibir nada hasta que se descarta
+#define BULK_MAX_REPORTED_FAILURES 10
 
 
 typedef enum{
@@ -34,6 +47,15 @@ typedef enum{
     ADMIN_STAT_HISTORIC_CONNECTIONS,
     ADMIN_STAT_CURRENT_CONNECTIONS,
     ADMIN_STAT_BYTES_TRANSFERRED,
+    ADMIN_STAT_EXPUNGE_LATENCY,
+    ADMIN_STAT_MAILDIR_SCAN,
+    ADMIN_STAT_LOGGER,
+    ADMIN_STAT_LATENCY,
+    ADMIN_BULK_BEGIN,
+    ADMIN_BULK_ADD,
+    ADMIN_BULK_COMMIT,
+    ADMIN_BULK_ABORT,
+    ADMIN_STAT_LOOP,
     ADMIN_ERROR
 }admin_command;
 
@@ -87,8 +109,18 @@ void set_maildir_action(int socket, request* req,struct pop3args* args, struct s
 void stat_historic_connections_action(int socket, request* req,struct pop3args* args, struct sockaddr_storage* client_addr, unsigned int client_len);
 void stat_current_connections_action(int socket, request* req,struct pop3args* args, struct sockaddr_storage* client_addr, unsigned int client_len);
 void stat_bytes_transferred_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void stat_expunge_latency_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void stat_maildir_scan_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void stat_logger_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void stat_latency_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void bulk_begin_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void bulk_add_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void bulk_commit_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void bulk_abort_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
+void stat_loop_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len);
 const char * get_status_message(admin_status status);
-admin_status parse_request(request* req, char * buff, size_t buff_len, struct pop3args* args);
+admin_status parse_header(request* req, char** buff, struct pop3args* args);
+admin_status parse_command(request* req, char** buff);
 static command commands[] = {
         {
             .name = "ADD_USER",
@@ -125,39 +157,155 @@ static command commands[] = {
         {
             .name = "STAT_BYTES_TRANSFERRED",
             .action = stat_bytes_transferred_action
+        },
+        {
+            .name = "STAT_EXPUNGE_LATENCY",
+            .action = stat_expunge_latency_action
+        },
+        {
+            .name = "STAT_MAILDIR_SCAN",
+            .action = stat_maildir_scan_action
+        },
+        {
+            .name = "STAT_LOGGER",
+            .action = stat_logger_action
+        },
+        {
+            .name = "STAT_LATENCY",
+            .action = stat_latency_action
+        },
+        {
+            .name = "BULK_BEGIN",
+            .action = bulk_begin_action
+        },
+        {
+            .name = "BULK_ADD",
+            .action = bulk_add_action
+        },
+        {
+            .name = "BULK_COMMIT",
+            .action = bulk_commit_action
+        },
+        {
+            .name = "BULK_ABORT",
+            .action = bulk_abort_action
+        },
+        {
+            .name = "STAT_LOOP",
+            .action = stat_loop_action
         }
 };
 
 
 
+/*
+ * Respuesta de un request de la version 2: las acciones llaman a send_response como siempre,
+ * pero mientras active sea true cada respuesta se agrega aca y se manda todo junto al final
+ */
+static struct {
+    bool active;
+    char buff[BATCH_DGRAM_SIZE];
+    size_t len;
+} batch;
+
+static void batch_append(admin_status status, const char* data, request* req){
+    size_t space = BATCH_DGRAM_SIZE - batch.len;
+    int len = snprintf(batch.buff + batch.len,space,"%zu\n%c\n%s\n",req->req_id,status==OK?'+':'-',data);
+    if(len >= 0 && (size_t) len < space){
+        batch.len += len;
+        return;
+    }
+    //no entra: avisamos en esa respuesta si hay lugar, las siguientes tambien van a fallar
+    len = snprintf(batch.buff + batch.len,space,"%zu\n-\n%s\n",req->req_id,BATCH_TOO_LARGE_MESSAGE);
+    if(len >= 0 && (size_t) len < space){
+        batch.len += len;
+    }else{
+        batch.buff[batch.len] = '\0';
+    }
+    logf(LOG_WARNING, "[ADMIN] Response to request %zu does not fit in the batch datagram", req->req_id);
+}
+
 static void send_response(int socket, admin_status status, char* data, request * req,struct sockaddr_storage* client_addr, size_t addr_len){
+    if(batch.active){
+        batch_append(status,data,req);
+        return;
+    }
     char ans[DGRAM_SIZE];
     int len = snprintf(ans,DGRAM_SIZE,"PROTOS\n%ld\n%zu\n%c\n%s\n",req->version,req->req_id,status==OK?'+':'-',data);
     if(len<0){
         logf(LOG_ERROR, "[ADMIN] Cannot generate response to socket %d", socket);
         return;
     }
+    if(len >= DGRAM_SIZE){
+        len = DGRAM_SIZE - 1;
+    }
     if(sendto(socket,ans,len+1,0,(struct sockaddr*) client_addr,addr_len) < 0){
         logf(LOG_ERROR, "[ADMIN] Cannot send response to socket %d", socket);
     }
 }
 
+/*
+ * Ejecuta todos los comandos de un request de la version 2 y manda las respuestas en un solo datagrama
+ * Un comando invalido solo genera una respuesta de error, el resto se ejecuta igual
+ * Si el encabezado fue invalido (header_status, por ejemplo el token), todos los comandos responden ese error
+ */
+static void run_batch(int socket, request* req, admin_status header_status, char* buff, struct pop3args* args, struct sockaddr_storage* client_addr, unsigned int client_len){
+    batch.active = true;
+    batch.len = (size_t) snprintf(batch.buff,BATCH_DGRAM_SIZE,"PROTOS\n%ld\n",req->version);
+    size_t count = 0;
+    while(*buff != '\0'){
+        admin_status status = parse_command(req,&buff);
+        if(status == FORMAT_ERROR && req->command[0] == '\0'){
+            //no quedaban comandos, solo lineas vacias
+            break;
+        }
+        count++;
+        if(header_status != OK){
+            status = header_status;
+        }
+        if(status != OK){
+            logf(LOG_WARNING, "[ADMIN] Invalid command in batch from socket %d, got status '%s'", socket, get_status_message(status));
+            send_response(socket,status,parser_messages[status],req,client_addr,client_len);
+            continue;
+        }
+        commands[req->cmd].action(socket,req,args,client_addr,client_len);
+    }
+    batch.active = false;
+    logf(LOG_DEBUG, "[ADMIN] Sending batch response with %zu commands", count);
+    if(sendto(socket,batch.buff,batch.len+1,0,(struct sockaddr*) client_addr,client_len) < 0){
+        logf(LOG_ERROR, "[ADMIN] Cannot send response to socket %d", socket);
+    }
+}
+
 void admin_read(struct selector_key* key){
     //con el {0} me aseguro que todos los strings terminan en \0 (si no me paso escribiendo)
     static request req = {0}; //static para que no se reserve siempre
-    char buff[DGRAM_SIZE+1]={0};
+    static char buff[BATCH_DGRAM_SIZE+1];
     struct sockaddr_storage client_addr;
     unsigned int len = sizeof (client_addr);
 
-    long read_count = recvfrom(key->fd,buff,DGRAM_SIZE,0,(struct sockaddr*) &client_addr, &len);
+    long read_count = recvfrom(key->fd,buff,BATCH_DGRAM_SIZE,0,(struct sockaddr*) &client_addr, &len);
 
     if(read_count<=0){ //si hay errores es -1, 0 no tiene sentido en UDP
         logf(LOG_ERROR,"[ADMIN] Cannot read from socket %d", key->fd);
         return;
     }
+    buff[read_count] = '\0';
 
     struct pop3args* args = (struct pop3args*) key->data;
-    admin_status status = parse_request(&req,buff,DGRAM_SIZE,args);
+    char* next = buff;
+    req.req_id = 0;
+    admin_status status = parse_header(&req,&next,args);
+    if(req.version == ADMIN_BATCH_VERSION){
+        if(status != OK){
+            logf(LOG_WARNING, "[ADMIN] Invalid batch request from socket %d, got status '%s'", key->fd, get_status_message(status));
+        }
+        run_batch(key->fd,&req,status,next,args,&client_addr,len);
+        return;
+    }
+    if(status == OK){
+        status = parse_command(&req,&next);
+    }
     if(status != OK){
         logf(LOG_WARNING, "[ADMIN] Invalid request from socket %d, got status '%s'", key->fd, get_status_message(status));
         send_response(key->fd,status,parser_messages[status],&req,&client_addr,len);
@@ -170,7 +318,7 @@ void admin_read(struct selector_key* key){
 
 
 admin_command find_command(const char* cmd){
-    for(admin_command command = ADMIN_ADD_USER; command <= ADMIN_STAT_BYTES_TRANSFERRED; command ++){
+    for(admin_command command = ADMIN_ADD_USER; command < ADMIN_ERROR; command ++){
         if(strcmp(cmd,commands[command].name)==0){
             return command;
         }
@@ -178,68 +326,92 @@ admin_command find_command(const char* cmd){
     return ADMIN_ERROR;
 }
 
-admin_status parse_request(request* request, char* buff, size_t buff_len, struct pop3args* args){
-    //Vamos a ir buscando los \n para separar las cosas
+/*
+ * Devuelve la proxima linea de *buff (sin el \n) y avanza *buff a la siguiente
+ * Si la ultima linea no termina en \n, la devuelve igual. NULL si no quedan lineas
+ */
+static char* next_line(char** buff){
+    char* line = *buff;
+    if(*line == '\0'){
+        return NULL;
+    }
+    char* end = strchr(line,'\n');
+    if(end == NULL){
+        *buff = line + strlen(line);
+    }else{
+        *end = '\0';
+        *buff = end + 1;
+    }
+    return line;
+}
+
+/*
+ * Lee el encabezado comun a todos los requests: protocolo, version y token
+ */
+bool admin_valid_token(const char* token, const char* access_token){
+    return strncasecmp(token, access_token, TOKEN_SIZE) == 0;
+}
+
+admin_status parse_header(request* request, char** buff, struct pop3args* args){
+    char* line;
+    request->version = ADMIN_VERSION;
+    if((line = next_line(buff)) == NULL){
+        return FORMAT_ERROR;
+    }
+    strncpy(request->protocol,line,PROTOCOL_SIZE);
+    if(strcasecmp(ADMIN_PROTOCOL,request->protocol)!=0){
+        return INVALID_PROTOCOL;
+    }
+    if((line = next_line(buff)) == NULL){
+        return FORMAT_ERROR;
+    }
+    errno = 0;
+    long version = strtol(line,NULL,10);
+    if(errno == EINVAL || errno == ERANGE || (version != ADMIN_VERSION && version != ADMIN_BATCH_VERSION)){
+        return INVALID_VERSION;
+    }
+    request->version = version;
+    if((line = next_line(buff)) == NULL){
+        return FORMAT_ERROR;
+    }
+    strncpy(request->token,line,TOKEN_SIZE);
+    if(!admin_valid_token(request->token, args->access_token)){
+        return INVALID_TOKEN;
+    }
+    return OK;
+}
+
+/*
+ * Lee un comando: id, nombre y argumentos, hasta una linea vacia o el final del datagrama
+ * Las lineas vacias antes del comando se ignoran. Si no hay comando, deja request->command vacio y retorna FORMAT_ERROR
+ */
+admin_status parse_command(request* request, char** buff){
+    char* line;
     request->arg_c = 0;
-    char * last;
-    size_t len = strlen(buff);
-    int i = 0;
-    admin_status ret = OK;
-    while (i<MAX_LINES){
-        last = strchr(buff,'\n');
-        if(last == NULL){
-            if(ret!=OK){
-                return ret;
-            }
-            return i+1>=HEADER_LINES?OK:FORMAT_ERROR;
-        }
-        *last = '\0';
-        switch (i) {
-            case 0:
-                strncpy(request->protocol,buff,PROTOCOL_SIZE);
-                if(strcasecmp(ADMIN_PROTOCOL,request->protocol)!=0){
-                    ret = (ret == OK) ? INVALID_PROTOCOL:ret;
-                }
-                break;
-            case 1:
-                request->version = strtol(buff,NULL,10);
-                if(errno == EINVAL || errno == ERANGE || request->version!=1){
-                    ret = (ret == OK) ? INVALID_VERSION:ret;
-                }
-                break;
-            case 2:
-                strncpy(request->token,buff,TOKEN_SIZE);
-                if(strncasecmp(request->token, args->access_token,TOKEN_SIZE) != 0){
-                    ret = (ret == OK) ? INVALID_TOKEN:ret;
-                }
-                break;
-            case 3:
-                request->req_id = strtol(buff,NULL,10);
-                if(errno == EINVAL || errno == ERANGE){
-                    ret = (ret == OK) ? INVALID_ID:ret;
-                }
-                break;
-            case 4:
-                strncpy(request->command,buff,COMMAND_SIZE);
-                if((request->cmd = find_command(request->command)) == ADMIN_ERROR){
-                    ret = (ret == OK) ? INVALID_COMMAND:ret;
-                }
-                break;
-            default:
-                strncpy(request->args[request->arg_c],buff,ARG_SIZE);
-                (request->arg_c)++;
-        }
-        i++;
-        len -= (last - buff);
-        if(len == 0){
-            if(ret != OK){
-                return ret;
-            }
-            return i+1>=HEADER_LINES?OK:FORMAT_ERROR;
+    request->command[0] = '\0';
+    while((line = next_line(buff)) != NULL && *line == '\0');
+    if(line == NULL){
+        return FORMAT_ERROR;
+    }
+    errno = 0;
+    request->req_id = strtol(line,NULL,10);
+    admin_status ret = (errno == EINVAL || errno == ERANGE) ? INVALID_ID : OK;
+    if((line = next_line(buff)) == NULL || *line == '\0'){
+        //lo marcamos para que no se confunda con el final del batch
+        strcpy(request->command,"?");
+        return ret == OK ? FORMAT_ERROR : ret;
+    }
+    strncpy(request->command,line,COMMAND_SIZE);
+    if((request->cmd = find_command(request->command)) == ADMIN_ERROR && ret == OK){
+        ret = INVALID_COMMAND;
+    }
+    while((line = next_line(buff)) != NULL && *line != '\0'){
+        if(request->arg_c < ARG_COUNT){
+            strncpy(request->args[request->arg_c],line,ARG_SIZE);
+            (request->arg_c)++;
         }
-        buff = last + 1;
     }
-    return OK;
+    return ret;
 }
 
 void add_user_action(int socket, request* req,struct pop3args* args, struct sockaddr_storage* client_addr, unsigned int client_len){
@@ -388,6 +560,325 @@ void stat_bytes_transferred_action(int socket, request* req,struct pop3args* arg
 
 }
 
+void stat_expunge_latency_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    extern unsigned long expunge_count, expunge_total_us, expunge_max_us, expunged_emails;
+    char ans[DATA_SIZE];
+    unsigned long avg_us = expunge_count == 0 ? 0 : expunge_total_us / expunge_count;
+    if(snprintf(ans,DATA_SIZE,"expunges=%lu emails=%lu avg_us=%lu max_us=%lu\n",expunge_count,expunged_emails,avg_us,expunge_max_us)<0){
+        log(LOG_ERROR,"[ADMIN] Error generating expunge_latency metric response");
+        send_response(socket,GENERAL_ERROR,"Error al generar la respuesta",req,client_addr,client_len);
+        return;
+    }
+    logf(LOG_DEBUG,"[ADMIN] Sending expunge_latency metric: %lu expunges", expunge_count);
+    send_response(socket,OK,ans,req,client_addr,client_len);
+}
+
+void stat_maildir_scan_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    extern unsigned long maildir_scans, maildir_entries, maildir_stats_avoided, delivered_emails;
+    char ans[DATA_SIZE];
+    if(snprintf(ans,DATA_SIZE,"scans=%lu emails=%lu stats_avoided=%lu delivered=%lu\n",maildir_scans,maildir_entries,maildir_stats_avoided,delivered_emails)<0){
+        log(LOG_ERROR,"[ADMIN] Error generating maildir_scan metric response");
+        send_response(socket,GENERAL_ERROR,"Error al generar la respuesta",req,client_addr,client_len);
+        return;
+    }
+    logf(LOG_DEBUG,"[ADMIN] Sending maildir_scan metric: %lu scans", maildir_scans);
+    send_response(socket,OK,ans,req,client_addr,client_len);
+}
+
+void stat_logger_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    char ans[DATA_SIZE];
+    unsigned long dropped = logger_get_dropped();
+    if(snprintf(ans,DATA_SIZE,"dropped=%lu backlog=%zu rotations=%lu\n",dropped,logger_get_backlog(),logger_get_rotations())<0){
+        log(LOG_ERROR,"[ADMIN] Error generating logger metric response");
+        send_response(socket,GENERAL_ERROR,"Error al generar la respuesta",req,client_addr,client_len);
+        return;
+    }
+    logf(LOG_DEBUG,"[ADMIN] Sending logger metric: %lu dropped", dropped);
+    send_response(socket,OK,ans,req,client_addr,client_len);
+}
+
+void stat_latency_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    char ans[LATENCY_DATA_SIZE];
+    int len = pop3_latency_report(ans,LATENCY_DATA_SIZE);
+    if(len<0){
+        log(LOG_ERROR,"[ADMIN] Error generating latency metric response");
+        send_response(socket,GENERAL_ERROR,"Error al generar la respuesta",req,client_addr,client_len);
+        return;
+    }
+    if(len>=LATENCY_DATA_SIZE){
+        log(LOG_WARNING,"[ADMIN] Latency metric response truncated");
+    }
+    log(LOG_DEBUG,"[ADMIN] Sending latency metric");
+    send_response(socket,OK,ans,req,client_addr,client_len);
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Operaciones masivas sobre los usuarios
+ *
+ * BULK_BEGIN devuelve un id. Cada BULK_ADD (id, seq, ADD|PASS, usuario, contraseña) guarda una operacion
+ * con su numero de secuencia, asi pueden llegar en cualquier orden y en varios datagramas (y reenviarse si se
+ * pierde la respuesta). Se guardan en el orden en que llegan, asi la memoria depende de lo recibido y no del
+ * seq. BULK_COMMIT (id, cantidad) las ordena por seq, verifica que esten todas y las aplica juntas con
+ * usersADT_apply, respondiendo un resumen. Nada se aplica hasta el commit; si no hay memoria no se aplica ninguna
+ * --------------------------------------------------------------------------------------
+ */
+struct bulk_entry{
+    users_op op;
+    size_t seq;
+    size_t arrival; //para quedarse con el ultimo reenvio de un seq
+};
+
+static struct {
+    unsigned long id; //0 si esta libre
+    time_t last_used;
+    struct bulk_entry* entries;
+    size_t length;
+    size_t capacity;
+    size_t received; //contador para arrival
+} bulks[BULK_MAX_PENDING];
+
+static unsigned long next_bulk_id = 1;
+
+static void bulk_free(size_t i){
+    for(size_t j = 0; j < bulks[i].length; j++){
+        free((char*) bulks[i].entries[j].op.name);
+        free((char*) bulks[i].entries[j].op.pass);
+    }
+    free(bulks[i].entries);
+    bulks[i].id = 0;
+    bulks[i].entries = NULL;
+    bulks[i].length = 0;
+    bulks[i].capacity = 0;
+    bulks[i].received = 0;
+}
+
+static int bulk_entry_cmp(const void* a, const void* b){
+    const struct bulk_entry* x = a;
+    const struct bulk_entry* y = b;
+    if(x->seq != y->seq){
+        return x->seq < y->seq ? -1 : 1;
+    }
+    return x->arrival < y->arrival ? -1 : x->arrival > y->arrival;
+}
+
+/*
+ * Ordena las operaciones por seq y deja solo el ultimo reenvio de cada una
+ */
+static void bulk_sort(size_t i){
+    struct bulk_entry* entries = bulks[i].entries;
+    if(bulks[i].length == 0){
+        return;
+    }
+    qsort(entries,bulks[i].length,sizeof(struct bulk_entry),bulk_entry_cmp);
+    size_t kept = 0;
+    for(size_t j = 0; j < bulks[i].length; j++){
+        if(kept > 0 && entries[kept - 1].seq == entries[j].seq){
+            //el anterior es un envio viejo del mismo seq
+            free((char*) entries[kept - 1].op.name);
+            free((char*) entries[kept - 1].op.pass);
+            kept--;
+        }
+        entries[kept++] = entries[j];
+    }
+    bulks[i].length = kept;
+}
+
+/*
+ * Busca la operacion masiva con el id del argumento arg. Retorna su posicion o -1
+ */
+static int bulk_find(request* req, size_t arg){
+    char* end;
+    errno = 0;
+    unsigned long id = strtoul(req->args[arg],&end,10);
+    if(errno != 0 || *end != '\0' || id == 0){
+        return -1;
+    }
+    for(int i = 0; i < BULK_MAX_PENDING; i++){
+        if(bulks[i].id == id){
+            bulks[i].last_used = time(NULL);
+            return i;
+        }
+    }
+    return -1;
+}
+
+void admin_destroy(void){
+    for(size_t i = 0; i < BULK_MAX_PENDING; i++){
+        if(bulks[i].id != 0){
+            bulk_free(i);
+        }
+    }
+}
+
+void bulk_begin_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    char ans[DATA_SIZE];
+    time_t now = time(NULL);
+    int free_slot = -1;
+    for(int i = 0; i < BULK_MAX_PENDING; i++){
+        if(bulks[i].id != 0 && now - bulks[i].last_used > BULK_TIMEOUT){
+            logf(LOG_WARNING,"[ADMIN] Discarding bulk %lu, timed out", bulks[i].id);
+            bulk_free(i);
+        }
+        if(bulks[i].id == 0 && free_slot == -1){
+            free_slot = i;
+        }
+    }
+    if(free_slot == -1){
+        log(LOG_ERROR,"[ADMIN] Too many pending bulk operations");
+        send_response(socket,GENERAL_ERROR,"Too many pending bulk operations\n",req,client_addr,client_len);
+        return;
+    }
+    bulks[free_slot].id = next_bulk_id++;
+    bulks[free_slot].last_used = now;
+    if(snprintf(ans,DATA_SIZE,"%lu\n",bulks[free_slot].id)<0){
+        log(LOG_ERROR,"[ADMIN] Error generating bulk_begin response");
+        bulk_free(free_slot);
+        send_response(socket,GENERAL_ERROR,"Error al generar la respuesta",req,client_addr,client_len);
+        return;
+    }
+    logf(LOG_INFO,"[ADMIN] Started bulk %lu", bulks[free_slot].id);
+    send_response(socket,OK,ans,req,client_addr,client_len);
+}
+
+void bulk_add_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    if(req->arg_c<5){
+        logf(LOG_ERROR, "[ADMIN] Incorrect quantity of arguments, expected 5, got %ld", req->arg_c);
+        send_response(socket,GENERAL_ERROR,"Cantidad de argumentos incorrecta",req,client_addr,client_len);
+        return;
+    }
+    int bulk = bulk_find(req,0);
+    if(bulk == -1){
+        send_response(socket,GENERAL_ERROR,"Unknown bulk id\n",req,client_addr,client_len);
+        return;
+    }
+    char* end;
+    errno = 0;
+    unsigned long seq = strtoul(req->args[1],&end,10);
+    if(errno != 0 || *end != '\0' || seq >= BULK_MAX_ENTRIES){
+        send_response(socket,GENERAL_ERROR,"Invalid sequence number\n",req,client_addr,client_len);
+        return;
+    }
+    users_op_type type;
+    if(strcasecmp(req->args[2],"ADD") == 0){
+        type = USERS_OP_ADD;
+    }else if(strcasecmp(req->args[2],"PASS") == 0){
+        type = USERS_OP_CHANGE_PASS;
+    }else{
+        send_response(socket,GENERAL_ERROR,"Invalid operation, expected ADD or PASS\n",req,client_addr,client_len);
+        return;
+    }
+    if(bulks[bulk].length == BULK_MAX_ENTRIES){
+        send_response(socket,GENERAL_ERROR,"Too many operations in bulk\n",req,client_addr,client_len);
+        return;
+    }
+    if(bulks[bulk].length == bulks[bulk].capacity){
+        size_t capacity = bulks[bulk].capacity == 0 ? 64 : bulks[bulk].capacity * 2;
+        struct bulk_entry* aux = realloc(bulks[bulk].entries, capacity * sizeof(struct bulk_entry));
+        if(aux == NULL){
+            log(LOG_ERROR,"[ADMIN] Unable to allocate memory for bulk operation");
+            send_response(socket,GENERAL_ERROR,"Out of memory\n",req,client_addr,client_len);
+            return;
+        }
+        bulks[bulk].entries = aux;
+        bulks[bulk].capacity = capacity;
+    }
+    char* name = strdup(req->args[3]);
+    char* pass = strdup(req->args[4]);
+    if(name == NULL || pass == NULL){
+        free(name);
+        free(pass);
+        log(LOG_ERROR,"[ADMIN] Unable to allocate memory for bulk operation");
+        send_response(socket,GENERAL_ERROR,"Out of memory\n",req,client_addr,client_len);
+        return;
+    }
+    //si es un reenvio, el commit se queda con este (ver bulk_sort)
+    struct bulk_entry* entry = bulks[bulk].entries + bulks[bulk].length++;
+    entry->op.type = type;
+    entry->op.name = name;
+    entry->op.pass = pass;
+    entry->seq = seq;
+    entry->arrival = bulks[bulk].received++;
+    send_response(socket,OK,"",req,client_addr,client_len);
+}
+
+void bulk_commit_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    char ans[DATA_SIZE];
+    if(req->arg_c<2){
+        logf(LOG_ERROR, "[ADMIN] Incorrect quantity of arguments, expected 2, got %ld", req->arg_c);
+        send_response(socket,GENERAL_ERROR,"Cantidad de argumentos incorrecta",req,client_addr,client_len);
+        return;
+    }
+    int bulk = bulk_find(req,0);
+    if(bulk == -1){
+        send_response(socket,GENERAL_ERROR,"Unknown bulk id\n",req,client_addr,client_len);
+        return;
+    }
+    char* end;
+    errno = 0;
+    unsigned long count = strtoul(req->args[1],&end,10);
+    if(errno != 0 || *end != '\0' || count > BULK_MAX_ENTRIES){
+        send_response(socket,GENERAL_ERROR,"Invalid operation count\n",req,client_addr,client_len);
+        return;
+    }
+    //no se descarta: el cliente puede reenviar lo que falta y volver a intentar
+    bulk_sort(bulk);
+    for(size_t i = 0; i < count; i++){
+        //ordenadas y sin repetir, la i tiene seq i salvo que falte alguna antes
+        if(i >= bulks[bulk].length || bulks[bulk].entries[i].seq != i){
+            snprintf(ans,DATA_SIZE,"Missing operation %zu\n",i);
+            send_response(socket,GENERAL_ERROR,ans,req,client_addr,client_len);
+            return;
+        }
+    }
+    //usersADT_apply necesita las operaciones contiguas
+    users_op* ops = malloc((count == 0 ? 1 : count) * sizeof(users_op));
+    if(ops == NULL){
+        log(LOG_ERROR,"[ADMIN] Unable to allocate memory for bulk commit");
+        send_response(socket,GENERAL_ERROR,"Out of memory, nothing applied\n",req,client_addr,client_len);
+        return;
+    }
+    for(size_t i = 0; i < count; i++){
+        ops[i] = bulks[bulk].entries[i].op;
+    }
+    long applied = usersADT_apply(args->users,ops,count);
+    if(applied < 0){
+        free(ops);
+        log(LOG_ERROR,"[ADMIN] Unable to allocate memory for bulk commit");
+        send_response(socket,GENERAL_ERROR,"Out of memory, nothing applied\n",req,client_addr,client_len);
+        return;
+    }
+    int len = snprintf(ans,DATA_SIZE,"applied=%ld failed=%ld\n",applied,(long) count - applied);
+    size_t reported = 0;
+    for(size_t i = 0; i < count && len >= 0 && len < DATA_SIZE && reported < BULK_MAX_REPORTED_FAILURES; i++){
+        if(ops[i].result != 0){
+            len += snprintf(ans + len,DATA_SIZE - len,"%zu %s %s\n",i,ops[i].name,
+                            ops[i].type == USERS_OP_ADD ? "already exists" : "unknown user");
+            reported++;
+        }
+    }
+    free(ops);
+    logf(LOG_INFO,"[ADMIN] Committed bulk %lu: %ld applied, %ld failed", bulks[bulk].id, applied, (long) count - applied);
+    bulk_free(bulk);
+    send_response(socket,OK,ans,req,client_addr,client_len);
+}
+
+void bulk_abort_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    if(req->arg_c<1){
+        logf(LOG_ERROR, "[ADMIN] Incorrect quantity of arguments, expected 1, got %ld", req->arg_c);
+        send_response(socket,GENERAL_ERROR,"Cantidad de argumentos incorrecta",req,client_addr,client_len);
+        return;
+    }
+    int bulk = bulk_find(req,0);
+    if(bulk == -1){
+        send_response(socket,GENERAL_ERROR,"Unknown bulk id\n",req,client_addr,client_len);
+        return;
+    }
+    logf(LOG_INFO,"[ADMIN] Aborted bulk %lu", bulks[bulk].id);
+    bulk_free(bulk);
+    send_response(socket,OK,"Bulk aborted\n",req,client_addr,client_len);
+}
+
 const char * get_status_message(admin_status status) {
     switch(status) {
         case OK:
@@ -408,3 +899,77 @@ const char * get_status_message(admin_status status) {
             return "General error";
     }
 }
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Self-profiling del loop (-P)
+ * --------------------------------------------------------------------------------------
+ */
+struct loop_report{
+    char* buff;
+    size_t size;
+    size_t written;
+};
+
+static void loop_report_append(struct loop_report* report, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void loop_report_append(struct loop_report* report, const char* fmt, ...){
+    if(report->written >= report->size){
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(report->buff + report->written, report->size - report->written, fmt, ap);
+    va_end(ap);
+    if(len > 0){
+        report->written += len;
+    }
+}
+
+// Agrega llamadas/total/max (en us) de un evento, si se llamo alguna vez
+static void loop_report_counter(struct loop_report* report, const char* event, const struct profile_counter* counter){
+    if(counter->calls == 0){
+        return;
+    }
+    loop_report_append(report, " %s=%lu/%lu/%lu", event, counter->calls, (unsigned long) (counter->total_ns / NS_PER_US),
+                       (unsigned long) (counter->max_ns / NS_PER_US));
+}
+
+static void loop_report_handler(const char* name, const struct profile_counter* read, const struct profile_counter* write,
+                                const struct profile_counter* block, void* data){
+    struct loop_report* report = data;
+    loop_report_append(report, "%s", name);
+    loop_report_counter(report, "r", read);
+    loop_report_counter(report, "w", write);
+    loop_report_counter(report, "b", block);
+    loop_report_append(report, "\n");
+}
+
+static void loop_report_state(const char* state, const struct profile_counter* counter, void* data){
+    struct loop_report* report = data;
+    loop_report_append(report, "%s", state);
+    loop_report_counter(report, "n", counter);
+    loop_report_append(report, "\n");
+}
+
+void stat_loop_action(int socket, request* req, struct pop3args* args,struct sockaddr_storage* client_addr, unsigned int client_len){
+    if(!args->loop_profile){
+        send_response(socket,GENERAL_ERROR,"Loop profiling is disabled, start the server with -P\n",req,client_addr,client_len);
+        return;
+    }
+    char ans[LOOP_DATA_SIZE];
+    struct loop_report report = {.buff = ans, .size = LOOP_DATA_SIZE};
+    struct profile_counter wait, busy;
+    selector_profile_loop(&wait, &busy);
+    //busy es cuanto tarda cada iteracion en atender todo lo que estaba listo, o sea el lag del loop
+    loop_report_append(&report, "calls/total/max us\nloop");
+    loop_report_counter(&report, "wait", &wait);
+    loop_report_counter(&report, "busy", &busy);
+    loop_report_append(&report, "\n");
+    selector_profile_foreach(loop_report_handler, &report);
+    pop3_state_profile_foreach(loop_report_state, &report);
+    if(report.written >= LOOP_DATA_SIZE){
+        log(LOG_WARNING,"[ADMIN] Loop profile response truncated");
+    }
+    log(LOG_DEBUG,"[ADMIN] Sending loop profile");
+    send_response(socket,OK,ans,req,client_addr,client_len);
+}
@@ -1,8 +1,20 @@
 #ifndef PROTOS_ADMIN_H
 #define PROTOS_ADMIN_H
 
+#include <stdbool.h>
+#include "selector.h"
 
 void admin_read(struct selector_key* key);
 
+/*
+ * Compara un token recibido con el del servidor (sin distinguir mayusculas), igual para el canal UDP y el TCP
+ */
+bool admin_valid_token(const char* token, const char* access_token);
+
+/*
+ * Libera las operaciones masivas que quedaron sin confirmar
+ */
+void admin_destroy(void);
+
 
 #endif //PROTOS_ADMIN_H
@@ -0,0 +1,340 @@
+#include <sys/types.h>   // socket
+#include <sys/socket.h>  // socket
+#include <sys/timerfd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "admin_stream.h"
+#include "admin.h"
+#include "args.h"
+#include "logging/logger.h"
+
+#define STREAM_LINE_SIZE 256
+#define STREAM_BUFFER_SIZE 4096
+#define STREAM_SNAPSHOT_SIZE 512 //lo que se reserva en el buffer para una linea STATS
+#define STREAM_DEFAULT_INTERVAL_MS 1000
+#define STREAM_MIN_INTERVAL_MS 100
+#define STREAM_MAX_INTERVAL_MS 3600000
+#define MS_PER_SECOND 1000
+#define NS_PER_MS 1000000
+
+struct stats_snapshot{
+    unsigned long connections;
+    unsigned long bytes;
+    unsigned long expunges;
+    unsigned long log_dropped;
+};
+
+/*
+ * Estado de una conexion al canal de administracion
+ * timer_fd es el timerfd de la suscripcion, -1 si no hay
+ */
+struct stream_connection{
+    struct pop3args* args;
+    int fd;
+    char request[STREAM_LINE_SIZE + 1];
+    size_t request_len;
+    char response[STREAM_BUFFER_SIZE];
+    size_t response_len;
+    bool authenticated;
+    bool closing; //se cierra cuando termine de mandar la respuesta
+    int timer_fd;
+    unsigned long interval_ms;
+    unsigned long skipped;
+    struct stats_snapshot last;
+};
+
+static void stream_read(struct selector_key* key);
+static void stream_write(struct selector_key* key);
+static void stream_close(struct selector_key* key);
+static void timer_read(struct selector_key* key);
+static void timer_close(struct selector_key* key);
+
+static const struct fd_handler stream_handler = {
+    .handle_read = stream_read,
+    .handle_write = stream_write,
+    .handle_close = stream_close,
+    .name = "admin-stream"
+};
+
+static const struct fd_handler timer_handler = {
+    .handle_read = timer_read,
+    .handle_close = timer_close,
+    .name = "admin-stream-timer"
+};
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Respuestas
+ * --------------------------------------------------------------------------------------
+ */
+static void take_snapshot(struct stats_snapshot* snapshot){
+    extern unsigned long historic_connections, bytes_sent, expunge_count;
+    snapshot->connections = historic_connections;
+    snapshot->bytes = bytes_sent;
+    snapshot->expunges = expunge_count;
+    snapshot->log_dropped = logger_get_dropped();
+}
+
+/*
+ * Agrega texto a la respuesta. Retorna false si no entra (y no agrega nada)
+ */
+static bool append(struct stream_connection* conn, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static bool append(struct stream_connection* conn, const char* fmt, ...){
+    size_t space = STREAM_BUFFER_SIZE - conn->response_len;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(conn->response + conn->response_len, space, fmt, ap);
+    va_end(ap);
+    if(len < 0 || (size_t) len >= space){
+        return false;
+    }
+    conn->response_len += len;
+    return true;
+}
+
+/*
+ * Agrega una linea STATS con los totales y lo que cambio desde la anterior de esta conexion
+ */
+static void append_stats(struct stream_connection* conn){
+    extern unsigned long current_connections;
+    if(STREAM_BUFFER_SIZE - conn->response_len < STREAM_SNAPSHOT_SIZE){
+        conn->skipped++;
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct stats_snapshot snapshot;
+    take_snapshot(&snapshot);
+    append(conn, "STATS ts_ms=%lld connections=%lu current=%lu bytes=%lu connections_delta=%lu bytes_delta=%lu"
+                 " expunges=%lu log_dropped=%lu log_backlog=%zu skipped=%lu\n",
+           (long long) now.tv_sec * MS_PER_SECOND + now.tv_nsec / NS_PER_MS, snapshot.connections, current_connections,
+           snapshot.bytes, snapshot.connections - conn->last.connections, snapshot.bytes - conn->last.bytes,
+           snapshot.expunges, snapshot.log_dropped, logger_get_backlog(), conn->skipped);
+    conn->last = snapshot;
+    conn->skipped = 0;
+}
+
+/*
+ * Pide escritura en la conexion solo si hay algo para mandar. key puede ser la del timer
+ * Si se esta cerrando no se lee mas: si siguiera pidiendo lectura, lo que mande el cliente la dejaria siempre lista
+ */
+static void update_interest(struct selector_key* key, int fd){
+    struct stream_connection* conn = key->data;
+    fd_interest interest = conn->response_len > 0 ? OP_READ | OP_WRITE : OP_READ;
+    if(conn->closing){
+        interest = OP_WRITE;
+    }
+    if(selector_set_interest(key->s, fd, interest) != SELECTOR_SUCCESS){
+        selector_unregister_fd(key->s, fd);
+    }
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Comandos
+ * --------------------------------------------------------------------------------------
+ */
+static void unsubscribe(struct selector_key* key){
+    struct stream_connection* conn = key->data;
+    if(conn->timer_fd != -1){
+        selector_unregister_fd(key->s, conn->timer_fd);
+    }
+}
+
+static void subscribe(struct selector_key* key, const char* arg){
+    struct stream_connection* conn = key->data;
+    unsigned long interval = STREAM_DEFAULT_INTERVAL_MS;
+    if(arg != NULL){
+        char* end;
+        errno = 0;
+        interval = strtoul(arg, &end, 10);
+        if(errno != 0 || *end != '\0' || interval < STREAM_MIN_INTERVAL_MS || interval > STREAM_MAX_INTERVAL_MS){
+            append(conn, "-ERR Interval must be between %d and %d ms\n", STREAM_MIN_INTERVAL_MS, STREAM_MAX_INTERVAL_MS);
+            return;
+        }
+    }
+    if(conn->timer_fd == -1){
+        int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(timer_fd == -1){
+            log(LOG_ERROR, "[ADMIN] Unable to create subscription timer");
+            append(conn, "-ERR Unable to create timer\n");
+            return;
+        }
+        if(selector_register(key->s, timer_fd, &timer_handler, OP_READ, conn) != SELECTOR_SUCCESS){
+            log(LOG_ERROR, "[ADMIN] Unable to register subscription timer");
+            close(timer_fd);
+            append(conn, "-ERR Unable to create timer\n");
+            return;
+        }
+        conn->timer_fd = timer_fd;
+    }
+    struct itimerspec spec = {
+        .it_interval = {.tv_sec = interval / MS_PER_SECOND, .tv_nsec = (interval % MS_PER_SECOND) * NS_PER_MS},
+    };
+    spec.it_value = spec.it_interval;
+    if(timerfd_settime(conn->timer_fd, 0, &spec, NULL) == -1){
+        log(LOG_ERROR, "[ADMIN] Unable to start subscription timer");
+        unsubscribe(key);
+        append(conn, "-ERR Unable to start timer\n");
+        return;
+    }
+    conn->interval_ms = interval;
+    logf(LOG_INFO, "[ADMIN] Socket %d subscribed to stats every %lu ms", key->fd, interval);
+    append(conn, "+OK Subscribed interval_ms=%lu\n", interval);
+    append_stats(conn);
+}
+
+static void process_line(struct selector_key* key, char* line){
+    struct stream_connection* conn = key->data;
+    char* save;
+    char* command = strtok_r(line, " \r", &save);
+    char* arg = strtok_r(NULL, " \r", &save);
+    if(command == NULL){
+        return;
+    }
+    if(strcasecmp(command, "QUIT") == 0){
+        append(conn, "+OK Bye\n");
+        conn->closing = true;
+    }else if(strcasecmp(command, "AUTH") == 0){
+        if(arg == NULL || !admin_valid_token(arg, conn->args->access_token)){
+            logf(LOG_WARNING, "[ADMIN] Invalid authentication token on socket %d", key->fd);
+            append(conn, "-ERR Invalid authentication token\n");
+            conn->closing = true;
+        }else{
+            conn->authenticated = true;
+            append(conn, "+OK\n");
+        }
+    }else if(!conn->authenticated){
+        append(conn, "-ERR Authentication required\n");
+    }else if(strcasecmp(command, "SNAPSHOT") == 0){
+        append_stats(conn);
+    }else if(strcasecmp(command, "SUBSCRIBE") == 0){
+        subscribe(key, arg);
+    }else if(strcasecmp(command, "UNSUBSCRIBE") == 0){
+        unsubscribe(key);
+        append(conn, "+OK\n");
+    }else{
+        append(conn, "-ERR Unknown command\n");
+    }
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Funciones utilizadas por el selector
+ * --------------------------------------------------------------------------------------
+ */
+void admin_stream_passive_accept(struct selector_key* key){
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    struct stream_connection* conn = NULL;
+    const int client_fd = accept(key->fd, (struct sockaddr *) &address, &address_len);
+    if(client_fd == -1){
+        log(LOG_ERROR, "[ADMIN] Error accepting TCP connection");
+        return;
+    }
+    if(selector_fd_set_nio(client_fd) == -1){
+        log(LOG_ERROR, "[ADMIN] Error setting TCP connection as non-blocking");
+        goto fail;
+    }
+    conn = calloc(1, sizeof(struct stream_connection));
+    if(conn == NULL){
+        log(LOG_ERROR, "[ADMIN] Error reserving memory for TCP connection");
+        goto fail;
+    }
+    conn->args = key->data;
+    conn->fd = client_fd;
+    conn->timer_fd = -1;
+    take_snapshot(&conn->last);
+    if(selector_register(key->s, client_fd, &stream_handler, OP_READ, conn) != SELECTOR_SUCCESS){
+        log(LOG_ERROR, "[ADMIN] Failed to register TCP connection");
+        goto fail;
+    }
+    logf(LOG_DEBUG, "[ADMIN] Accepted TCP connection on socket %d", client_fd);
+    return;
+
+fail:
+    close(client_fd);
+    free(conn);
+}
+
+static void stream_read(struct selector_key* key){
+    struct stream_connection* conn = key->data;
+    if(conn->closing){
+        return;
+    }
+    ssize_t read_count = recv(key->fd, conn->request + conn->request_len, STREAM_LINE_SIZE - conn->request_len, 0);
+    if(read_count <= 0){
+        if(read_count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+            selector_unregister_fd(key->s, key->fd);
+        }
+        return;
+    }
+    conn->request_len += read_count;
+    conn->request[conn->request_len] = '\0';
+
+    char* line = conn->request;
+    char* end;
+    while(!conn->closing && (end = strchr(line, '\n')) != NULL){
+        *end = '\0';
+        process_line(key, line);
+        line = end + 1;
+    }
+    conn->request_len -= line - conn->request;
+    memmove(conn->request, line, conn->request_len + 1);
+    if(conn->request_len == STREAM_LINE_SIZE){
+        append(conn, "-ERR Line too long\n");
+        conn->closing = true;
+    }
+    update_interest(key, key->fd);
+}
+
+static void stream_write(struct selector_key* key){
+    struct stream_connection* conn = key->data;
+    ssize_t sent_count = send(key->fd, conn->response, conn->response_len, MSG_NOSIGNAL);
+    if(sent_count == -1){
+        if(errno != EAGAIN && errno != EWOULDBLOCK){
+            selector_unregister_fd(key->s, key->fd);
+        }
+        return;
+    }
+    conn->response_len -= sent_count;
+    memmove(conn->response, conn->response + sent_count, conn->response_len);
+    if(conn->response_len == 0 && conn->closing){
+        selector_unregister_fd(key->s, key->fd);
+        return;
+    }
+    update_interest(key, key->fd);
+}
+
+static void stream_close(struct selector_key* key){
+    struct stream_connection* conn = key->data;
+    unsubscribe(key);
+    logf(LOG_DEBUG, "[ADMIN] Closing TCP connection on socket %d", key->fd);
+    close(key->fd);
+    free(conn);
+}
+
+static void timer_read(struct selector_key* key){
+    struct stream_connection* conn = key->data;
+    uint64_t expirations;
+    if(read(key->fd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+        return;
+    }
+    //si se atraso el loop, se junta todo en una sola linea
+    append_stats(conn);
+    //comparten los datos, pero hay que escribir en el fd de la conexion
+    update_interest(key, conn->fd);
+}
+
+static void timer_close(struct selector_key* key){
+    struct stream_connection* conn = key->data;
+    close(key->fd);
+    conn->timer_fd = -1;
+}
@@ -0,0 +1,21 @@
+#ifndef ADMIN_STREAM_H_Tn4WqLc8Rz2XvB6mKd9YhP3sJ
+#define ADMIN_STREAM_H_Tn4WqLc8Rz2XvB6mKd9YhP3sJ
+
+#include "selector.h"
+
+/*
+ * Canal de administracion por TCP, en el mismo selector que POP3
+ *
+ * El protocolo es de lineas terminadas en \n. Primero hay que autenticarse con AUTH <token>; despues:
+ *   SNAPSHOT          una linea STATS con las metricas actuales
+ *   SUBSCRIBE [ms]    una linea STATS cada ms milisegundos (default 1000) hasta UNSUBSCRIBE o cerrar la conexion
+ *   UNSUBSCRIBE
+ *   QUIT
+ * Cada comando responde +OK o -ERR en una linea. Si el cliente no lee, las lineas STATS que no entran en el buffer
+ * se saltean y la siguiente lo indica en skipped
+ *
+ * El socket pasivo se registra con este handler de lectura y los pop3args como dato (para el token)
+ */
+void admin_stream_passive_accept(struct selector_key* key);
+
+#endif
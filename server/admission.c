@@ -0,0 +1,135 @@
+#include <string.h>
+#include <netinet/in.h>
+#include "admission.h"
+#include "timing.h"
+
+#define ADMISSION_TABLE_SIZE 4096 //potencia de 2
+#define ADMISSION_MAX_PROBES 32   //entradas que se miran antes de dar la tabla por llena
+#define ADMISSION_WINDOW_S 1      //ventana de -r
+#define IPV6_PREFIX_BYTES 8       //se cuenta por /64
+#define US_PER_SECOND 1000000
+#define FNV_PRIME 1099511628211ULL
+
+struct admission_entry{
+    admission_key key;
+    uint32_t connections;   //abiertas ahora
+    uint32_t window_count;  //nuevas en la ventana actual
+    uint32_t window_start;  //segundo (monotonico) en que empezo la ventana
+    bool used;              //una vez usada sigue siendo parte de las cadenas de busqueda aunque se venza
+};
+
+static struct admission_entry table[ADMISSION_TABLE_SIZE];
+//semilla del hash, para que no se puedan elegir direcciones que caigan todas en la misma cadena
+static uint64_t seed = 0;
+static unsigned long table_full = 0;
+
+static const char* result_names[ADMISSION_RESULTS] = {
+    "ok", "max_connections", "ip_connections", "ip_rate"
+};
+
+void admission_key_init(admission_key* key, const struct sockaddr_storage* address){
+    memset(key, 0, sizeof(*key));
+    if(address->ss_family == AF_INET){
+        //como IPv4 mapeada, para que cuente igual si llega por el socket IPv6
+        const struct sockaddr_in* in = (const struct sockaddr_in*) address;
+        key->addr[10] = 0xff;
+        key->addr[11] = 0xff;
+        memcpy(key->addr + 12, &in->sin_addr, sizeof(in->sin_addr));
+    }else if(address->ss_family == AF_INET6){
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) address;
+        if(IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)){
+            memcpy(key->addr, &in6->sin6_addr, sizeof(key->addr));
+        }else{
+            memcpy(key->addr, &in6->sin6_addr, IPV6_PREFIX_BYTES);
+        }
+    }
+}
+
+static size_t hash(const admission_key* key){
+    uint64_t h = seed;
+    for(size_t i = 0; i < sizeof(key->addr); i++){
+        h = (h ^ key->addr[i]) * FNV_PRIME;
+    }
+    return (size_t) (h ^ (h >> 32));
+}
+
+static bool expired(const struct admission_entry* entry, uint32_t now){
+    return entry->connections == 0 && now - entry->window_start >= ADMISSION_WINDOW_S;
+}
+
+/*
+ * Busca la entrada de key. Si no esta y create es true, usa la primera libre o vencida del camino
+ * Retorna NULL si no esta (o si no hay lugar)
+ */
+static struct admission_entry* find(const admission_key* key, uint32_t now, bool create){
+    if(seed == 0){
+        seed = timing_now_us() | 1;
+    }
+    struct admission_entry* reusable = NULL;
+    size_t index = hash(key);
+    for(int i = 0; i < ADMISSION_MAX_PROBES; i++, index++){
+        struct admission_entry* entry = &table[index & (ADMISSION_TABLE_SIZE - 1)];
+        if(!entry->used){
+            //fin de la cadena: no esta
+            if(reusable == NULL){
+                reusable = entry;
+            }
+            break;
+        }
+        if(memcmp(&entry->key, key, sizeof(*key)) == 0){
+            return entry;
+        }
+        if(reusable == NULL && expired(entry, now)){
+            reusable = entry;
+        }
+    }
+    if(!create || reusable == NULL){
+        return NULL;
+    }
+    reusable->key = *key;
+    reusable->connections = 0;
+    reusable->window_count = 0;
+    reusable->window_start = now;
+    reusable->used = true;
+    return reusable;
+}
+
+admission_result admission_enter(const admission_key* key, unsigned long ip_connections, unsigned long ip_rate, bool* tracked){
+    *tracked = false;
+    uint32_t now = (uint32_t) (timing_now_us() / US_PER_SECOND);
+    struct admission_entry* entry = find(key, now, true);
+    if(entry == NULL){
+        table_full++;
+        return ADMISSION_OK;
+    }
+    if(now - entry->window_start >= ADMISSION_WINDOW_S){
+        entry->window_start = now;
+        entry->window_count = 0;
+    }
+    if(ip_connections != 0 && entry->connections >= ip_connections){
+        return ADMISSION_IP_CONNECTIONS;
+    }
+    if(ip_rate != 0 && entry->window_count >= ip_rate){
+        return ADMISSION_IP_RATE;
+    }
+    entry->connections++;
+    entry->window_count++;
+    *tracked = true;
+    return ADMISSION_OK;
+}
+
+void admission_leave(const admission_key* key){
+    //con create en false no se modifica nada, el tiempo no importa
+    struct admission_entry* entry = find(key, 0, false);
+    if(entry != NULL && entry->connections > 0){
+        entry->connections--;
+    }
+}
+
+const char* admission_result_name(admission_result result){
+    return result < ADMISSION_RESULTS ? result_names[result] : "unknown";
+}
+
+unsigned long admission_table_full(void){
+    return table_full;
+}
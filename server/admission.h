@@ -0,0 +1,56 @@
+#ifndef ADMISSION_H_Qx7TnV3kPz9LmW4cRb2YsH6dJ
+#define ADMISSION_H_Qx7TnV3kPz9LmW4cRb2YsH6dJ
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Limites por IP de las conexiones POP3 (-I conexiones abiertas a la vez, -r conexiones nuevas por segundo)
+ *
+ * Se guarda una entrada por direccion en una tabla de tamaño fijo (open addressing). Una entrada sin conexiones
+ * abiertas y con la ventana de un segundo vencida se puede reusar para otra direccion, asi que la tabla no crece
+ * ni hay que limpiarla. Si no hay lugar se deja pasar la conexion sin contarla (la cubre el limite global -C)
+ *
+ * Las IPv4 (tambien las mapeadas en IPv6) se cuentan por direccion y las IPv6 por /64, que es lo que suele tener
+ * un cliente
+ */
+typedef struct admission_key{
+    uint8_t addr[16];
+}admission_key;
+
+typedef enum{
+    ADMISSION_OK,
+    ADMISSION_MAX_CONNECTIONS,  //-C, lo chequea quien llama con las conexiones actuales
+    ADMISSION_IP_CONNECTIONS,   //-I
+    ADMISSION_IP_RATE,          //-r
+    ADMISSION_RESULTS
+}admission_result;
+
+/*
+ * Arma la clave de la direccion del cliente (AF_INET o AF_INET6)
+ */
+void admission_key_init(admission_key* key, const struct sockaddr_storage* address);
+
+/*
+ * Cuenta una conexion nueva de key si entra en los limites (0 es sin limite)
+ * Deja *tracked en true si quedo contada, y entonces hay que llamar a admission_leave cuando se cierre
+ */
+admission_result admission_enter(const admission_key* key, unsigned long ip_connections, unsigned long ip_rate, bool* tracked);
+
+/*
+ * Descuenta una conexion de key que quedo contada en admission_enter
+ */
+void admission_leave(const admission_key* key);
+
+/*
+ * Nombre del resultado, para logs y metricas
+ */
+const char* admission_result_name(admission_result result);
+
+/*
+ * Veces que no hubo lugar en la tabla y se dejo pasar una conexion sin contarla
+ */
+unsigned long admission_table_full(void);
+
+#endif
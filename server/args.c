@@ -41,6 +41,30 @@ max_mails(const char *s) {
     return sl;
 }
 
+static unsigned long
+non_negative(const char *s, const char * name) {
+    char *end     = 0;
+    errno = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s|| '\0' != *end
+        || ((LONG_MIN == sl || LONG_MAX == sl) && ERANGE == errno) || sl < 0) {
+        fprintf(stderr, "%s should be a non negative number: %s\n", name, s);
+        exit(1);
+    }
+    return sl;
+}
+
+static int
+backlog(const char *s) {
+    const unsigned long backlog = non_negative(s, "listen backlog");
+    if(backlog == 0 || backlog > INT_MAX) {
+        fprintf(stderr, "listen backlog should be between 1 and %d: %s\n", INT_MAX, s);
+        exit(1);
+    }
+    return (int) backlog;
+}
+
 static char * path(const char * path){
     unsigned int path_len = strlen(path);
     char * ret_str = calloc(path_len+1,sizeof (char));
@@ -113,12 +137,27 @@ usage(const char *progname) {
         "\n"
         "   -h               Ayuda.\n"
         "   -p <POP3 port>   Puerto entrante para conexiones POP3.\n"
+        "   -c <port>        Puerto TCP de administracion (suscripcion a estadisticas, popadmin -W usa el 1101). Default: deshabilitado.\n"
         "   -d <path>        Path del directorio Maildir.\n"
         "   -u <name>:<pass> Usuario y contraseña de usuario POP3. Indicarlo para cada usuario que se desea agregar\n"
         "   -l <log level>   Nivel de log. Valores posibles: DEBUG, INFO, WARNING, ERROR, FATAL. Default: INFO.\n"
         "   -v               Imprime información sobre la versión.\n"
         "   -m <max>         La cantidad maxima de mails que lee el servidor de maildir para un usuario\n"
         "   -t <token>       Token utilizado por el cliente para realizar cambios en el servidor\n"
+        "   -B               Escribir los logs en formato binario (se leen con popserver-logdump).\n"
+        "   -R <bytes>       Rotar el archivo de logs cuando llega a ese tamaño. Default: 0 (no rotar).\n"
+        "   -T <segundos>    Rotar el archivo de logs cada tantos segundos. Default: 0 (no rotar).\n"
+        "   -K <bytes>       Maximo de logs en memoria esperando a ser escritos, el resto se descarta. Default: 0 (solo el buffer de cada hilo).\n"
+        "   -M <port>        Puerto HTTP para las metricas en formato Prometheus (GET /metrics). Default: deshabilitado.\n"
+        "   -a               Access log: un registro [ACCESS] por sesion (usuario, duracion, comandos, bytes, RETR, DELE).\n"
+        "   -A <N>           Como -a, y ademas loggea la latencia de uno de cada N comandos.\n"
+        "   -q <N>           Largo de la cola de conexiones POP3 pendientes de aceptar (listen). Default: 20.\n"
+        "   -C <N>           Maximo de conexiones POP3 abiertas, las demas se rechazan. Default: 0 (sin limite).\n"
+        "   -I <N>           Maximo de conexiones POP3 abiertas por IP (por /64 en IPv6). Default: 0 (sin limite).\n"
+        "   -r <N>           Maximo de conexiones POP3 nuevas por segundo por IP (por /64 en IPv6). Default: 0 (sin limite).\n"
+        "   -E               Usar epoll en lugar de pselect, con las conexiones POP3 edge-triggered.\n"
+        "   -P               Medir el tiempo de cada handler del selector y de cada estado de las conexiones (popadmin -P).\n"
+        "   -S               No confiar en el tamaño que indica el nombre de los mails (,S=<size>), hacer siempre stat\n"
         "\n",
         progname);
 }
@@ -128,7 +167,7 @@ parse_args(const int argc, const char **argv, struct pop3args *args) {
     memset(args, 0, sizeof(*args)); // sobre todo para setear en null los punteros de users
 
     args->pop3_port = DEFAULT_POP3_PORT;
-    args->pop3_config_port = DEFAULT_POP3_CONFIG_PORT;
+    args->pop3_config_port = 0; //el canal TCP de administracion se habilita con -c
     args->maildir_path = NULL;
     args->max_mails = DEFAULT_MAX_MAILS;
     args->users = usersADT_init();
@@ -137,12 +176,14 @@ parse_args(const int argc, const char **argv, struct pop3args *args) {
     }
     args->log_level = LOG_INFO;
     args->access_token = DEFAULT_ACCESS_TOKEN;
+    args->size_hints = true;
+    args->listen_backlog = DEFAULT_LISTEN_BACKLOG;
 
     int c;
     int nusers = 0;
 
     while (true) {
-        c = getopt(argc, (char *const *) argv, "hp:u:vd:m:l:t:");
+        c = getopt(argc, (char *const *) argv, "hp:c:u:vd:m:l:t:SBR:T:K:aA:M:PEq:C:I:r:");
         if (c == -1) {
             break;
         }
@@ -154,6 +195,9 @@ parse_args(const int argc, const char **argv, struct pop3args *args) {
             case 'p':
                 args->pop3_port = port(optarg);
                 break;
+            case 'c':
+                args->pop3_config_port = port(optarg);
+                break;
             case 'u':
                 if(nusers >= MAX_USERS) {
                     fprintf(stderr, "maximun number of command line users reached: %d.\n", MAX_USERS);
@@ -180,6 +224,49 @@ parse_args(const int argc, const char **argv, struct pop3args *args) {
             case 't':
                 args->access_token = optarg;
                 break;
+            case 'S':
+                args->size_hints = false;
+                break;
+            case 'B':
+                args->binary_log = true;
+                break;
+            case 'R':
+                args->log_rotate_bytes = non_negative(optarg, "log rotation size");
+                break;
+            case 'T':
+                args->log_rotate_seconds = non_negative(optarg, "log rotation time");
+                break;
+            case 'K':
+                args->log_backlog_limit = non_negative(optarg, "log backlog limit");
+                break;
+            case 'M':
+                args->metrics_port = port(optarg);
+                break;
+            case 'a':
+                args->access_log = true;
+                break;
+            case 'A':
+                args->access_log = true;
+                args->access_sample = non_negative(optarg, "access log sample");
+                break;
+            case 'P':
+                args->loop_profile = true;
+                break;
+            case 'E':
+                args->epoll = true;
+                break;
+            case 'q':
+                args->listen_backlog = backlog(optarg);
+                break;
+            case 'C':
+                args->max_connections = non_negative(optarg, "max connections");
+                break;
+            case 'I':
+                args->ip_connections = non_negative(optarg, "max connections per IP");
+                break;
+            case 'r':
+                args->ip_rate = non_negative(optarg, "connections per second per IP");
+                break;
             default:
                 fprintf(stderr, "Unknown argument: '%c'.\n", c);
                 exit(1);
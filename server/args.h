@@ -10,16 +10,31 @@
 #define DEFAULT_MAILDIR_PATH "/var/mail/"
 #define DEFAULT_MAX_MAILS 20
 #define MAX_USERS 500
+#define DEFAULT_LISTEN_BACKLOG 20
 
 
 struct pop3args {
     unsigned short  pop3_port;
     unsigned short  pop3_config_port;
+    unsigned short  metrics_port;
     char *          maildir_path;
     log_level_t     log_level;
     usersADT        users;
     unsigned long   max_mails;
     char*           access_token;
+    bool            size_hints;
+    bool            binary_log;
+    unsigned long   log_rotate_bytes;
+    unsigned long   log_rotate_seconds;
+    unsigned long   log_backlog_limit;
+    bool            access_log;
+    unsigned long   access_sample;
+    bool            loop_profile;
+    bool            epoll;
+    int             listen_backlog;
+    unsigned long   max_connections;
+    unsigned long   ip_connections;
+    unsigned long   ip_rate;
 };
 
 /**
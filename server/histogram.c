@@ -0,0 +1,92 @@
+#include <string.h>
+#include "histogram.h"
+
+#define HISTOGRAM_MAX_VALUE ((UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1)
+
+// Posicion del bit mas significativo (value > 0)
+static unsigned msb(uint64_t value) {
+#if defined(__GNUC__)
+    return 63 - (unsigned) __builtin_clzll(value);
+#else
+    unsigned bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static size_t bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (size_t) value;
+    }
+    if (value > HISTOGRAM_MAX_VALUE) {
+        value = HISTOGRAM_MAX_VALUE;
+    }
+    unsigned shift = msb(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    // (value >> shift) esta entre HISTOGRAM_SUB_BUCKETS y 2 * HISTOGRAM_SUB_BUCKETS - 1
+    return (size_t) (shift + 1) * HISTOGRAM_SUB_BUCKETS + (size_t) ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// Mayor valor que cae en el bucket
+static uint64_t bucket_upper(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = (unsigned) (index / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t mantissa = HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void histogram_reset(struct histogram * h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void histogram_record(struct histogram * h, uint64_t value) {
+    h->counts[bucket_index(value)]++;
+    h->count++;
+    h->total += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void histogram_merge(struct histogram * dst, const struct histogram * src) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->count += src->count;
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t histogram_percentile(const struct histogram * h, double percentile) {
+    if (h->count == 0) {
+        return 0;
+    }
+    if (percentile < 0) {
+        percentile = 0;
+    } else if (percentile > 100) {
+        percentile = 100;
+    }
+    // Cantidad de valores que tienen que quedar a la izquierda (al menos 1)
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) h->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t upper = bucket_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+uint64_t histogram_mean(const struct histogram * h) {
+    return h->count == 0 ? 0 : h->total / h->count;
+}
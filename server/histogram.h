@@ -0,0 +1,56 @@
+#ifndef HISTOGRAM_H_Qm3VtZr8Lk2WxN6bYc9PfJs4D
+#define HISTOGRAM_H_Qm3VtZr8Lk2WxN6bYc9PfJs4D
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Histograma log-lineal (al estilo HDR) para latencias en microsegundos
+ *
+ * Los valores menores a HISTOGRAM_SUB_BUCKETS tienen un bucket cada uno. El resto se separa por potencia de 2,
+ * y cada potencia en HISTOGRAM_SUB_BUCKETS buckets iguales, asi el error relativo de un percentil es a lo sumo
+ * 1/HISTOGRAM_SUB_BUCKETS (6.25%) sin importar la magnitud. Los valores de mas de HISTOGRAM_MAX_BITS bits
+ * (unas 19 horas en microsegundos) se cuentan en el ultimo bucket.
+ *
+ * Registrar un valor es O(1) y no reserva memoria; el struct se puede declarar global o en el stack.
+ * No es thread safe: cada hilo usa el suyo y se juntan con histogram_merge
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+};
+
+/*
+ * Deja al histograma vacio
+ */
+void histogram_reset(struct histogram * h);
+
+/*
+ * Registra un valor
+ */
+void histogram_record(struct histogram * h, uint64_t value);
+
+/*
+ * Suma los valores de src a dst
+ */
+void histogram_merge(struct histogram * dst, const struct histogram * src);
+
+/*
+ * Valor del percentil (entre 0 y 100): el mayor valor del bucket donde cae, o el maximo registrado si es menor
+ * Retorna 0 si el histograma esta vacio
+ */
+uint64_t histogram_percentile(const struct histogram * h, double percentile);
+
+/*
+ * Promedio de los valores registrados, 0 si esta vacio
+ */
+uint64_t histogram_mean(const struct histogram * h);
+
+#endif
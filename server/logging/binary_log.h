@@ -0,0 +1,35 @@
+#ifndef _BINARY_LOG_H_
+#define _BINARY_LOG_H_
+
+// Formato de los logs binarios (ver logger_set_format), lo comparten el logger y popserver-logdump
+//
+// El archivo empieza con BINLOG_MAGIC y BINLOG_ENDIAN_CHECK (uint32, en el orden de bytes del servidor)
+// Despues vienen registros, cada uno empieza con un byte con su tipo y un uint16 con el largo del resto:
+//
+//   BINLOG_RECORD_FORMAT: uint32 id, el string de formato (sin '\0')
+//       Se escribe una sola vez por cada logf, antes que el primer BINLOG_RECORD_LOG que lo use
+//   BINLOG_RECORD_LOG: uint64 microsegundos desde epoch, uint8 nivel, uint32 id del formato, argumentos
+//       Cada argumento es un byte con su tipo (BINLOG_ARG_*) seguido del valor:
+//       int64 / uint64 / double, o uint16 largo + bytes para los strings
+//
+// Los numeros se escriben con el orden de bytes del servidor, sin alinear
+
+#define BINLOG_MAGIC "POPBLOG1"
+#define BINLOG_MAGIC_LENGTH 8
+#define BINLOG_ENDIAN_CHECK 0x01020304u
+
+#define BINLOG_RECORD_FORMAT 'F'
+#define BINLOG_RECORD_LOG 'R'
+
+#define BINLOG_ARG_INT 'i'
+#define BINLOG_ARG_UINT 'u'
+#define BINLOG_ARG_DOUBLE 'd'
+#define BINLOG_ARG_STRING 's'
+#define BINLOG_ARG_POINTER 'p'
+
+/* tipo + largo */
+#define BINLOG_RECORD_HEADER_LENGTH 3
+/* microsegundos + nivel + id */
+#define BINLOG_LOG_HEADER_LENGTH (8 + 1 + 4)
+
+#endif
@@ -1,31 +1,46 @@
 #include "logger.h"
+#include "binary_log.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #define DEFAULT_LOG_FOLDER "./log"
-#define DEFAULT_LOG_FILE (DEFAULT_LOG_FOLDER "/%04d-%02d-%02d_%02d-%02d-%02d.log")
-#define DEFAULT_LOG_FILE_MAXSTRLEN 48
-
-/* Tamaño minimo para el buffer */
-#define LOG_MIN_BUFFER_SIZE 0x1000 // 4 KBs
-/* Tamaño maximo para el buffer */
-#define LOG_MAX_BUFFER_SIZE 0x400000 // 4 MBs
-/* De a cuanto se agranda el buffer */
-#define LOG_BUFFER_SIZE_CHUNK 0x1000 // 4 KBs
-/* Tamaño maximo que un unico log deberia requerir */
-#define LOG_BUFFER_MAX_PRINT_LENGTH 0x200 // 512 bytes
+#define DEFAULT_LOG_FILE (DEFAULT_LOG_FOLDER "/%04d-%02d-%02d_%02d-%02d-%02d%s")
+#define LOG_FILE_EXTENSION ".log"
+#define BINARY_LOG_FILE_EXTENSION ".blog"
+#define DEFAULT_LOG_FILE_MAXSTRLEN 64
+/* Si ya existe un archivo con el nombre al rotar, se agrega -1, -2, ... */
+#define LOG_ROTATION_SUFFIX "-%u"
+#define LOG_ROTATION_MAX_SUFFIX 1000
+
+/* Tamaño del buffer circular de cada hilo (tiene que ser potencia de 2) */
+#define LOG_RING_SIZE 0x10000 // 64 KBs
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+/* Cada cuanto revisa los buffers el hilo del logger aunque nadie lo despierte */
+#define LOG_WRITER_PERIOD_NS 100000000 // 100 ms
+#define NANOS_PER_SECOND 1000000000
+/* [YYYY-DD-MM HH:MM:SS], con lugar para enteros de cualquier tamaño (el compilador no sabe los rangos de struct tm) */
+#define LOG_TIMESTAMP_MAX_LENGTH 80
 
 /* 0666 para darle permisos en la creación del archivo */
 #define LOG_FILE_PERMISSION_BITS 0666
 /* 0777 para poder entrar al directorio */
 #define LOG_FOLDER_PERMISSION_BITS 0777
-#define LOG_FILE_OPEN_FLAGS (O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK)
+#define LOG_FILE_OPEN_FLAGS (O_WRONLY | O_APPEND | O_CREAT)
+/* Al rotar no seguimos un archivo existente, que ya podria estar lleno */
+#define LOG_ROTATED_FILE_OPEN_FLAGS (LOG_FILE_OPEN_FLAGS | O_EXCL)
 
 const char* logger_get_level_string(log_level_t level) {
     switch (level) {
@@ -46,104 +61,249 @@ const char* logger_get_level_string(log_level_t level) {
 
 #ifndef DISABLE_LOGGER
 
-
-static char* buffer = NULL;
-static size_t buffer_start = 0, buffer_length = 0, buffer_capacity = 0;
+/*
+ Buffer circular de un hilo: el hilo dueño es el unico que escribe (avanza head)
+ y el hilo del logger el unico que lee (avanza tail). head y tail no vuelven a 0, la posicion es
+ head & LOG_RING_MASK. Solo tiene lineas completas, asi no se mezclan lineas de distintos hilos
+ */
+struct log_ring {
+    char data[LOG_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    /* El hilo dueño termino: cuando se vacia, el hilo del logger lo libera */
+    atomic_bool retired;
+    struct log_ring* next;
+};
+
+/* Lista de buffers de todos los hilos. Se agregan al principio, solo el hilo del logger los saca */
+static struct log_ring* rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Para enterarnos cuando termina un hilo que loggeo (llama a retire_ring) */
+static pthread_key_t ring_key;
+static _Thread_local struct log_ring* thread_ring = NULL;
+
+/* Ultima hora formateada por este hilo, localtime_r solo se llama cuando cambia el segundo */
+static _Thread_local time_t timestamp_second = (time_t) -1;
+static _Thread_local char timestamp[LOG_TIMESTAMP_MAX_LENGTH];
+
+static pthread_t writer;
+static sem_t writer_sem;
+static atomic_bool running = false;
+static atomic_ulong dropped = 0;
+/* Bytes en los buffers que todavia no se escribieron, y el maximo permitido (0 sin limite) */
+static atomic_size_t backlog = 0;
+static size_t backlog_limit = 0;
+
+/* Rotacion: se abre otro archivo cuando el actual llega a rotate_bytes o tiene rotate_seconds (0 para no rotar) */
+static size_t rotate_bytes = 0;
+static unsigned rotate_seconds = 0;
+static atomic_ulong rotations = 0;
+/* Solo los usa el hilo del logger (y logger_init antes de crearlo) */
+static char log_file_name[DEFAULT_LOG_FILE_MAXSTRLEN + 1];
+static size_t file_bytes = 0;
+static time_t file_opened = 0;
+
+static void maybe_rotate();
 
 /* File descriptor para el archivo a escribir */
 static int log_file_fd = -1;
-static fd_selector selector = NULL;
-static log_level_t log_level = MIN_LOG_LEVEL;
+static atomic_int log_level = MIN_LOG_LEVEL;
 
 /* Stream a escribir logs, por ejemplo stdout */
 static FILE* log_stream = NULL;
+static log_output_t output = LOG_OUTPUT_TEXT;
 
-static void make_buffer_space(size_t len) {
-    if (buffer_length + buffer_start + len > buffer_capacity) {
-        if (len < buffer_capacity - buffer_length) {
-            //Tengo espacio suficiente si muevo memoria al principio
-            //el espacio antes de start (buffer_start) y despues de end (buffer_capacity - buffer_start - buffer_length) sumados
-            //es mayor al que necesito
-            memmove(buffer, buffer + buffer_start, buffer_length);
-            buffer_start = 0;
-        } else if (buffer_capacity < LOG_MAX_BUFFER_SIZE) {
-            //Si puedo agrandarlo, lo hago
-            size_t new_buffer_capacity = buffer_length + len;
-            new_buffer_capacity = (new_buffer_capacity + LOG_BUFFER_SIZE_CHUNK - 1) / LOG_BUFFER_SIZE_CHUNK * LOG_BUFFER_SIZE_CHUNK;
-            if (new_buffer_capacity > LOG_MAX_BUFFER_SIZE)
-                new_buffer_capacity = LOG_MAX_BUFFER_SIZE;
-
-            void* new_buffer = malloc(new_buffer_capacity);
-            if (new_buffer == NULL) {
-                memmove(buffer, buffer + buffer_start, buffer_length);
-                buffer_start = 0;
-            } else {
-                memcpy(new_buffer, buffer + buffer_start, buffer_length);
-                free(buffer);
-                buffer = new_buffer;
-                buffer_capacity = new_buffer_capacity;
-                buffer_start = 0;
+/*
+ Formatos registrados para el modo binario, el id es la posicion + 1
+ El hilo del logger escribe los que agregaron desde la ultima vez antes de vaciar los buffers,
+ asi el formato siempre queda antes que los registros que lo usan
+ */
+static struct log_format_site** formats = NULL;
+static uint32_t formats_count = 0, formats_capacity = 0, formats_written = 0;
+static pthread_mutex_t formats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define FORMATS_CHUNK 64
+
+static void retire_ring(void* data) {
+    struct log_ring* ring = data;
+    atomic_store_explicit(&ring->retired, true, memory_order_release);
+    sem_post(&writer_sem);
+}
+
+/*
+ Devuelve el buffer del hilo actual, creandolo la primera vez que loggea
+ */
+static struct log_ring* get_ring() {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+    struct log_ring* ring = malloc(sizeof(struct log_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->retired, false);
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+static void write_out(const char* data, size_t len) {
+    if (log_stream != NULL) {
+        fwrite(data, 1, len, log_stream);
+    }
+    while (log_file_fd >= 0 && len > 0) {
+        ssize_t written = write(log_file_fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            // No hay a donde avisar, lo perdemos
+            return;
         }
+        data += written;
+        len -= written;
+        file_bytes += written;
     }
 }
 
 /*
- Intenta enviar todo lo que puede al archivo de loggeo
- Si quedan bytes a escribir le avisamos al selector
+ Encabezado de los logs binarios, va al principio de cada archivo
  */
-static void try_flush_buffer_to_file() {
-    //escribimos asi porque lo marcamos como no bloqueante
-    ssize_t written = write(log_file_fd, buffer + buffer_start, buffer_length);
-    if (written > 0) {
-        buffer_length -= written;
-        buffer_start = (buffer_length == 0 ? 0 : (buffer_start + written));
+static void write_binary_header() {
+    uint32_t endian_check = BINLOG_ENDIAN_CHECK;
+    write_out(BINLOG_MAGIC, BINLOG_MAGIC_LENGTH);
+    write_out((const char*) &endian_check, sizeof(endian_check));
+}
+
+static void write_formats();
+
+/*
+ Escribe todo lo que tiene un buffer
+ Retorna true si habia algo para escribir
+ */
+static bool drain_ring(struct log_ring* ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    // Despues de leer head: los formatos de todos los registros que vamos a copiar ya estan registrados,
+    // y tienen que llegar al archivo antes que ellos
+    if (output == LOG_OUTPUT_BINARY) {
+        write_formats();
     }
+    size_t start = tail & LOG_RING_MASK;
+    size_t len = head - tail;
+    size_t first = len < LOG_RING_SIZE - start ? len : LOG_RING_SIZE - start;
+    write_out(ring->data + start, first);
+    if (len > first) {
+        write_out(ring->data, len - first);
+    }
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    atomic_fetch_sub_explicit(&backlog, len, memory_order_relaxed);
+    return true;
+}
 
-    // Si quedan para escribir, me quedo en el selector interesado para escribir
-    selector_set_interest(selector, log_file_fd, buffer_length > 0 ? OP_WRITE : OP_NOOP);
+static void remove_ring(struct log_ring* ring) {
+    pthread_mutex_lock(&rings_mutex);
+    struct log_ring** prev = &rings;
+    while (*prev != ring) {
+        prev = &(*prev)->next;
+    }
+    *prev = ring->next;
+    pthread_mutex_unlock(&rings_mutex);
+    free(ring);
 }
 
-static void fd_write_handler(struct selector_key* key) {
-    try_flush_buffer_to_file();
+/*
+ Escribe los formatos que se registraron desde la ultima vez (solo en modo binario)
+ */
+static void write_formats() {
+    pthread_mutex_lock(&formats_mutex);
+    for (; formats_written < formats_count; formats_written++) {
+        struct log_format_site* site = formats[formats_written];
+        size_t format_len = strnlen(site->format, LOG_LINE_MAX_LENGTH);
+        uint16_t len = (uint16_t) (sizeof(uint32_t) + format_len);
+        uint32_t id = formats_written + 1;
+        char header[BINLOG_RECORD_HEADER_LENGTH + sizeof(uint32_t)];
+        header[0] = BINLOG_RECORD_FORMAT;
+        memcpy(header + 1, &len, sizeof(len));
+        memcpy(header + BINLOG_RECORD_HEADER_LENGTH, &id, sizeof(id));
+        write_out(header, sizeof(header));
+        write_out(site->format, format_len);
+    }
+    pthread_mutex_unlock(&formats_mutex);
 }
 
-static void fd_close_handler(struct selector_key* key) {
-    // Intento enviar lo que queda
-
-    if (buffer_length != 0) {
-        // Lo hago bloqueante para que termine, total ya el selector me saco porque llamaron a destroy
-        int flags = fcntl(log_file_fd, F_GETFD, 0);
-        fcntl(log_file_fd, F_SETFL, flags & (~O_NONBLOCK));
-        ssize_t written = write(log_file_fd, buffer, buffer_length);
-        if (written > 0) {
-            buffer_length -= written;
-            buffer_start = (buffer_length == 0 ? 0 : (buffer_start + written));
+/*
+ Escribe lo que tienen todos los buffers
+ Retorna true si encontro algo para escribir
+ */
+static bool drain_rings() {
+    maybe_rotate();
+    pthread_mutex_lock(&rings_mutex);
+    struct log_ring* ring = rings;
+    pthread_mutex_unlock(&rings_mutex);
+    // Los que se agreguen mientras tanto van al principio, asi que podemos recorrer sin el mutex
+    bool found = false;
+    while (ring != NULL) {
+        struct log_ring* next = ring->next;
+        // Hay que ver si termino antes de vaciarlo, para no perder lo que escribio al final
+        bool retired = atomic_load_explicit(&ring->retired, memory_order_acquire);
+        if (found) {
+            // Ya escribimos algo en esta pasada, puede que el archivo se haya llenado
+            maybe_rotate();
         }
+        found = drain_ring(ring) || found;
+        if (retired) {
+            remove_ring(ring);
+        }
+        ring = next;
     }
-
-    close(log_file_fd);
-    log_file_fd = -1;
+    if (found && log_stream != NULL) {
+        fflush(log_stream);
+    }
+    return found;
 }
 
-static fd_handler fdHandler = {
-    .handle_read = NULL,
-    .handle_write = fd_write_handler,
-    .handle_close = fd_close_handler,
-    .handle_block = NULL};
-
+static void* writer_run(void* arg) {
+    while (atomic_load(&running)) {
+        if (!drain_rings()) {
+            // No habia nada, esperamos a que nos despierten (o a que pase un rato)
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += LOG_WRITER_PERIOD_NS;
+            if (until.tv_nsec >= NANOS_PER_SECOND) {
+                until.tv_sec++;
+                until.tv_nsec -= NANOS_PER_SECOND;
+            }
+            sem_timedwait(&writer_sem, &until);
+        }
+    }
+    // Escribimos lo que haya quedado
+    drain_rings();
+    return NULL;
+}
 
-static int try_open_log_file(const char* log_file, struct tm tm) {
+static int try_open_log_file(const char* log_file, time_t now, bool rotating) {
     if (log_file == NULL)
         return -1;
 
     char log_file_buffer[DEFAULT_LOG_FILE_MAXSTRLEN + 1];
+    struct tm tm;
+    localtime_r(&now, &tm);
+    const char* extension = output == LOG_OUTPUT_BINARY ? BINARY_LOG_FILE_EXTENSION : LOG_FILE_EXTENSION;
 
     // Si es "", le ponemos un default (YYYY-MM-DD.log), si ya existe se sigue loggeando ahi
     if (log_file[0] == '\0') {
-        snprintf(log_file_buffer, DEFAULT_LOG_FILE_MAXSTRLEN, DEFAULT_LOG_FILE, tm.tm_year + 1900, tm.tm_mday, tm.tm_mon + 1, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        snprintf(log_file_buffer, DEFAULT_LOG_FILE_MAXSTRLEN, DEFAULT_LOG_FILE, tm.tm_year + 1900, tm.tm_mday, tm.tm_mon + 1, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 rotating ? "" : extension);
 
-        log_file = log_file_buffer;
         struct stat st = {0};
 
         // Crea la carpeta log si no esta creada
@@ -153,105 +313,433 @@ static int try_open_log_file(const char* log_file, struct tm tm) {
     } else {
         // Agrega el directorio al nombre del archivo
         snprintf(log_file_buffer, DEFAULT_LOG_FILE_MAXSTRLEN, "%s/%s", DEFAULT_LOG_FOLDER, log_file);
-        log_file = log_file_buffer;
     }
 
-    int fd = open(log_file, LOG_FILE_OPEN_FLAGS, LOG_FILE_PERMISSION_BITS);
-    if (fd < 0) {
-        fprintf(stderr, "WARNING: Failed to open logging file at '%s'. Logging will be disabled.\n", log_file);
-        return -1;
+    int fd;
+    if (!rotating) {
+        fd = open(log_file_buffer, LOG_FILE_OPEN_FLAGS, LOG_FILE_PERMISSION_BITS);
+        if (fd < 0) {
+            fprintf(stderr, "WARNING: Failed to open logging file at '%s'. Logging will be disabled.\n", log_file_buffer);
+        }
+        return fd;
     }
-
+    // Al rotar puede que ya exista uno con la misma hora (o el nombre fijo), buscamos uno nuevo
+    char rotated[DEFAULT_LOG_FILE_MAXSTRLEN + 1];
+    unsigned suffix = 0;
+    do {
+        int len = snprintf(rotated, DEFAULT_LOG_FILE_MAXSTRLEN, "%s", log_file_buffer);
+        if (suffix > 0 && len >= 0 && len < DEFAULT_LOG_FILE_MAXSTRLEN) {
+            len += snprintf(rotated + len, DEFAULT_LOG_FILE_MAXSTRLEN - len, LOG_ROTATION_SUFFIX, suffix);
+        }
+        if (log_file[0] == '\0' && len >= 0 && len < DEFAULT_LOG_FILE_MAXSTRLEN) {
+            snprintf(rotated + len, DEFAULT_LOG_FILE_MAXSTRLEN - len, "%s", extension);
+        }
+        fd = open(rotated, LOG_ROTATED_FILE_OPEN_FLAGS, LOG_FILE_PERMISSION_BITS);
+        suffix++;
+    } while (fd < 0 && errno == EEXIST && suffix < LOG_ROTATION_MAX_SUFFIX);
     return fd;
 }
 
-int logger_init(fd_selector selector_param, const char* log_file, FILE* log_stream_param) {
-    // Fecha actual para crear el default
-    time_t timeNow = time(NULL);
-    struct tm tm = *localtime(&timeNow);
+/*
+ Si el archivo actual llego al tamaño o al tiempo de rotacion, abre uno nuevo y cambia el fd
+ Solo lo llama el hilo del logger, que es el unico que escribe en el archivo
+ */
+static void maybe_rotate() {
+    if (log_file_fd < 0 || (rotate_bytes == 0 && rotate_seconds == 0)) {
+        return;
+    }
+    time_t now = time(NULL);
+    if ((rotate_bytes == 0 || file_bytes < rotate_bytes) && (rotate_seconds == 0 || now - file_opened < (time_t) rotate_seconds)) {
+        return;
+    }
+    int fd = try_open_log_file(log_file_name, now, true);
+    // Si no pudimos abrir otro, seguimos con el mismo y volvemos a probar en el proximo periodo
+    file_opened = now;
+    if (fd < 0) {
+        file_bytes = 0;
+        return;
+    }
+    close(log_file_fd);
+    log_file_fd = fd;
+    file_bytes = 0;
+    atomic_fetch_add_explicit(&rotations, 1, memory_order_relaxed);
+    if (output == LOG_OUTPUT_BINARY) {
+        // El archivo nuevo se tiene que poder leer solo: encabezado y todos los formatos de nuevo
+        write_binary_header();
+        pthread_mutex_lock(&formats_mutex);
+        formats_written = 0;
+        pthread_mutex_unlock(&formats_mutex);
+    }
+}
 
-    selector = selector_param;
-    log_file_fd = selector_param == NULL ? -1 : try_open_log_file(log_file, tm);
-    log_stream = log_stream_param;
-    log_level = MAX_LOG_LEVEL;
+int logger_init(const char* log_file, FILE* log_stream_param) {
+    // Fecha actual para crear el default
+    time_t now = time(NULL);
 
-    // Registrar el archivo si lo pudimos abrir
-    if (log_file_fd >= 0){
-        selector_register(selector, log_file_fd, &fdHandler, OP_NOOP, NULL);
+    log_file_fd = try_open_log_file(log_file, now, false);
+    if (log_file != NULL) {
+        snprintf(log_file_name, DEFAULT_LOG_FILE_MAXSTRLEN, "%s", log_file);
+    }
+    file_opened = now;
+    if (log_file_fd >= 0) {
+        // Si seguimos un archivo que ya existia, cuenta para la rotacion
+        struct stat st;
+        file_bytes = fstat(log_file_fd, &st) == 0 ? (size_t) st.st_size : 0;
     }
+    log_stream = log_stream_param;
+    atomic_store(&log_level, MAX_LOG_LEVEL);
 
     // Chequeo que estoy loggeando por archivo o por Stream
-    if (log_file_fd >= 0 || log_stream != NULL) {
-        buffer = malloc(LOG_MIN_BUFFER_SIZE); //empiezo con el tamaño minimo
-        buffer_capacity = LOG_MIN_BUFFER_SIZE;
-        buffer_length = 0;
-        buffer_start = 0;
-        if (buffer == NULL || errno == ENOMEM) {
-            close(log_file_fd);
-            log_file_fd = -1;
-            fprintf(stderr, "WARNING: Failed to malloc a buffer for logging\n");
-            return -1;
-        }
+    if (log_file_fd < 0 && log_stream == NULL) {
+        return 0;
+    }
+    if (output == LOG_OUTPUT_BINARY) {
+        // Todavia no hay otro hilo, podemos escribir directo
+        write_binary_header();
+    }
+    if (sem_init(&writer_sem, 0, 0) != 0 || pthread_key_create(&ring_key, retire_ring) != 0) {
+        fprintf(stderr, "WARNING: Failed to initialize the logger thread\n");
+        goto fail;
+    }
+    atomic_store(&running, true);
+
+    // El hilo hereda la mascara: que las señales las siga recibiendo el hilo principal
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&writer, NULL, writer_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        fprintf(stderr, "WARNING: Failed to create the logger thread\n");
+        atomic_store(&running, false);
+        pthread_key_delete(ring_key);
+        goto fail;
     }
     return 0;
-}
 
-int logger_finalize() {
+fail:
     if (log_file_fd >= 0) {
-        selector_unregister_fd(selector, log_file_fd);
-        selector = NULL;
+        close(log_file_fd);
+        log_file_fd = -1;
     }
+    log_stream = NULL;
+    return -1;
+}
 
-    if (buffer != NULL) {
-        free(buffer);
-        buffer = NULL;
-        buffer_capacity = 0;
-        buffer_length = 0;
-        buffer_start = 0;
+int logger_finalize() {
+    if (!atomic_load(&running)) {
+        return 0;
+    }
+    // El hilo del logger escribe lo que quedo antes de terminar
+    atomic_store(&running, false);
+    sem_post(&writer_sem);
+    pthread_join(writer, NULL);
+
+    pthread_mutex_lock(&rings_mutex);
+    while (rings != NULL) {
+        struct log_ring* next = rings->next;
+        free(rings);
+        rings = next;
     }
+    pthread_mutex_unlock(&rings_mutex);
+    thread_ring = NULL;
+    pthread_key_delete(ring_key);
 
+    pthread_mutex_lock(&formats_mutex);
+    free(formats);
+    formats = NULL;
+    formats_count = formats_capacity = formats_written = 0;
+    pthread_mutex_unlock(&formats_mutex);
+    sem_destroy(&writer_sem);
+
+    if (log_file_fd >= 0) {
+        close(log_file_fd);
+        log_file_fd = -1;
+    }
     log_stream = NULL;
     return 0;
 }
 
 void logger_set_level(log_level_t level) {
-    log_level = level;
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
 }
 
-int logger_is_enabled_for(log_level_t level) {
-    return level >= log_level && (log_file_fd > 0 || log_stream != NULL);
+void logger_set_output(log_output_t output_param) {
+    output = output_param;
 }
 
-void logger_pre_print() {
-    make_buffer_space(LOG_BUFFER_MAX_PRINT_LENGTH);
+int logger_is_binary() {
+    return output == LOG_OUTPUT_BINARY;
 }
 
-void logger_get_bufstart_and_maxlength(char** bufstartVar, size_t* maxlenVar) {
-    *bufstartVar = buffer + buffer_start + buffer_length;
-    *maxlenVar = buffer_capacity - buffer_length - buffer_start;
+int logger_is_enabled_for(log_level_t level) {
+    return (int) level >= atomic_load_explicit(&log_level, memory_order_relaxed) && atomic_load_explicit(&running, memory_order_relaxed);
+}
+
+const char* logger_get_timestamp() {
+    // En Linux time() no hace una syscall (vDSO), lo caro es localtime_r
+    time_t now = time(NULL);
+    if (now != timestamp_second) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        snprintf(timestamp, LOG_TIMESTAMP_MAX_LENGTH, "[%04d-%02d-%02d %02d:%02d:%02d]",
+                 tm.tm_year + 1900, tm.tm_mday, tm.tm_mon + 1, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        timestamp_second = now;
+    }
+    return timestamp;
 }
 
+/*
+ Copia un registro (linea o registro binario) al buffer del hilo actual
+ Si no entra, lo descarta
+ */
+static int ring_push(const char* data, size_t len) {
+    struct log_ring* ring = get_ring();
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < len
+        || (backlog_limit != 0 && atomic_load_explicit(&backlog, memory_order_relaxed) + len > backlog_limit)) {
+        // No esperamos al hilo del logger, preferimos perder la linea
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&backlog, len, memory_order_relaxed);
+    size_t start = head & LOG_RING_MASK;
+    size_t first = len < LOG_RING_SIZE - start ? len : LOG_RING_SIZE - start;
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, data + first, len - first);
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+    if (head == tail) {
+        // Estaba vacio, puede que el hilo del logger este esperando
+        sem_post(&writer_sem);
+    }
+    return 0;
+}
 
-int logger_post_print(int written, size_t maxlen) {
+int logger_post_print(char* line, int written, size_t max_len) {
     if (written < 0) {
-        fprintf(stderr, "Error: snprintf(): '%s'\n", strerror(errno));
         return -1;
     }
+    size_t len = (size_t) written;
+    if (len >= max_len) {
+        // Que siga terminando en una linea
+        len = max_len - 1;
+        line[len - 1] = '\n';
+    }
+    return ring_push(line, len);
+}
 
-    if ((size_t)written >= maxlen) {
-        fprintf(stderr, "Error: %lu bytes of logs possibly lost\n", written - maxlen + 1);
-        written = maxlen - 1;
+static uint32_t register_format(struct log_format_site* site) {
+    pthread_mutex_lock(&formats_mutex);
+    uint32_t id = atomic_load_explicit(&site->id, memory_order_relaxed);
+    if (id == 0) {
+        if (formats_count == formats_capacity) {
+            void* aux = realloc(formats, (formats_capacity + FORMATS_CHUNK) * sizeof(*formats));
+            if (aux == NULL) {
+                pthread_mutex_unlock(&formats_mutex);
+                return 0;
+            }
+            formats = aux;
+            formats_capacity += FORMATS_CHUNK;
+        }
+        formats[formats_count++] = site;
+        id = formats_count;
+        atomic_store_explicit(&site->id, id, memory_order_release);
     }
+    pthread_mutex_unlock(&formats_mutex);
+    return id;
+}
 
-    if (log_stream != NULL) {
-        fprintf(log_stream, "%s", buffer + buffer_start + buffer_length);
+/*
+ Estado para ir agregando argumentos a un registro binario
+ */
+struct binary_record {
+    char data[LOG_LINE_MAX_LENGTH];
+    size_t len;
+};
+
+static bool record_append(struct binary_record* record, char type, const void* value, size_t size) {
+    if (record->len + 1 + size > LOG_LINE_MAX_LENGTH) {
+        return false;
     }
+    record->data[record->len++] = type;
+    memcpy(record->data + record->len, value, size);
+    record->len += size;
+    return true;
+}
 
-    if (log_file_fd >= 0) {
-        buffer_length += written;
-        try_flush_buffer_to_file();
+static bool record_append_string(struct binary_record* record, const char* str) {
+    if (str == NULL) {
+        str = "(null)";
     }
-    return 0;
+    size_t available = LOG_LINE_MAX_LENGTH - record->len;
+    if (available < 1 + sizeof(uint16_t)) {
+        return false;
+    }
+    // Si no entra entero, lo cortamos
+    uint16_t str_len = (uint16_t) strnlen(str, available - 1 - sizeof(uint16_t));
+    record->data[record->len++] = BINLOG_ARG_STRING;
+    memcpy(record->data + record->len, &str_len, sizeof(str_len));
+    record->len += sizeof(str_len);
+    memcpy(record->data + record->len, str, str_len);
+    record->len += str_len;
+    return true;
+}
+
+/*
+ Lee de args los argumentos que pide format (como lo haria printf) y los agrega al registro
+ Los enteros se guardan como int64/uint64, ya convertidos al tipo que indica el formato
+ */
+static void record_append_args(struct binary_record* record, const char* format, va_list args) {
+    for (const char* c = format; *c != '\0'; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        c++;
+        if (*c == '%') {
+            continue;
+        }
+        // flags, ancho y precision (con * vienen como int)
+        while (*c != '\0' && strchr("-+ #0", *c) != NULL) {
+            c++;
+        }
+        for (; (*c >= '0' && *c <= '9') || *c == '.' || *c == '*'; c++) {
+            if (*c == '*') {
+                int64_t width = va_arg(args, int);
+                if (!record_append(record, BINLOG_ARG_INT, &width, sizeof(width))) {
+                    return;
+                }
+            }
+        }
+        // modificadores de largo
+        int longs = 0;
+        char modifier = '\0';
+        for (; *c != '\0' && strchr("hlLqjzt", *c) != NULL; c++) {
+            modifier = *c;
+            longs += *c == 'l' || *c == 'h' ? 1 : 0;
+        }
+        bool ok = true;
+        switch (*c) {
+            case 'd':
+            case 'i':
+            case 'c': {
+                int64_t value;
+                if (modifier == 'l') {
+                    value = longs > 1 ? va_arg(args, long long) : va_arg(args, long);
+                } else if (modifier == 'j') {
+                    value = va_arg(args, intmax_t);
+                } else if (modifier == 'z' || modifier == 't') {
+                    value = va_arg(args, ptrdiff_t);
+                } else {
+                    value = va_arg(args, int);
+                    if (modifier == 'h') {
+                        value = longs > 1 ? (signed char) value : (short) value;
+                    }
+                }
+                ok = record_append(record, BINLOG_ARG_INT, &value, sizeof(value));
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X': {
+                uint64_t value;
+                if (modifier == 'l') {
+                    value = longs > 1 ? va_arg(args, unsigned long long) : va_arg(args, unsigned long);
+                } else if (modifier == 'j') {
+                    value = va_arg(args, uintmax_t);
+                } else if (modifier == 'z' || modifier == 't') {
+                    value = va_arg(args, size_t);
+                } else {
+                    value = va_arg(args, unsigned int);
+                    if (modifier == 'h') {
+                        value = longs > 1 ? (unsigned char) value : (unsigned short) value;
+                    }
+                }
+                ok = record_append(record, BINLOG_ARG_UINT, &value, sizeof(value));
+                break;
+            }
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double value = modifier == 'L' ? (double) va_arg(args, long double) : va_arg(args, double);
+                ok = record_append(record, BINLOG_ARG_DOUBLE, &value, sizeof(value));
+                break;
+            }
+            case 's':
+                ok = record_append_string(record, va_arg(args, const char*));
+                break;
+            case 'p': {
+                uint64_t value = (uintptr_t) va_arg(args, void*);
+                ok = record_append(record, BINLOG_ARG_POINTER, &value, sizeof(value));
+                break;
+            }
+            default:
+                // %n o algo que no conocemos: no sabemos que tipo tiene, cortamos aca
+                return;
+        }
+        if (!ok || *c == '\0') {
+            return;
+        }
+    }
+}
+
+int logger_post_binary(struct log_format_site* site, log_level_t level, ...) {
+    uint32_t id = atomic_load_explicit(&site->id, memory_order_acquire);
+    if (id == 0 && (id = register_format(site)) == 0) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    struct binary_record record;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t micros = (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+    record.data[0] = BINLOG_RECORD_LOG;
+    record.len = BINLOG_RECORD_HEADER_LENGTH;
+    memcpy(record.data + record.len, &micros, sizeof(micros));
+    record.len += sizeof(micros);
+    record.data[record.len++] = (char) level;
+    memcpy(record.data + record.len, &id, sizeof(id));
+    record.len += sizeof(id);
+
+    va_list args;
+    va_start(args, level);
+    record_append_args(&record, site->format, args);
+    va_end(args);
+
+    uint16_t len = (uint16_t) (record.len - BINLOG_RECORD_HEADER_LENGTH);
+    memcpy(record.data + 1, &len, sizeof(len));
+    return ring_push(record.data, record.len);
+}
+
+unsigned long logger_get_dropped() {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+size_t logger_get_backlog() {
+    return atomic_load_explicit(&backlog, memory_order_relaxed);
+}
+
+unsigned long logger_get_rotations() {
+    return atomic_load_explicit(&rotations, memory_order_relaxed);
+}
+
+void logger_set_rotation(size_t max_bytes, unsigned max_seconds) {
+    rotate_bytes = max_bytes;
+    rotate_seconds = max_seconds;
+}
+
+void logger_set_backlog_limit(size_t max_bytes) {
+    backlog_limit = max_bytes;
 }
 
 #endif // #ifndef DISABLE_LOGGER
@@ -3,6 +3,8 @@
 
 // Este logger crea copias de los datos que necesita con los parametros
 // El archivo default o con el nombre deseado se encuentra dentro de ./log/
+// Cada hilo deja sus lineas en un buffer circular propio, y un hilo aparte las escribe al archivo,
+// asi loggear no bloquea al selector (ni a los workers)
 
 // Definir esto para deshabilitarlo
 // #define DISABLE_LOGGER
@@ -13,7 +15,7 @@
 #include <sys/socket.h>
 #include <time.h> // Para el struct tm
 #include <unistd.h>
-#include "../selector.h"
+#include <stdatomic.h>
 
 typedef enum {
     LOG_DEBUG = 0,
@@ -23,28 +25,67 @@ typedef enum {
     LOG_FATAL
 } log_level_t;
 
+/*
+ Como se escriben los logs: lineas de texto, o registros binarios que se leen con popserver-logdump
+ */
+typedef enum {
+    LOG_OUTPUT_TEXT = 0,
+    LOG_OUTPUT_BINARY
+} log_output_t;
+
+/*
+ Datos de cada llamada a logf para el modo binario: el formato se escribe una sola vez con un id
+ y despues los registros solo llevan el id
+ */
+struct log_format_site {
+    const char* format;
+    atomic_uint id; // 0 si todavia no se registro
+};
+
 #define MIN_LOG_LEVEL LOG_DEBUG
 #define MAX_LOG_LEVEL LOG_FATAL
 
+/*
+ Nivel minimo que se compila (valor numerico de log_level_t, por ejemplo 1 para LOG_INFO)
+ Los logs de menor nivel no generan codigo, aunque se pida ese nivel con -l
+ Se define desde el Makefile: make all LOG_COMPILE_MIN_LEVEL=1
+ */
+#ifndef LOG_COMPILE_MIN_LEVEL
+#define LOG_COMPILE_MIN_LEVEL 0
+#endif
+
 const char* logger_get_level_string(log_level_t level);
 
 #ifdef DISABLE_LOGGER
-#define loggerInit(selector, logFile, logStream)
-#define loggerFinalize()
-#define loggerSetLevel(level)
-#define loggerIsEnabledFor(level) 0
+#define logger_init(logFile, logStream) 0
+#define logger_set_output(output)
+#define logger_finalize() 0
+#define logger_set_level(level)
+#define logger_is_enabled_for(level) 0
+#define logger_get_dropped() 0UL
+#define logger_get_backlog() ((size_t) 0)
+#define logger_get_rotations() 0UL
+#define logger_set_rotation(max_bytes, max_seconds)
+#define logger_set_backlog_limit(max_bytes)
 #define logf(level, format, ...)
 #define log(level, s)
-#define logClientAuthenticated(clientId, username, successful)
 #else
 /*
- Inicializa el logger con "selectorParam" como selector a usar para poder escribir sin bloquearse
- logFile es el archivo en donde se guardan los logs (no funciona todavia utilizar un file default,
- creando un archivo con nombre predeterminado al pasarle "")
+ Inicializa el logger y arranca el hilo que escribe los logs
+ logFile es el archivo en donde se guardan los logs (dentro de ./log/, con "" se usa uno con la fecha y hora)
  logStreamParam puede ser stdout para también imprimir lo que se loggea a la consola
+ */
+int logger_init(const char* log_file, FILE* log_stream_param);
+
+/*
+ Elige entre logs de texto (default) o binarios. Se tiene que llamar antes de logger_init
+ */
+void logger_set_output(log_output_t output);
 
+/*
+ Se fija si los logs son binarios
  */
-int logger_init(fd_selector selector_param, const char* log_file, FILE* log_stream_param);
+int logger_is_binary();
 
 /*
  Termina y envia los logs restantes
@@ -62,37 +103,69 @@ void logger_set_level(log_level_t level);
 int logger_is_enabled_for(log_level_t level);
 
 /*
- Hace lugar en el buffer para por lo menos una linea mas de logging
- Ojo, tiene tamaño fijo
+ Fecha y hora actual para poner en el log, ya con formato
+ Cada hilo la recalcula solo cuando cambia el segundo
+ */
+const char* logger_get_timestamp();
+
+/*
+ Deja la linea en el buffer del hilo que loggea, para que la escriba el hilo del logger
+ Si el buffer esta lleno, la linea se descarta (ver logger_get_dropped)
  */
-void logger_pre_print();
+int logger_post_print(char* line, int written, size_t max_len);
 
-void logger_get_bufstart_and_maxlength(char** buf_start_var, size_t* max_len_var);
+/*
+ Version binaria de logger_post_print: guarda los argumentos tal cual (segun el formato de site), sin snprintf
+ */
+int logger_post_binary(struct log_format_site* site, log_level_t level, ...);
 
 /*
- Escribe en el logStream
- Actualiza el current del buffer e intenta flushear al archivo de log
+ Cantidad de lineas descartadas porque el buffer del hilo estaba lleno (o se paso el limite de logger_set_backlog_limit)
  */
-int logger_post_print(int written, size_t max_len);
+unsigned long logger_get_dropped();
+
+/*
+ Bytes de logs en memoria que todavia no se escribieron al archivo
+ */
+size_t logger_get_backlog();
+
+/*
+ Cantidad de veces que se roto el archivo de logs
+ */
+unsigned long logger_get_rotations();
+
+/*
+ Abre un archivo de logs nuevo cuando el actual llega a max_bytes o tiene max_seconds (0 para no usar ese limite)
+ El archivo nuevo lo abre el hilo del logger. Se tiene que llamar antes de logger_init
+ */
+void logger_set_rotation(size_t max_bytes, unsigned max_seconds);
+
+/*
+ Maximo de bytes de logs en memoria entre todos los hilos (0 sin limite, mas alla del buffer de cada hilo)
+ Las lineas que no entran se descartan. Se tiene que llamar antes de logger_init
+ */
+void logger_set_backlog_limit(size_t max_bytes);
+
+/* Tamaño maximo de una linea de log */
+#define LOG_LINE_MAX_LENGTH 0x200 // 512 bytes
 
 /*
  Macro a utilizar para loggear
- Le pasas el nivel y lo que queres escribir, se fija si podes, hace lugar
- calcula la hora y escribe la hora seguido del log
+ Le pasas el nivel y lo que queres escribir, se fija si podes, toma la hora
+ y arma la linea en el stack (o el registro, en modo binario). El hilo del logger la escribe despues
+ Si el nivel es menor a LOG_COMPILE_MIN_LEVEL, el compilador saca todo el bloque
  */
 #define logf(level, format, ...)                                                                                                           \
-    if (logger_is_enabled_for(level)) {                                                                                                    \
-        logger_pre_print();                                                                                                                \
-        time_t loginternal_time = time(NULL);                                                                                              \
-        struct tm loginternal_tm = *localtime(&loginternal_time);                                                                          \
-        size_t loginternal_maxlen;                                                                                                         \
-        char* loginternal_bufstart;                                                                                                        \
-        logger_get_bufstart_and_maxlength(&loginternal_bufstart, &loginternal_maxlen);                                                     \
-        int loginternal_written = snprintf(loginternal_bufstart, loginternal_maxlen, "[%04d-%02d-%02d %02d:%02d:%02d]%s\t" format "\n",    \
-                                           loginternal_tm.tm_year + 1900, loginternal_tm.tm_mday, loginternal_tm.tm_mon + 1,               \
-                                           loginternal_tm.tm_hour, loginternal_tm.tm_min, loginternal_tm.tm_sec,                           \
-                                           logger_get_level_string(level), __VA_ARGS__);                      \
-        logger_post_print(loginternal_written, loginternal_maxlen);                                                                          \
+    if ((level) >= LOG_COMPILE_MIN_LEVEL && logger_is_enabled_for(level)) {                                                                \
+        if (logger_is_binary()) {                                                                                                          \
+            static struct log_format_site loginternal_site = {format, 0};                                                                  \
+            logger_post_binary(&loginternal_site, level, __VA_ARGS__);                                                                     \
+        } else {                                                                                                                           \
+            char loginternal_line[LOG_LINE_MAX_LENGTH];                                                                                    \
+            int loginternal_written = snprintf(loginternal_line, LOG_LINE_MAX_LENGTH, "%s%s\t" format "\n",                                \
+                                               logger_get_timestamp(), logger_get_level_string(level), __VA_ARGS__);                       \
+            logger_post_print(loginternal_line, loginternal_written, LOG_LINE_MAX_LENGTH);                                                 \
+        }                                                                                                                                  \
     }
 
 // Para loggear sin formato
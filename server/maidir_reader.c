@@ -1,74 +1,296 @@
+// getdents64 y statx son de Linux (ver MAILDIR_FAST_SCAN)
+#define _GNU_SOURCE
 #include "maidir_reader.h"
 #include <sys/types.h>   // socket, opendir
 #include <sys/stat.h> //stat
+#include <fcntl.h> //open
+#include <unistd.h> //unlinkat
 #include <dirent.h> //readdir
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 #include "logging/logger.h"
 
+/*
+ * En Linux (glibc >= 2.30) leemos el directorio con getdents64 y un buffer grande, usamos d_type para
+ * descartar lo que no es un archivo regular sin hacer stat (incluidos . y ..) y pedimos solo el tamaño con statx
+ * En otro caso, se usa readdir + fstatat
+ */
+#if defined(__linux__) && defined(__GLIBC__)
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30)
+#define MAILDIR_FAST_SCAN
+#endif
+#endif
+
+/*
+ * renameat2 con RENAME_NOREPLACE esta desde glibc 2.28. Si no esta, usamos link + unlink, que tampoco
+ * pisa un mail que ya este en cur/ (es como lo hacen los MDA clasicos)
+ */
+#if defined(__linux__) && defined(__GLIBC__)
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 28)
+#define MAILDIR_RENAME_NOREPLACE
+#endif
+#endif
 
 #define CHUNK_SIZE 10
+#define INFO_SUFFIX ":2,"
+#define DENTS_BUFFER_SIZE (128 * 1024)
+#define MAX_SIZE_HINT_DIGITS 15
 
-email* read_maildir(const char* maildir_path, size_t* size){
-    size_t i = 0;
-    size_t ans_size = CHUNK_SIZE;
-    email* ans = malloc(CHUNK_SIZE * sizeof (email));
-    DIR* mail_dir = NULL;
-    if(ans == NULL || errno == ENOMEM){
+struct maildir_scanner{
+#ifdef MAILDIR_FAST_SCAN
+    int dir_fd;
+    char* dents;
+    size_t dents_len;
+    size_t dents_pos;
+#else
+    DIR* mail_dir;
+#endif
+    email* emails;
+    size_t count;
+    size_t capacity;
+    size_t max;
+    bool use_size_hints;
+    //cantidad de mails cuyo tamaño sacamos del nombre, sin hacer stat
+    size_t hinted;
+};
+
+maildir_scanner* maildir_scan_open(const char* maildir_path, size_t max, bool use_size_hints){
+    if(maildir_path == NULL){
+        log(LOG_FATAL, "Maildir_path is null");
+        return NULL;
+    }
+    maildir_scanner* scanner = calloc(1, sizeof(maildir_scanner));
+    if(scanner == NULL || errno == ENOMEM){
+        log(LOG_FATAL, "Error to allocate memory for maildir scanner");
+        free(scanner);
+        return NULL;
+    }
+#ifdef MAILDIR_FAST_SCAN
+    scanner->dir_fd = -1;
+#endif
+    scanner->emails = malloc(CHUNK_SIZE * sizeof (email));
+    if(scanner->emails == NULL || errno == ENOMEM){
         log(LOG_FATAL, "Error to allocate memory for emails");
         goto fail;
     }
-    if(maildir_path == NULL){
-        log(LOG_FATAL, "Maildir_path is null");
+    scanner->capacity = CHUNK_SIZE;
+    scanner->max = max;
+    scanner->use_size_hints = use_size_hints;
+#ifdef MAILDIR_FAST_SCAN
+    scanner->dents = malloc(DENTS_BUFFER_SIZE);
+    if(scanner->dents == NULL || errno == ENOMEM){
+        log(LOG_FATAL, "Error to allocate memory for directory entries");
         goto fail;
     }
-    mail_dir = opendir(maildir_path);
-    if(mail_dir == NULL){
+    scanner->dir_fd = open(maildir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(scanner->dir_fd == -1){
+#else
+    scanner->mail_dir = opendir(maildir_path);
+    if(scanner->mail_dir == NULL){
+#endif
         log(LOG_FATAL, "An error occurred opening maildir_path");
         goto fail;
     }
-    struct dirent* dirent = NULL;
-    while(dirent = readdir(mail_dir),dirent != NULL && i<*size){
-        if(strcmp(dirent->d_name,".")!=0 && strcmp(dirent->d_name,"..")!=0){
-            //Tengo que considerar al directorio
-            struct stat file_stat;
-            if(fstatat(dirfd(mail_dir),dirent->d_name,&file_stat,0)==-1){
-                log(LOG_ERROR, "An error occurred when using fstatat");
-                goto fail;
+    return scanner;
+    fail:
+    maildir_scan_close(scanner);
+    return NULL;
+}
+
+/*
+ * Agrega un mail al final del arreglo, creciendo al doble si no entra
+ * Retorna false si no hay memoria
+ */
+static bool add_email(maildir_scanner* scanner, const char* name, off_t size){
+    if(scanner->count >= scanner->capacity){
+        void* aux =  realloc(scanner->emails,(scanner->capacity*2)*sizeof (email));
+        if(aux==NULL || errno == ENOMEM){
+            log(LOG_ERROR, "Error when using realloc for normal file");
+            return false;
+        }
+        scanner->emails = aux;
+        scanner->capacity*=2;
+    }
+    email* curr = scanner->emails + scanner->count;
+    curr->size = size;
+    curr->deleted = false;
+    size_t name_len = strnlen(name,NAME_SIZE-1);
+    memcpy(curr->name,name,name_len);
+    curr->name[name_len] = '\0';
+    scanner->count++;
+    return true;
+}
+
+/*
+ * Busca el tamaño que Maildir++ agrega al nombre del archivo (<unico>,S=<tamaño>[,...][:2,<flags>])
+ * Solo se busca antes del ':' porque despues van los flags del mail
+ * Retorna false si el nombre no lo tiene o esta mal formado
+ */
+static bool size_hint(const char* name, off_t* size){
+    const char* info = strchr(name, ':');
+    for(const char* p = strchr(name, ','); p != NULL && (info == NULL || p < info); p = strchr(p + 1, ',')){
+        if(p[1] != 'S' || p[2] != '='){
+            continue;
+        }
+        const char* digits = p + 3;
+        off_t value = 0;
+        const char* c;
+        //Con mas de MAX_SIZE_HINT_DIGITS digitos podria desbordar, no es un tamaño razonable
+        for(c = digits; *c >= '0' && *c <= '9' && c - digits < MAX_SIZE_HINT_DIGITS; c++){
+            value = value * 10 + (*c - '0');
+        }
+        if(c == digits || (*c != ',' && *c != ':' && *c != '\0')){
+            return false;
+        }
+        *size = value;
+        return true;
+    }
+    return false;
+}
+
+#ifdef MAILDIR_FAST_SCAN
+maildir_scan_status maildir_scan_step(maildir_scanner* scanner, size_t budget){
+    for(size_t read = 0; read < budget; read++){
+        if(scanner->count >= scanner->max){
+            return MAILDIR_SCAN_DONE;
+        }
+        if(scanner->dents_pos >= scanner->dents_len){
+            //Pedimos todas las entradas que entren en el buffer en una sola llamada
+            ssize_t len = getdents64(scanner->dir_fd, scanner->dents, DENTS_BUFFER_SIZE);
+            if(len < 0){
+                log(LOG_ERROR, "An error occurred when using getdents64");
+                return MAILDIR_SCAN_ERROR;
             }
-            if(S_ISREG(file_stat.st_mode)){
-                //Es un archivo regular, lo considero como un mail
-                if(ans == NULL || i>=ans_size){
-                    void* aux =  realloc(ans,(ans_size+CHUNK_SIZE)*sizeof (email));
-                    if(aux==NULL || errno == ENOMEM){
-                        log(LOG_ERROR, "Error when using realloc for normal file");
-                        ans = aux; //tengo que liberar la memoria original
-                        goto fail;
-                    }
-                    ans = aux;
-                    ans_size+=CHUNK_SIZE;
-                }
-                ans[i].size = file_stat.st_size;
-                ans[i].deleted = false;
-                strncpy(ans[i].name,dirent->d_name,NAME_SIZE);
-                i++;
+            if(len == 0){
+                return MAILDIR_SCAN_DONE;
             }
+            scanner->dents_len = (size_t) len;
+            scanner->dents_pos = 0;
+        }
+        struct dirent64* dirent = (struct dirent64*) (scanner->dents + scanner->dents_pos);
+        scanner->dents_pos += dirent->d_reclen;
 
+        unsigned int mask = STATX_SIZE;
+        if(dirent->d_type == DT_LNK || dirent->d_type == DT_UNKNOWN){
+            //No sabemos a que apunta, hay que preguntar tambien el tipo
+            mask |= STATX_TYPE;
+        }else if(dirent->d_type != DT_REG){
+            //Directorios (. y .. tambien), fifos, etc. no son mails
+            continue;
+        }else if(scanner->use_size_hints){
+            //Es un archivo regular, si el nombre trae el tamaño no hace falta el statx
+            off_t size;
+            if(size_hint(dirent->d_name, &size)){
+                if(!add_email(scanner, dirent->d_name, size)){
+                    return MAILDIR_SCAN_ERROR;
+                }
+                scanner->hinted++;
+                continue;
+            }
+        }
+        struct statx file_stat;
+        if(statx(scanner->dir_fd, dirent->d_name, AT_STATX_SYNC_AS_STAT, mask, &file_stat) == -1){
+            if(errno == ENOENT){
+                //Lo borraron mientras leiamos el directorio
+                continue;
+            }
+            log(LOG_ERROR, "An error occurred when using statx");
+            return MAILDIR_SCAN_ERROR;
+        }
+        if((mask & STATX_TYPE) && !S_ISREG(file_stat.stx_mode)){
+            continue;
+        }
+        //Es un archivo regular, lo considero como un mail
+        if(!add_email(scanner, dirent->d_name, (off_t) file_stat.stx_size)){
+            return MAILDIR_SCAN_ERROR;
         }
     }
-    closedir(mail_dir);
-    *size = i;
+    return MAILDIR_SCAN_PENDING;
+}
+#else
+maildir_scan_status maildir_scan_step(maildir_scanner* scanner, size_t budget){
+    struct dirent* dirent = NULL;
+    for(size_t read = 0; read < budget; read++){
+        if(scanner->count >= scanner->max || (dirent = readdir(scanner->mail_dir)) == NULL){
+            return MAILDIR_SCAN_DONE;
+        }
+        if(strcmp(dirent->d_name,".")==0 || strcmp(dirent->d_name,"..")==0){
+            continue;
+        }
+#ifdef _DIRENT_HAVE_D_TYPE
+        //Sin d_type no sabemos si es un archivo regular, asi que igual hay que hacer stat
+        off_t size;
+        if(scanner->use_size_hints && dirent->d_type == DT_REG && size_hint(dirent->d_name, &size)){
+            if(!add_email(scanner, dirent->d_name, size)){
+                return MAILDIR_SCAN_ERROR;
+            }
+            scanner->hinted++;
+            continue;
+        }
+#endif
+        //Tengo que considerar al directorio
+        struct stat file_stat;
+        if(fstatat(dirfd(scanner->mail_dir),dirent->d_name,&file_stat,0)==-1){
+            log(LOG_ERROR, "An error occurred when using fstatat");
+            return MAILDIR_SCAN_ERROR;
+        }
+        if(!S_ISREG(file_stat.st_mode)){
+            continue;
+        }
+        //Es un archivo regular, lo considero como un mail
+        if(!add_email(scanner, dirent->d_name, file_stat.st_size)){
+            return MAILDIR_SCAN_ERROR;
+        }
+    }
+    return MAILDIR_SCAN_PENDING;
+}
+#endif
+
+size_t maildir_scan_hinted(const maildir_scanner* scanner){
+    return scanner->hinted;
+}
+
+email* maildir_scan_finish(maildir_scanner* scanner, size_t* size){
+    email* ans = scanner->emails;
+    *size = scanner->count;
+    scanner->emails = NULL;
+    maildir_scan_close(scanner);
     return ans;
-    fail:
-    if(mail_dir!=NULL){
-        closedir(mail_dir);
+}
+
+void maildir_scan_close(maildir_scanner* scanner){
+    if(scanner == NULL){
+        return;
     }
-    if(ans != NULL){
-        free(ans);
+#ifdef MAILDIR_FAST_SCAN
+    if(scanner->dir_fd != -1){
+        close(scanner->dir_fd);
     }
-    return NULL;
+    free(scanner->dents);
+#else
+    if(scanner->mail_dir!=NULL){
+        closedir(scanner->mail_dir);
+    }
+#endif
+    free(scanner->emails);
+    free(scanner);
+}
+
+email* read_maildir(const char* maildir_path, size_t* size){
+    maildir_scanner* scanner = maildir_scan_open(maildir_path, *size, true);
+    if(scanner == NULL){
+        return NULL;
+    }
+    maildir_scan_status status;
+    while((status = maildir_scan_step(scanner, SIZE_MAX)) == MAILDIR_SCAN_PENDING);
+    if(status == MAILDIR_SCAN_ERROR){
+        maildir_scan_close(scanner);
+        return NULL;
+    }
+    return maildir_scan_finish(scanner, size);
 }
 void free_emails(email* emails, size_t size){
     if(emails == NULL){
@@ -77,3 +299,97 @@ void free_emails(email* emails, size_t size){
     }
     free(emails);
 }
+
+/*
+ * Mueve un mail de new/ a cur/ sin pisar uno existente
+ * Retorna false si no se pudo (ya existe en cur/, lo borraron, etc.)
+ */
+static bool move_to_cur(int new_fd, int cur_fd, const char* name, const char* cur_name){
+#ifdef MAILDIR_RENAME_NOREPLACE
+    if(renameat2(new_fd, name, cur_fd, cur_name, RENAME_NOREPLACE) == 0){
+        return true;
+    }
+    if(errno != EINVAL && errno != ENOSYS){
+        return false;
+    }
+    //El filesystem no soporta RENAME_NOREPLACE, seguimos con link + unlink
+#endif
+    if(linkat(new_fd, name, cur_fd, cur_name, 0) == -1){
+        return false;
+    }
+    unlinkat(new_fd, name, 0);
+    return true;
+}
+
+bool maildir_has_new(const char* new_path){
+    DIR* new_dir = opendir(new_path);
+    if(new_dir == NULL){
+        //Si no se puede abrir por otro motivo, que lo intente (y lo informe) deliver_new_maildir
+        return errno != ENOENT;
+    }
+    bool found = false;
+    struct dirent* dirent;
+    //Con un directorio vacio alcanza con el primer readdir (una sola llamada al sistema)
+    while(!found && (dirent = readdir(new_dir)) != NULL){
+        found = dirent->d_name[0] != '.';
+    }
+    closedir(new_dir);
+    return found;
+}
+
+long deliver_new_maildir(const char* new_path, const char* cur_path){
+    DIR* new_dir = opendir(new_path);
+    if(new_dir == NULL){
+        //Si no hay new/ no hay nada que entregar
+        return errno == ENOENT ? 0 : -1;
+    }
+    int cur_fd = open(cur_path, O_RDONLY | O_DIRECTORY);
+    if(cur_fd == -1){
+        closedir(new_dir);
+        return -1;
+    }
+    long moved = 0;
+    char cur_name[NAME_SIZE];
+    struct dirent* dirent;
+    //readdir trae las entradas de a muchas por llamada, asi que solo queda un rename por mail
+    while((dirent = readdir(new_dir)) != NULL){
+        //En Maildir los archivos que empiezan con . no son mails (incluye . y ..)
+        if(dirent->d_name[0] == '.'){
+            continue;
+        }
+#ifdef _DIRENT_HAVE_D_TYPE
+        if(dirent->d_type != DT_REG && dirent->d_type != DT_UNKNOWN){
+            continue;
+        }
+#endif
+        //En cur/ el nombre lleva la informacion de flags (vacia), salvo que ya la tenga
+        const char* suffix = strchr(dirent->d_name, ':') == NULL ? INFO_SUFFIX : "";
+        int len = snprintf(cur_name, NAME_SIZE, "%s%s", dirent->d_name, suffix);
+        if(len < 0 || len >= NAME_SIZE){
+            //No entraria en el nombre de un email, lo dejamos en new/
+            continue;
+        }
+        if(move_to_cur(dirfd(new_dir), cur_fd, dirent->d_name, cur_name)){
+            moved++;
+        }
+    }
+    close(cur_fd);
+    closedir(new_dir);
+    return moved;
+}
+
+long expunge_maildir(const char* maildir_path, const email* emails, size_t size){
+    int dir_fd = open(maildir_path,O_DIRECTORY);
+    if(dir_fd == -1){
+        return -1;
+    }
+    long deleted = 0;
+    for(size_t i = 0; i<size; i++){
+        //elimnamos el archivo (cuando ningun proceso lo tenga abierto, lo va a sacar)
+        if(emails[i].deleted && unlinkat(dir_fd,emails[i].name,0) == 0){
+            deleted++;
+        }
+    }
+    close(dir_fd);
+    return deleted;
+}
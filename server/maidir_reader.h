@@ -12,12 +12,71 @@ struct email{
     bool deleted;
 };
 
+typedef struct maildir_scanner maildir_scanner;
+
+typedef enum{
+    MAILDIR_SCAN_PENDING,
+    MAILDIR_SCAN_DONE,
+    MAILDIR_SCAN_ERROR
+}maildir_scan_status;
+
 /*
  * Returns a dynamic array with entries for each directory file
  * size: the max size for the array, it returns the actual size
  */
 email* read_maildir(const char* maildir_path, size_t* size);
 
+/*
+ * Incremental version of read_maildir, so a big maildir can be read in chunks
+ * Opens the directory and returns a scanner that reads at most max emails,
+ * or NULL if the directory can't be opened
+ * use_size_hints: trust the Maildir++ ",S=<size>" in the file name instead of calling stat
+ */
+maildir_scanner* maildir_scan_open(const char* maildir_path, size_t max, bool use_size_hints);
+
+/*
+ * Reads at most budget directory entries
+ * Returns MAILDIR_SCAN_PENDING if there are entries left to read
+ */
+maildir_scan_status maildir_scan_step(maildir_scanner* scanner, size_t budget);
+
+/*
+ * Returns how many emails got their size from the file name (stat calls avoided)
+ */
+size_t maildir_scan_hinted(const maildir_scanner* scanner);
+
+/*
+ * Frees the scanner and returns the emails read (in directory order)
+ * size: returns the amount of emails
+ */
+email* maildir_scan_finish(maildir_scanner* scanner, size_t* size);
+
+/*
+ * Frees the scanner and the emails read so far
+ */
+void maildir_scan_close(maildir_scanner* scanner);
+
 void free_emails(email* emails, size_t size);
 
+/*
+ * Checks if new_path has any entry that could be an email (a name that does not start with '.')
+ * Returns false if new_path does not exist. It stops at the first entry found
+ */
+bool maildir_has_new(const char* new_path);
+
+/*
+ * Moves every email in new_path to cur_path, adding the ":2," info suffix (like a MUA does when it sees new mail)
+ * An email that already exists in cur_path is left in new_path
+ * It only uses its arguments, so it can be run in a worker thread
+ * Returns the amount of emails moved (0 if new_path does not exist), or -1 on error
+ */
+long deliver_new_maildir(const char* new_path, const char* cur_path);
+
+/*
+ * Deletes from maildir_path every email marked as deleted
+ * It only uses its arguments, so it can be run in a worker thread
+ * Returns the amount of emails deleted, or -1 if the directory can't be opened
+ */
+long expunge_maildir(const char* maildir_path, const email* emails, size_t size);
+
 #endif //TPE_PROTOS_MAIDIR_READER_H
@@ -13,17 +13,25 @@
 #include "selector.h"
 #include "pop3.h"
 #include "admin.h"
+#include "metrics.h"
+#include "admin_stream.h"
 #include "args.h"
+#include "worker.h"
 #include "logging/logger.h"
 
 #define MAX_PENDING_CONNECTIONS 20
 #define INITIAL_FDS 1024
+//Hilos que mueven y borran mails (ver worker.h), y cuantos trabajos pueden esperar antes de rechazarlos
+#define WORKER_THREADS 4
+#define WORKER_QUEUE_SIZE 256
 
 static bool done = false;
+//No se puede loggear desde el handler (interrumpe al hilo principal, que puede estar loggeando)
+static volatile sig_atomic_t raised_signal = 0;
 
 static void
 sigterm_handler(const int signal) {
-    logf(LOG_INFO, "Raised signal: %d", signal);
+    raised_signal = signal;
     done = true;
 }
 
@@ -37,15 +45,24 @@ int main(int argc, const char* argv[]) {
     selector_status   ss      = SELECTOR_SUCCESS;
     fd_selector selector      = NULL; //el selector que usa el servidor
 
+    struct pop3args* pop3_args = malloc(sizeof(struct pop3args));
+    if(pop3_args == NULL || errno == ENOMEM){
+        fprintf(stderr, "Cant allocate memory for pop3args\n");
+        return 1;
+    }
+    parse_args(argc, argv, pop3_args);
+
     //Opciones de configuracion del selector
     //Decimos que usamos sigalarm para los trabajos bloqueantes (no nos interesa)
     //Espera 10 segundos hasta salir del select interno
+    //Con -E usa epoll, y las conexiones POP3 son edge-triggered
     const struct selector_init conf = {
             .signal = SIGALRM,
             .select_timeout = {
                     .tv_sec  = 10,
                     .tv_nsec = 0,
             },
+            .epoll = pop3_args->epoll,
     };
 
     //Guarda las configuraciones para el selector
@@ -61,19 +78,19 @@ int main(int argc, const char* argv[]) {
         return 1;
     }
 
-    if(logger_init(selector, "", NULL)!=0){
+    //Se inicializa despues de leer los argumentos porque el formato de los logs se elige ahi
+    logger_set_output(pop3_args->binary_log ? LOG_OUTPUT_BINARY : LOG_OUTPUT_TEXT);
+    logger_set_rotation(pop3_args->log_rotate_bytes, pop3_args->log_rotate_seconds);
+    logger_set_backlog_limit(pop3_args->log_backlog_limit);
+    selector_profile_enable(pop3_args->loop_profile);
+    if(logger_init("", NULL)!=0){
         fprintf(stderr,"Unable to initialize logger\n");
         return 1;
     }
-
-    struct pop3args* pop3_args = malloc(sizeof(struct pop3args));
-    if(pop3_args == NULL || errno == ENOMEM){
-        log(LOG_FATAL, "Cant allocate memory for pop3args");
-        return 1;
-    }
-    parse_args(argc, argv, pop3_args);
-
     logger_set_level(pop3_args->log_level);
+    if(pop3_args->log_level < LOG_COMPILE_MIN_LEVEL) {
+        fprintf(stderr, "WARNING: logs below level %d were not compiled in this build\n", LOG_COMPILE_MIN_LEVEL);
+    }
     log(LOG_INFO, "Initializing logger");
 
     // No queremos que se haga buffering de la salida estandar (que se envíe al recibir un \n), sino que se envíe inmediatamente
@@ -116,6 +133,27 @@ int main(int argc, const char* argv[]) {
 
     log(LOG_DEBUG, "Opening ADMIN socket");
     const int admin = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    //El canal de administracion por TCP solo se abre si se pidio con -c
+    int admin_stream = -1;
+    int metrics = -1;
+    if(pop3_args->pop3_config_port != 0){
+        log(LOG_DEBUG, "Opening ADMIN TCP socket");
+        admin_stream = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(admin_stream < 0){
+            err_msg = "Unable to create socket for admin in TCP";
+            goto finally;
+        }
+    }
+    //El endpoint de metricas es opcional
+    if(pop3_args->metrics_port != 0){
+        log(LOG_DEBUG, "Opening METRICS socket");
+        metrics = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(metrics < 0){
+            err_msg = "Unable to create socket for metrics";
+            goto finally;
+        }
+    }
     //Si hubo algun error al abrir el socket
     if(server < 0) {
         err_msg = "Unable to create socket for IPv4";
@@ -165,16 +203,60 @@ int main(int argc, const char* argv[]) {
         goto finally;
     }
 
+    if(metrics >= 0){
+        struct sockaddr_in metrics_addr;
+        memset(&metrics_addr, 0, sizeof(metrics_addr));
+        metrics_addr.sin_family = AF_INET;
+        metrics_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        metrics_addr.sin_port = htons(pop3_args->metrics_port);
+        setsockopt(metrics, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+        logf(LOG_INFO, "Binding socket for METRICS on port %d", (int) pop3_args->metrics_port);
+        if(bind(metrics, (struct sockaddr*) &metrics_addr, sizeof(metrics_addr)) < 0) {
+            err_msg = "Unable to bind socket for metrics";
+            goto finally;
+        }
+        if(listen(metrics, MAX_PENDING_CONNECTIONS) < 0) {
+            err_msg = "Unable to listen in metrics socket";
+            goto finally;
+        }
+        if(selector_fd_set_nio(metrics) == -1) {
+            err_msg = "Unable to set metrics socket as non-blocking";
+            goto finally;
+        }
+    }
+
+    if(admin_stream >= 0){
+        struct sockaddr_in admin_stream_addr;
+        memset(&admin_stream_addr, 0, sizeof(admin_stream_addr));
+        admin_stream_addr.sin_family = AF_INET;
+        admin_stream_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        admin_stream_addr.sin_port = htons(pop3_args->pop3_config_port);
+        setsockopt(admin_stream, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+        logf(LOG_INFO, "Binding socket for ADMIN TCP on port %d", (int) pop3_args->pop3_config_port);
+        if(bind(admin_stream, (struct sockaddr*) &admin_stream_addr, sizeof(admin_stream_addr)) < 0) {
+            err_msg = "Unable to bind socket for admin in TCP";
+            goto finally;
+        }
+        if(listen(admin_stream, MAX_PENDING_CONNECTIONS) < 0) {
+            err_msg = "Unable to listen in admin TCP socket";
+            goto finally;
+        }
+        if(selector_fd_set_nio(admin_stream) == -1) {
+            err_msg = "Unable to set admin TCP socket as non-blocking";
+            goto finally;
+        }
+    }
+
     //Marca al socket server como un socket pasivo
-    //Si hay mas de MAX_PENDING_CONNECTIONS conexiones en la lista de espera, va a empezar a rechazar algunas
+    //Si hay mas de -q conexiones en la lista de espera, va a empezar a rechazar algunas (el kernel lo limita a somaxconn)
     log(LOG_INFO, "Start listening for incoming connections for IPv4 socket");
-    if (listen(server, MAX_PENDING_CONNECTIONS) < 0) {
+    if (listen(server, pop3_args->listen_backlog) < 0) {
         err_msg = "Unable to listen in IPv4 socket";
         goto finally;
     }
 
     log(LOG_INFO, "Start listening for incoming connections for IPv6 socket");
-    if (listen(server_6, MAX_PENDING_CONNECTIONS) < 0) {
+    if (listen(server_6, pop3_args->listen_backlog) < 0) {
         err_msg = "Unable to listen in IPv6 socket";
         goto finally;
     }
@@ -212,14 +294,36 @@ int main(int argc, const char* argv[]) {
             .handle_read       = pop3_passive_accept,
             .handle_write      = NULL,
             .handle_close      = NULL, // nada que liberar
+            .name              = "pop3-accept",
     };
 
     const struct fd_handler admin_handler = {
             .handle_read    = admin_read,
             .handle_write   = NULL,
-            .handle_close   = NULL
+            .handle_close   = NULL,
+            .name           = "admin",
     };
 
+    const struct fd_handler metrics_handler = {
+            .handle_read    = metrics_passive_accept,
+            .handle_write   = NULL,
+            .handle_close   = NULL, // cada conexion libera lo suyo
+            .name           = "metrics-accept",
+    };
+
+    const struct fd_handler admin_stream_handler = {
+            .handle_read    = admin_stream_passive_accept,
+            .handle_write   = NULL,
+            .handle_close   = NULL, // cada conexion libera lo suyo
+            .name           = "admin-stream-accept",
+    };
+
+    log(LOG_INFO, "Starting worker threads");
+    if(worker_init(WORKER_THREADS, WORKER_QUEUE_SIZE) != 0){
+        err_msg = "Unable to start worker threads";
+        goto finally;
+    }
+
     log(LOG_INFO, "Setting IPv4 socket as passive");
     //Registra al fd del server, suscribiendolo para la lectura
     //Como no necesita un dato auxiliar para los handlers, pasa NULL
@@ -246,6 +350,26 @@ int main(int argc, const char* argv[]) {
         goto finally;
     }
 
+    if(metrics >= 0){
+        log(LOG_INFO, "Setting METRICS socket as passive");
+        ss = selector_register(selector, metrics, &metrics_handler,
+                               OP_READ, NULL);
+        if(ss != SELECTOR_SUCCESS) {
+            err_msg = "Unable to register fd for metrics socket";
+            goto finally;
+        }
+    }
+
+    if(admin_stream >= 0){
+        log(LOG_INFO, "Setting ADMIN TCP socket as passive");
+        ss = selector_register(selector, admin_stream, &admin_stream_handler,
+                               OP_READ, pop3_args);
+        if(ss != SELECTOR_SUCCESS) {
+            err_msg = "Unable to register fd for admin TCP socket";
+            goto finally;
+        }
+    }
+
     for(;!done;) {
         err_msg = NULL;
         ss = selector_select(selector);
@@ -255,6 +379,9 @@ int main(int argc, const char* argv[]) {
             goto finally;
         }
     }
+    if(raised_signal != 0) {
+        logf(LOG_INFO, "Raised signal: %d", (int) raised_signal);
+    }
 
     log(LOG_INFO, "Closing everything");
 
@@ -279,8 +406,12 @@ int main(int argc, const char* argv[]) {
         log(LOG_INFO, "Destroying selector");
         selector_destroy(selector);
     }
+    //Despues del selector: las conexiones ya soltaron sus trabajos, solo se terminan los que estaban encolados
+    log(LOG_INFO, "Waiting for worker threads");
+    worker_close();
     log(LOG_INFO, "Closing selector");
     selector_close();
+    admin_destroy();
     usersADT_destroy(pop3_args->users);
     free(pop3_args->maildir_path);
     free(pop3_args);
@@ -301,6 +432,16 @@ int main(int argc, const char* argv[]) {
         close(admin);
     }
 
+    if(admin_stream >= 0){
+        log(LOG_INFO,"Closing ADMIN TCP socket");
+        close(admin_stream);
+    }
+
+    if(metrics >= 0){
+        log(LOG_INFO,"Closing METRICS socket");
+        close(metrics);
+    }
+
     logf(LOG_INFO, "Server terminated with code %d", ret);
     logger_finalize();
     return ret;
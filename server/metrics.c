@@ -0,0 +1,269 @@
+#include <sys/types.h>   // socket
+#include <sys/socket.h>  // socket
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include "metrics.h"
+#include "pop3.h"
+#include "histogram.h"
+#include "admission.h"
+#include "worker.h"
+#include "logging/logger.h"
+
+#define METRICS_REQUEST_SIZE 2048
+#define METRICS_PATH "/metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+#define HTTP_NOT_FOUND "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define HTTP_BAD_REQUEST "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define HTTP_SERVER_ERROR "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+#define US_PER_SECOND 1e6
+
+/*
+ * Estado de una conexion al endpoint de metricas
+ * response es NULL mientras se lee el request. Si apunta a un mensaje fijo, owns_response es false
+ */
+struct metrics_connection{
+    char request[METRICS_REQUEST_SIZE + 1];
+    size_t request_len;
+    char* response;
+    size_t response_len;
+    size_t sent;
+    bool owns_response;
+};
+
+static void metrics_read(struct selector_key* key);
+static void metrics_write(struct selector_key* key);
+static void metrics_close(struct selector_key* key);
+
+static const struct fd_handler metrics_handler = {
+    .handle_read = metrics_read,
+    .handle_write = metrics_write,
+    .handle_close = metrics_close,
+    .name = "metrics"
+};
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Generacion de las metricas
+ * --------------------------------------------------------------------------------------
+ */
+static void write_metric(FILE* out, const char* name, const char* type, const char* help, double value){
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+static void write_summary_lines(FILE* out, const char* name, const char* labels, const struct histogram* h){
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    const char* separator = labels[0] == '\0' ? "" : ",";
+    for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++){
+        fprintf(out, "%s{%s%squantile=\"%g\"} %.6f\n", name, labels, separator, quantiles[i],
+                histogram_percentile(h, quantiles[i] * 100) / US_PER_SECOND);
+    }
+    fprintf(out, "%s_sum{%s} %.6f\n", name, labels, h->total / US_PER_SECOND);
+    fprintf(out, "%s_count{%s} %lu\n", name, labels, (unsigned long) h->count);
+}
+
+static void write_accept_error(const char* error, unsigned long count, void* data){
+    fprintf(data, "pop3_accept_errors_total{errno=\"%s\"} %lu\n", error, count);
+}
+
+struct command_summaries{
+    FILE* out;
+    bool ttfb;
+};
+
+static void write_command_summary(const char* command, const struct histogram* ttfb, const struct histogram* total, void* data){
+    struct command_summaries* summaries = data;
+    char labels[64];
+    snprintf(labels, sizeof(labels), "command=\"%s\"", command);
+    if(summaries->ttfb){
+        write_summary_lines(summaries->out, "pop3_command_ttfb_seconds", labels, ttfb);
+    }else{
+        write_summary_lines(summaries->out, "pop3_command_duration_seconds", labels, total);
+    }
+}
+
+static void write_metrics(FILE* out){
+    extern unsigned long historic_connections, current_connections, bytes_sent, write_budget_yields, accept_dropped;
+    extern unsigned long expunge_count, expunge_total_us, expunged_emails;
+    extern unsigned long maildir_entries, maildir_stats_avoided, delivered_emails;
+    extern unsigned long rejected_connections[ADMISSION_RESULTS];
+
+    write_metric(out, "pop3_connections_total", "counter", "POP3 connections accepted.", historic_connections);
+    write_metric(out, "pop3_connections", "gauge", "POP3 connections currently open.", current_connections);
+    write_metric(out, "pop3_sent_bytes_total", "counter", "Bytes sent to POP3 clients.", bytes_sent);
+    write_metric(out, "pop3_connection_buffer_bytes", "gauge", "Memory used by the I/O buffers of open connections.",
+                 (double) current_connections * POP3_CONNECTION_BUFFERS * BUFFER_SIZE);
+    write_metric(out, "pop3_write_budget_yields_total", "counter", "Responses paused to let other connections run.", write_budget_yields);
+    fprintf(out, "# HELP pop3_accept_errors_total Failed accept calls on the POP3 sockets, by errno.\n"
+                 "# TYPE pop3_accept_errors_total counter\n");
+    pop3_accept_errors_foreach(write_accept_error, out);
+    write_metric(out, "pop3_accept_dropped_total", "counter", "Connections closed right after accept because there were no fds left.", accept_dropped);
+    fprintf(out, "# HELP pop3_rejected_connections_total Connections closed by the -C, -I and -r limits, by reason.\n"
+                 "# TYPE pop3_rejected_connections_total counter\n");
+    for(admission_result reason = ADMISSION_MAX_CONNECTIONS; reason < ADMISSION_RESULTS; reason++){
+        fprintf(out, "pop3_rejected_connections_total{reason=\"%s\"} %lu\n", admission_result_name(reason), rejected_connections[reason]);
+    }
+    write_metric(out, "pop3_admission_table_full_total", "counter", "Connections let through without per-IP accounting because the table was full.",
+                 admission_table_full());
+
+    struct command_summaries summaries = {.out = out, .ttfb = false};
+    fprintf(out, "# HELP pop3_command_duration_seconds Time from reading a command to sending the last byte of its response.\n"
+                 "# TYPE pop3_command_duration_seconds summary\n");
+    pop3_latency_foreach(write_command_summary, &summaries);
+    summaries.ttfb = true;
+    fprintf(out, "# HELP pop3_command_ttfb_seconds Time from reading a command to sending the first byte of its response.\n"
+                 "# TYPE pop3_command_ttfb_seconds summary\n");
+    pop3_latency_foreach(write_command_summary, &summaries);
+
+    fprintf(out, "# HELP pop3_maildir_scan_seconds Time spent reading the maildir after a login.\n"
+                 "# TYPE pop3_maildir_scan_seconds summary\n");
+    write_summary_lines(out, "pop3_maildir_scan_seconds", "", pop3_maildir_scan_latency());
+    write_metric(out, "pop3_maildir_emails_total", "counter", "Emails read from maildirs at login.", maildir_entries);
+    write_metric(out, "pop3_maildir_stats_avoided_total", "counter", "Emails whose size was taken from the file name.", maildir_stats_avoided);
+    write_metric(out, "pop3_delivered_emails_total", "counter", "Emails moved from new/ to cur/ at login.", delivered_emails);
+    write_metric(out, "pop3_expunges_total", "counter", "QUIT commands that deleted emails.", expunge_count);
+    write_metric(out, "pop3_expunged_emails_total", "counter", "Emails deleted at QUIT.", expunged_emails);
+    write_metric(out, "pop3_expunge_seconds_total", "counter", "Time spent deleting emails at QUIT.", expunge_total_us / US_PER_SECOND);
+    write_metric(out, "pop3_worker_rejected_total", "counter", "Deliver and expunge jobs rejected because the worker queue was full.", worker_rejected());
+
+    write_metric(out, "pop3_log_dropped_lines_total", "counter", "Log lines dropped because the buffers were full.", logger_get_dropped());
+    write_metric(out, "pop3_log_backlog_bytes", "gauge", "Log bytes waiting to be written.", logger_get_backlog());
+    write_metric(out, "pop3_log_rotations_total", "counter", "Log file rotations.", logger_get_rotations());
+}
+
+/*
+ * Arma la respuesta completa en memoria. Retorna false si no hubo memoria
+ */
+static bool build_metrics_response(struct metrics_connection* conn){
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* out = open_memstream(&body, &body_len);
+    if(out == NULL){
+        return false;
+    }
+    write_metrics(out);
+    if(fclose(out) != 0){
+        free(body);
+        return false;
+    }
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+    if(header_len < 0 || (size_t) header_len >= sizeof(header)){
+        free(body);
+        return false;
+    }
+    conn->response = malloc(header_len + body_len);
+    if(conn->response == NULL){
+        free(body);
+        return false;
+    }
+    memcpy(conn->response, header, header_len);
+    memcpy(conn->response + header_len, body, body_len);
+    conn->response_len = header_len + body_len;
+    conn->owns_response = true;
+    free(body);
+    return true;
+}
+
+static void set_static_response(struct metrics_connection* conn, const char* response){
+    conn->response = (char*) response;
+    conn->response_len = strlen(response);
+    conn->owns_response = false;
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Funciones utilizadas por el selector
+ * --------------------------------------------------------------------------------------
+ */
+void metrics_passive_accept(struct selector_key* key){
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    struct metrics_connection* conn = NULL;
+    const int client_fd = accept(key->fd, (struct sockaddr *) &address, &address_len);
+    if(client_fd == -1){
+        log(LOG_ERROR, "[METRICS] Error accepting connection");
+        return;
+    }
+    if(selector_fd_set_nio(client_fd) == -1){
+        log(LOG_ERROR, "[METRICS] Error setting connection as non-blocking");
+        goto fail;
+    }
+    conn = calloc(1, sizeof(struct metrics_connection));
+    if(conn == NULL){
+        log(LOG_ERROR, "[METRICS] Error reserving memory for connection");
+        goto fail;
+    }
+    if(selector_register(key->s, client_fd, &metrics_handler, OP_READ, conn) != SELECTOR_SUCCESS){
+        log(LOG_ERROR, "[METRICS] Failed to register connection");
+        goto fail;
+    }
+    return;
+
+fail:
+    close(client_fd);
+    free(conn);
+}
+
+static void metrics_read(struct selector_key* key){
+    struct metrics_connection* conn = key->data;
+    ssize_t read_count = recv(key->fd, conn->request + conn->request_len, METRICS_REQUEST_SIZE - conn->request_len, 0);
+    if(read_count <= 0){
+        selector_unregister_fd(key->s, key->fd);
+        return;
+    }
+    conn->request_len += read_count;
+    conn->request[conn->request_len] = '\0';
+
+    // Solo nos importa la primera linea, pero esperamos el fin de los headers para no cortar la conexion antes
+    if(strstr(conn->request, "\r\n\r\n") == NULL && strstr(conn->request, "\n\n") == NULL){
+        if(conn->request_len == METRICS_REQUEST_SIZE){
+            set_static_response(conn, HTTP_BAD_REQUEST);
+            selector_set_interest_key(key, OP_WRITE);
+        }
+        return;
+    }
+    if(strncmp(conn->request, "GET ", 4) != 0){
+        set_static_response(conn, HTTP_BAD_REQUEST);
+    }else{
+        char* path = conn->request + 4;
+        size_t path_len = strcspn(path, " ?\r\n");
+        if(path_len != strlen(METRICS_PATH) || strncmp(path, METRICS_PATH, path_len) != 0){
+            set_static_response(conn, HTTP_NOT_FOUND);
+        }else if(!build_metrics_response(conn)){
+            log(LOG_ERROR, "[METRICS] Error generating metrics response");
+            set_static_response(conn, HTTP_SERVER_ERROR);
+        }
+    }
+    if(selector_set_interest_key(key, OP_WRITE) != SELECTOR_SUCCESS){
+        selector_unregister_fd(key->s, key->fd);
+    }
+}
+
+static void metrics_write(struct selector_key* key){
+    struct metrics_connection* conn = key->data;
+    ssize_t sent_count = send(key->fd, conn->response + conn->sent, conn->response_len - conn->sent, MSG_NOSIGNAL);
+    if(sent_count == -1){
+        if(errno != EAGAIN && errno != EWOULDBLOCK){
+            selector_unregister_fd(key->s, key->fd);
+        }
+        return;
+    }
+    conn->sent += sent_count;
+    if(conn->sent == conn->response_len){
+        selector_unregister_fd(key->s, key->fd);
+    }
+}
+
+static void metrics_close(struct selector_key* key){
+    struct metrics_connection* conn = key->data;
+    close(key->fd);
+    if(conn->owns_response){
+        free(conn->response);
+    }
+    free(conn);
+}
@@ -0,0 +1,14 @@
+#ifndef METRICS_H_Hx7RcW2nQe5YtLk9PvBm3ZsA8
+#define METRICS_H_Hx7RcW2nQe5YtLk9PvBm3ZsA8
+
+#include "selector.h"
+
+/*
+ * Endpoint HTTP con las metricas del servidor en el formato de texto de Prometheus (GET /metrics)
+ *
+ * El socket pasivo se registra en el mismo selector que POP3 con este handler de lectura. Cada conexion
+ * lee un solo request, genera la respuesta completa en memoria y la manda sin bloquear; despues se cierra
+ */
+void metrics_passive_accept(struct selector_key* key);
+
+#endif
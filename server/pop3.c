@@ -1,6 +1,9 @@
+// accept4 es de Linux
+#define _GNU_SOURCE
 #include <sys/types.h>   // socket
 #include <sys/socket.h>  // socket
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,6 +19,12 @@
 #include "./parser/parser_definition/pop3_parser_definition.h"
 #include "./parser/parser_definition/byte_stuffing_parser_definition.h"
 #include "args.h"
+#include "worker.h"
+#include "timing.h"
+#include "histogram.h"
+#include "stuffing.h"
+#include "probes.h"
+#include "admission.h"
 #include "logging/logger.h"
 
 #define MAX_CMD 5
@@ -38,16 +47,123 @@
 #define LIST_MESSAGE "+OK scan listing follows\r\n"
 #define NO_MAILDIR_MESSAGE "-ERR Could not open maildir\r\n"
 #define UNKNOWN_ERROR_MESSAGE "-ERR Closing connection\r\n"
+#define EXPUNGE_REJECTED_MESSAGE "-ERR [SYS/TEMP] Some deleted messages not removed, try again later\r\n"
 #define MAX_LIST_FIRST_LINE (3 + 1 + 20 + 1 + 20 + 3) //+OK %ld %ld \r\n
 #define MAX_LIST_LINE (20+1+20+3) //%d %ld\r\n
 #define MAX_RETR_FIRST_LINE (3+1+20+1+6+3) //+OK %ld octets\r\n
 #define MAX_STAT_LINE (3+1+20+1+20+3) //+OK %zu %ld\r\n
+#define MAILDIR_SCAN_CHUNK 256 //entradas del maildir que se leen por iteracion del selector
+#define READ_ROUNDS 16 //recv por llamada a read_request antes de ceder el selector al resto de las conexiones
+//Presupuesto de cada llamada a write_response: pasado cualquiera de los dos, la conexion espera a que se atienda al resto
+#define WRITE_BUDGET_BYTES (32 * 1024)
+#define WRITE_BUDGET_US 500
+#define ACCEPT_BUDGET 64 //conexiones que se aceptan por llamada a pop3_passive_accept
+#define TOO_MANY_CONNECTIONS_MESSAGE "-ERR [SYS/TEMP] Too many connections, try again later\r\n"
 /*
  * Estadísticas del servidor
  */
 unsigned long historic_connections = 0;
 unsigned long current_connections = 0;
 unsigned long bytes_sent = 0;
+/*
+ * Estadísticas del borrado de mails al hacer QUIT (en microsegundos)
+ */
+unsigned long expunge_count = 0;
+unsigned long expunge_total_us = 0;
+unsigned long expunge_max_us = 0;
+unsigned long expunged_emails = 0;
+/*
+ * Estadísticas de la lectura del maildir al hacer PASS
+ * maildir_stats_avoided: mails cuyo tamaño salio del nombre (,S=<size>), sin hacer stat
+ */
+unsigned long maildir_scans = 0;
+unsigned long maildir_entries = 0;
+unsigned long maildir_stats_avoided = 0;
+unsigned long delivered_emails = 0;
+/*
+ * write_budget_yields: veces que una respuesta se corto por el presupuesto de write_response y se encolo
+ */
+unsigned long write_budget_yields = 0;
+/*
+ * accept_dropped: conexiones que se aceptaron y cerraron enseguida por no tener fds (ver accept_failed)
+ */
+unsigned long accept_dropped = 0;
+/*
+ * rejected_connections: conexiones cerradas por -C, -I o -r, por motivo (ADMISSION_OK no se usa)
+ */
+unsigned long rejected_connections[ADMISSION_RESULTS] = {0};
+/*
+ * Latencias por comando (solo los que tienen .metric) y de la lectura del maildir al hacer PASS, en microsegundos
+ * ttfb: desde que se termino de leer el comando hasta que se mando el primer byte de la respuesta
+ * total: hasta que se mando el ultimo byte de la respuesta
+ */
+struct command_latency{
+    struct histogram ttfb;
+    struct histogram total;
+};
+
+/*
+ * Contador de comandos para el muestreo de latencias del access log (-A)
+ */
+static unsigned long access_sample_counter = 0;
+
+//Fallos de accept por errno, el ultimo cuenta el resto
+static struct accept_error{
+    int error;
+    const char* name;
+    unsigned long count;
+} accept_errors[] = {
+    {EMFILE, "EMFILE", 0},
+    {ENFILE, "ENFILE", 0},
+    {ENOBUFS, "ENOBUFS", 0},
+    {ENOMEM, "ENOMEM", 0},
+    {ECONNABORTED, "ECONNABORTED", 0},
+    {EPROTO, "EPROTO", 0},
+    {EPERM, "EPERM", 0},
+    {0, "other", 0},
+};
+//fd abierto de mas para poder aceptar (y cerrar) una conexion cuando se acaban los fds
+static int reserve_fd = -1;
+
+/*
+ * Datos de la sesion para el access log (ver log_session): se emite un solo registro al cerrar la conexion
+ * command_start_us: momento en que se termino de leer el comando actual, 0 si no hay uno en curso
+ */
+struct session_stats{
+    uint64_t start_us;
+    uint64_t command_start_us;
+    unsigned long command_bytes;
+    bool first_byte_sent;
+    uint64_t scan_start_us;
+    unsigned long commands;
+    unsigned long bytes_sent;
+    unsigned long retrs;
+    long deleted;
+    bool authenticated;
+};
+
+/*
+ * Datos del borrado de mails que hace el worker al hacer QUIT
+ * Se queda con los mails y el path de la conexion, que ya no los necesita
+ */
+struct expunge_task{
+    char* path;
+    email* emails;
+    size_t emails_count;
+    long deleted;
+    uint64_t elapsed_us;
+    bool rejected; //la cola de los workers estaba llena: no se borro nada
+};
+
+/*
+ * Datos de la entrega de los mails de new/ a cur/ que hace el worker al hacer PASS
+ * Tiene copias de los paths, porque la conexion se puede cerrar antes de que termine
+ */
+struct deliver_task{
+    char* new_path;
+    char* cur_path;
+    long moved;
+};
 
 /*
  * Estructura para guardar un comando de POP3
@@ -57,6 +173,7 @@ struct command{
     char* name;
     bool (*check)(const char* arg);
     int (*action)(pop3* state);
+    bool metric; //si se guardan sus latencias (ver pop3_latency_report)
 };
 
 typedef struct command command;
@@ -66,7 +183,6 @@ typedef struct command command;
  */
 struct authorization{
     char * user;
-    char * pass;
     bool user_is_present;
     char * path_to_user_data;
 };
@@ -135,10 +251,17 @@ struct pop3{
     parserADT byte_stuffing_parser;
     email* emails;
     size_t emails_count;
+    maildir_scanner* scanner;
     char* path_to_user_maildir;
     int references;
     struct pop3args* pop3_args;
     user_t * user_s;
+    worker_job job;
+    struct expunge_task* expunge;
+    struct deliver_task* deliver;
+    struct session_stats stats;
+    admission_key client;
+    bool admitted; //si quedo contada en los limites por IP (ver admission_enter)
     union{
         struct authorization authorization;
         struct transaction transaction;
@@ -167,6 +290,23 @@ typedef enum{
      * Se usa para dejar los contenidos del archivo en un buffer intermedio, logrando no bloquearse en la lectura del archivo
      */
     PROCESSING_RESPONSE,
+    /*
+     * DELIVERING_MAILS: estado donde se mueven los mails nuevos del usuario (new/) a cur/ luego de un PASS valido
+     * Los renames se hacen en un worker, para no bloquear al resto de las conexiones. Al terminar se lee el maildir
+     */
+    DELIVERING_MAILS,
+    /*
+     * LOADING_MAILDIR: estado donde se lee el maildir del usuario luego de un PASS valido
+     * Se lee de a partes en cada iteracion del selector, para que un maildir grande no frene al resto de
+     * las conexiones. Los comandos que lleguen mientras tanto se procesan al terminar, con la numeracion final
+     */
+    LOADING_MAILDIR,
+    /*
+     * EXPUNGING: estado donde se estan borrando los mails marcados luego de un QUIT
+     * El borrado se hace en un worker, para no bloquear al resto de las conexiones. Al terminar,
+     * se escribe el mensaje de QUIT
+     */
+    EXPUNGING,
     /*
     * FINISHED: estado de finalización de la interaccion
     * Se utiliza para cerrar la conexion sin imprimir un mensaje de error
@@ -186,9 +326,24 @@ unsigned int hello_write(struct selector_key* key);
 unsigned int read_request(struct selector_key* key);
 unsigned int write_response(struct selector_key* key);
 unsigned int process_response(struct  selector_key* key);
+unsigned int load_maildir(struct selector_key* key);
+static bool read_file(fd_selector s, pop3* state);
+void deliver_start(const unsigned state, struct selector_key *key);
+unsigned int deliver_done(struct selector_key* key);
+static void deliver_task_destroy(void* data);
+unsigned int next_request(struct selector_key* key);
+static void command_received(pop3* state);
+static void command_done(pop3* state);
+static void response_sent(pop3* state, ssize_t sent_count);
+void load_maildir_start(const unsigned state, struct selector_key *key);
+static void log_session(pop3* state);
 void finish_connection(const unsigned state, struct selector_key *key);
+void error_start(const unsigned state, struct selector_key *key);
 unsigned int finish_error(struct  selector_key* key);
 void process_open_file(const unsigned state, struct selector_key *key);
+void expunge_start(const unsigned state, struct selector_key *key);
+unsigned int expunge_done(struct selector_key* key);
+static void expunge_task_destroy(void* data);
 //funcion para reiniciar estructuras asociadas a un estado del protocolo
 void reset_structures(pop3* state);
 //funciones utilizadas para crear y destruir la estructura que mantiene el estado de una conexion (pop3)
@@ -217,32 +372,38 @@ static struct command commands[]={
         {
             .name = "USER",
             .check = have_argument,
-            .action = user_action
+            .action = user_action,
+            .metric = true
         },
         {
             .name = "PASS",
             .check = have_argument,
-            .action = pass_action
+            .action = pass_action,
+            .metric = true
         },
         {
             .name = "STAT",
             .check = not_argument,
-            .action = stat_action
+            .action = stat_action,
+            .metric = true
         },
         {
             .name = "LIST",
             .check = might_argument,
-            .action = list_action
+            .action = list_action,
+            .metric = true
         },
         {
             .name = "RETR",
             .check = have_argument,
-            .action = retr_action
+            .action = retr_action,
+            .metric = true
         },
         {
             .name = "DELE",
             .check = have_argument,
-            .action = dele_action
+            .action = dele_action,
+            .metric = true
         },
         {
             .name = "NOOP",
@@ -256,7 +417,8 @@ static struct command commands[]={
         {
             .name = "QUIT",
             .check = not_argument,
-            .action = quit_action
+            .action = quit_action,
+            .metric = true
         },
         {
             .name = "CAPA",
@@ -291,44 +453,89 @@ static const struct state_definition state_handlers[] ={
         .on_arrival = process_open_file,
         .on_read_ready = process_response ,
     },
+    {
+        .state = DELIVERING_MAILS,
+        .on_arrival = deliver_start,
+        .on_write_ready = deliver_done,
+        .on_block_ready = deliver_done,
+    },
+    {
+        .state = LOADING_MAILDIR,
+        .on_arrival = load_maildir_start,
+        .on_write_ready = load_maildir,
+    },
+    {
+        .state = EXPUNGING,
+        .on_arrival = expunge_start,
+        .on_write_ready = expunge_done,
+        .on_block_ready = expunge_done,
+    },
     {
         .state = FINISHED,
         .on_arrival = finish_connection,
     },
     {
         .state = ERROR,
+        .on_arrival = error_start,
         .on_write_ready = finish_error
     }
 
 };
 
+static struct command_latency command_latencies[ERROR_COMMAND];
+static struct histogram maildir_scan_latency;
+
+//con -P, tiempo de los handlers de cada estado (de todas las conexiones)
+static struct profile_counter state_profile[ERROR + 1];
+static const char* state_names[ERROR + 1] = {
+    "HELLO", "READING_REQUEST", "WRITING_RESPONSE", "PROCESSING_RESPONSE", "DELIVERING_MAILS", "LOADING_MAILDIR",
+    "EXPUNGING", "FINISHED", "ERROR"
+};
+
 //fd_handler que van a usar todas las conexiones al servidor (que usen el socket pasivo de pop3)
 static const struct fd_handler handler = {
     .handle_read = pop3_read,
     .handle_write = pop3_write,
-    .handle_block = NULL,
-    .handle_close = pop3_close //se llama tambien cuando cierra el servidor
+    .handle_block = pop3_block,
+    .handle_close = pop3_close, //se llama tambien cuando cierra el servidor
+    .name = "pop3", //conexiones y archivos de RETR, se separan por estado en pop3_state_profile_foreach
+    .edge_triggered = true //con -E; read_request y write_response siguen hasta EAGAIN o llaman a selector_schedule
 };
 
 /*
- * Funcion utilizada en el socket pasivo para aceptar una nueva conexion y agregarla al selector
+ * Cierra una conexion que no entra en los limites de -C, -I o -r, avisandole al cliente si se puede
  */
-void pop3_passive_accept(struct selector_key* key) {
+static void reject_connection(const int client_fd, admission_result reason){
+    rejected_connections[reason]++;
+    logf(LOG_DEBUG, "Rejecting connection with fd %d: %s", client_fd, admission_result_name(reason));
+    //El socket recien aceptado tiene lugar para el mensaje, y si no se manda no se espera
+    send(client_fd, TOO_MANY_CONNECTIONS_MESSAGE, strlen(TOO_MANY_CONNECTIONS_MESSAGE), MSG_NOSIGNAL);
+    close(client_fd);
+}
+
+/*
+ * Registra en el selector una conexion recien aceptada (ya no bloqueante). Si falla, la cierra
+ * Antes de reservar nada para la sesion se chequean los limites de conexiones (-C) y por IP (-I y -r)
+ */
+static void accept_connection(struct selector_key* key, const int client_fd, const struct sockaddr_storage* address){
+    struct pop3args* args = key->data;
     pop3 *state = NULL;
-    // Se crea la estructura del socket activo para la conexion entrante
-    struct sockaddr_storage address;
-    socklen_t address_len = sizeof(address);
-    // Se acepta la conexion entrante, se cargan los datos en el socket activo y se devuelve el fd del socket activo
-    const int client_fd = accept(key->fd, (struct sockaddr *) &address, &address_len);
-
-    //Si tuvimos un error al crear el socket activo o no lo pudimos hacer no bloqueante, no iniciamos la conexion
-    if (client_fd == -1){
-        log(LOG_ERROR, "Error creating active socket for user");
-        goto fail;
+    admission_key client;
+    bool tracked = false;
+    admission_result admission = ADMISSION_OK;
+    if(args->max_connections != 0 && current_connections >= args->max_connections){
+        admission = ADMISSION_MAX_CONNECTIONS;
+    }else if(args->ip_connections != 0 || args->ip_rate != 0){
+        admission_key_init(&client, address);
+        admission = admission_enter(&client, args->ip_connections, args->ip_rate, &tracked);
     }
-    if(selector_fd_set_nio(client_fd) == -1) {
-        logf(LOG_ERROR, "Error setting not block for user %d",client_fd);
-        goto fail;
+    if(admission != ADMISSION_OK){
+        reject_connection(client_fd, admission);
+        return;
+    }
+    //Las respuestas se mandan enteras, sin Nagle no esperan al ACK retrasado del cliente
+    if(setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int)) == -1){
+        logf(LOG_WARNING, "Error setting TCP_NODELAY for user %d", client_fd);
     }
 
     if((state = pop3_create(key->data))==NULL){
@@ -336,28 +543,104 @@ void pop3_passive_accept(struct selector_key* key) {
         goto fail;
     }
     state->connection_fd = client_fd;
-    logf(LOG_INFO, "Registering client with fd %d", client_fd);
+    if(tracked){
+        //desde aca lo descuenta pop3_destroy
+        state->client = client;
+        state->admitted = true;
+        tracked = false;
+    }
+    //pop3_destroy las descuenta, aunque falle el registro
+    log(LOG_DEBUG,"Updating current and historic connections metrics");
+    current_connections++;
+    historic_connections++;
+    logf(LOG_DEBUG, "Registering client with fd %d", client_fd);
     //registramos en el selector al nuevo socket, y nos interesamos en escribir para mandarle el mensaje de bienvenida
     if(selector_register(key->s,client_fd,&handler,OP_WRITE,state)!= SELECTOR_SUCCESS){
         log(LOG_ERROR, "Failed to register socket")
         goto fail;
     }
-    log(LOG_DEBUG,"Updating current and historic connections metrics");
-    current_connections++;
-    historic_connections++;
+    PROBE1(session_accept, client_fd);
 
     return;
 
 fail:
-    if(client_fd != -1){
-        //cerramos el socket del cliente
-        close(client_fd);
+    //cerramos el socket del cliente
+    close(client_fd);
+    if(tracked){
+        admission_leave(&client);
     }
 
     //destuyo y libero el pop3
     pop3_destroy(state);
 }
 
+/*
+ * Cuenta un fallo de accept y decide si seguir aceptando en esta llamada
+ * Sin fds (EMFILE/ENFILE) el socket pasivo sigue listo y el selector lo llamaria en cada iteracion sin avanzar:
+ * se libera el fd de reserva para aceptar la conexion y cerrarla enseguida, asi el cliente no queda esperando
+ */
+static bool accept_failed(const int passive_fd, const int error){
+    size_t i = 0;
+    while(accept_errors[i].error != 0 && accept_errors[i].error != error){
+        i++;
+    }
+    accept_errors[i].count++;
+    logf(LOG_ERROR, "Error accepting connection: %s", accept_errors[i].name);
+    switch(error){
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case EINTR:
+            //fallo solo esta conexion, puede haber otras esperando
+            return true;
+        case EMFILE:
+        case ENFILE:
+            if(reserve_fd == -1){
+                return false;
+            }
+            close(reserve_fd);
+            int dropped = accept(passive_fd, NULL, NULL);
+            if(dropped != -1){
+                close(dropped);
+                accept_dropped++;
+            }
+            reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            return dropped != -1;
+        default:
+            //ENOBUFS, ENOMEM, ...: se vuelve a intentar en la proxima iteracion
+            return false;
+    }
+}
+
+/*
+ * Funcion utilizada en el socket pasivo para aceptar las conexiones entrantes y agregarlas al selector
+ * Acepta hasta ACCEPT_BUDGET por llamada: cuando los clientes reconectan todos juntos (por ejemplo despues de un corte
+ * de red), de a una por iteracion del selector la cola de listen (-q) se llena y el kernel empieza a descartarlos
+ */
+void pop3_passive_accept(struct selector_key* key) {
+    if(reserve_fd == -1){
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    for(int i = 0; i < ACCEPT_BUDGET; i++){
+        // Se crea la estructura del socket activo para la conexion entrante
+        struct sockaddr_storage address;
+        socklen_t address_len = sizeof(address);
+        // Se acepta la conexion entrante, ya no bloqueante (sin los dos fcntl de selector_fd_set_nio)
+        const int client_fd = accept4(key->fd, (struct sockaddr *) &address, &address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                //No quedan conexiones esperando
+                return;
+            }
+            if(!accept_failed(key->fd, errno)){
+                return;
+            }
+            continue;
+        }
+        accept_connection(key, client_fd, &address);
+    }
+}
+
 /*
  * Funcion utilizada para crear la estructura pop3 que mantiene el estado de una conexion
  */
@@ -379,6 +662,7 @@ pop3* pop3_create(void * data){
     ans->pop3_parser = parser_init(&pop3_parser_definition);
     ans->byte_stuffing_parser = parser_init(&byte_stuffing_parser_definition);
     ans->pop3_args = (struct pop3args*) data;
+    ans->stm.profile = ans->pop3_args->loop_profile ? state_profile : NULL;
 
     // Se inicializan los buffers para el cliente (uno para leer y otro para escribir)
     buffer_init(&(ans->info_read_buff), BUFFER_SIZE ,ans->read_buff);
@@ -389,6 +673,7 @@ pop3* pop3_create(void * data){
     uint8_t * ptr = buffer_write_ptr(&(ans->info_write_buff),&max);
     strncpy((char*)ptr,WELCOME_MESSAGE,max);
     buffer_write_adv(&(ans->info_write_buff),strlen(WELCOME_MESSAGE));
+    ans->stats.start_us = timing_now_us();
 
     log(LOG_DEBUG, "Finished initializing structure");
     return ans;
@@ -402,9 +687,26 @@ void pop3_destroy(pop3* state){
     if(state == NULL){
         return;
     }
-    logf(LOG_INFO, "Closing connection with fd %d", state->connection_fd);
+    logf(LOG_DEBUG, "Closing connection with fd %d", state->connection_fd);
+    PROBE4(session_close, state->connection_fd, timing_now_us() - state->stats.start_us, state->stats.commands,
+           state->stats.bytes_sent);
+    if(state->pop3_args->access_log){
+        log_session(state);
+    }
+    if(state->admitted){
+        admission_leave(&state->client);
+    }
     parser_destroy(state->pop3_parser);
     parser_destroy(state->byte_stuffing_parser);
+    //si hay un borrado en curso, termina solo y libera sus datos
+    if(state->job != NULL){
+        worker_release(state->job);
+    }else if(state->expunge != NULL){
+        expunge_task_destroy(state->expunge);
+    }else if(state->deliver != NULL){
+        deliver_task_destroy(state->deliver);
+    }
+    maildir_scan_close(state->scanner);
     free_emails(state->emails,state->emails_count);
     if(state->path_to_user_maildir != NULL){
         free(state->path_to_user_maildir);
@@ -425,7 +727,12 @@ void pop3_read(struct selector_key* key){
     // Se obtiene la maquina de estados del cliente asociado al key
     struct state_machine* stm = &(GET_POP3(key)->stm);
     // Se ejecuta la función de lectura para el estado actual de la maquina de estados
-    stm_handler_read(stm,key);
+    // Si se leyo un comando en el socket, se responde ya: casi seguro se puede escribir, y esperar a la
+    // proxima iteracion del selector es esperar a que todas las demas conexiones usen su presupuesto
+    // (con otro estado no se usa mas stm, puede estar liberada)
+    if(stm_handler_read(stm,key) == WRITING_RESPONSE && key->fd == GET_POP3(key)->connection_fd){
+        stm_handler_write(stm,key);
+    }
 }
 /*
  * Funcion llamada por el selector cuando puede escribir en un fd
@@ -436,6 +743,17 @@ void pop3_write(struct selector_key* key){
     // Se ejecuta la función de lectura para el estado actual de la maquina de estados
     stm_handler_write(stm,key);
 }
+/*
+ * Funcion llamada por el selector cuando termina un trabajo bloqueante de la conexion
+ */
+void pop3_block(struct selector_key* key){
+    //Si no esperamos ningun trabajo, es una notificacion vieja para otra conexion con el mismo fd
+    if(GET_POP3(key)->job == NULL){
+        return;
+    }
+    struct state_machine* stm = &(GET_POP3(key)->stm);
+    stm_handler_block(stm,key);
+}
 /*
  * Funcion llamada por el selector cuando se usa selector_unregister_fd (es decir, cuando se saca al fd del selector)
  */
@@ -464,16 +782,21 @@ unsigned hello_write(struct selector_key* key){
     size_t  max = 0;
     uint8_t* ptr = buffer_read_ptr(&(state->info_write_buff),&max);
     ssize_t sent_count = send(key->fd,ptr,max,MSG_NOSIGNAL);
+    PROBE2(send, key->fd, sent_count);
 
     if(sent_count == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return HELLO;
+        }
         log(LOG_ERROR,"Error writing at socket");
         return FINISHED;
     }
     bytes_sent += sent_count;
+    state->stats.bytes_sent += sent_count;
     buffer_read_adv(&(state->info_write_buff),sent_count);
     //si no pude mandar el mensaje de bienvenida completo, vuelve a intentar
     if(buffer_can_read(&(state->info_write_buff))){
-        return HELLO;
+        return selector_schedule(key->s,key->fd) == SELECTOR_SUCCESS ? HELLO : FINISHED;
     }
     //Si ya no hay mas para escribir y termine con el mensaje de bienvenida
     if(selector_set_interest(key->s,key->fd,OP_READ) != SELECTOR_SUCCESS){
@@ -485,19 +808,154 @@ unsigned hello_write(struct selector_key* key){
 
 unsigned int read_request(struct selector_key* key){
     pop3* state = GET_POP3(key);
-    //Guardamos lo que leemos del socket en el buffer de entrada
-    size_t max = 0;
-    uint8_t* ptr = buffer_write_ptr(&(state->info_read_buff),&max);
-    ssize_t read_count = recv(key->fd, ptr, max, 0);
+    //Leemos hasta vaciar el socket (EAGAIN) o hasta READ_ROUNDS lecturas, para no acaparar el selector
+    for(int round = 0; round < READ_ROUNDS; round++){
+        //Guardamos lo que leemos del socket en el buffer de entrada
+        size_t max = 0;
+        uint8_t* ptr = buffer_write_ptr(&(state->info_read_buff),&max);
+        ssize_t read_count = recv(key->fd, ptr, max, 0);
 
-    if(read_count<=0){
-        log(LOG_ERROR,"Error reading at socket");
+        if(read_count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            //No hay mas nada, el selector nos avisa cuando llegue algo
+            return READING_REQUEST;
+        }
+        if(read_count<=0){
+            log(LOG_ERROR,"Error reading at socket");
+            return FINISHED;
+        }
+        //Avanzamos la escritura en el buffer
+        buffer_write_adv(&(state->info_read_buff),read_count);
+        //Obtenemos un puntero para lectura
+        ptr = buffer_read_ptr(&(state->info_read_buff),&max);
+        for(size_t i = 0; i<max; i++){
+            parser_state parser = parser_feed(state->pop3_parser, ptr[i]);
+            if(parser == PARSER_FINISHED || parser == PARSER_ERROR){
+                //avanzamos solo hasta el fin del comando
+                buffer_read_adv(&(state->info_read_buff),i+1);
+                get_pop3_cmd(state->pop3_parser,state->cmd,MAX_CMD);
+                pop3_command command = get_command(state->cmd);
+                logf(LOG_DEBUG,"Reading request for cmd: '%s'", command>=0 ? commands[command].name : "invalid command");
+                state->command = command;
+                command_received(state);
+                get_pop3_arg(state->pop3_parser,state->arg,MAX_ARG);
+                if(parser == PARSER_ERROR || command == ERROR_COMMAND){
+                    log(LOG_ERROR, "Unknown command");
+                    state->command = ERROR_COMMAND;
+                }
+                if(!commands[command].check(state->arg)){
+                    log(LOG_ERROR, "Bad arguments");
+                    state->command = ERROR_COMMAND;
+                }
+                if(!check_command_for_protocol_state(state->pop3_protocol_state, command)){
+                    logf(LOG_ERROR,"Command '%s' not allowed in this state",commands[command].name);
+                    state->command = ERROR_COMMAND;
+                }
+                parser_reset(state->pop3_parser);
+                //Vamos a procesar la respuesta, lo que quede en el buffer lo toma next_request
+                if(selector_set_interest(key->s,key->fd,OP_WRITE) != SELECTOR_SUCCESS){
+                    log(LOG_ERROR, "Error setting interest to OP_WRITE after reading request");
+                    return FINISHED;
+                }
+                return WRITING_RESPONSE; //vamos a escribir la respuesta
+            }
+        }
+        //Avanzamos en el buffer, leimos lo que tenia
+        buffer_read_adv(&(state->info_read_buff), (ssize_t) max);
+    }
+    //Cortamos antes de EAGAIN: que nos vuelva a llamar en la proxima iteracion
+    if(selector_schedule(key->s,key->fd) != SELECTOR_SUCCESS){
         return FINISHED;
     }
-    //Avanzamos la escritura en el buffer
-    buffer_write_adv(&(state->info_read_buff),read_count);
-    //Obtenemos un puntero para lectura
-    ptr = buffer_read_ptr(&(state->info_read_buff),&max);
+    return READING_REQUEST; //vamos a seguir leyendo el request
+}
+
+unsigned int write_response(struct selector_key* key){
+    pop3* state = GET_POP3(key);
+    //Generamos y mandamos hasta llenar el socket (EAGAIN) o agotar el presupuesto, para que un RETR grande no acapare el selector
+    uint64_t start_us = timing_now_us();
+    size_t budget_sent = 0;
+    while(budget_sent < WRITE_BUDGET_BYTES && timing_now_us() - start_us < WRITE_BUDGET_US){
+        //ejecutamos la funcion para generar la respuesta, que va a setear a state->finished como corresponda
+        if(!state->finished) {
+            unsigned int ret_state = commands[state->command].action(state); //ejecutamos la accion
+            //Si tengo que irme de este estado (para leer del archivo) me voy
+            if(ret_state == ERROR){ //me mantengo en escritura
+                return ERROR;
+            }
+            if(ret_state == PROCESSING_RESPONSE && state->state_data.transaction.file_opened){
+                //El archivo ya esta abierto: lo leemos aca, sin esperar una vuelta del selector
+                if(!read_file(key->s,state)){
+                    return FINISHED;
+                }
+                continue;
+            }
+            if(ret_state!=WRITING_RESPONSE){
+                //Dejo de suscribirme en donde estoy, tengo que ir a otro lado
+                if(selector_set_interest(key->s,key->fd,OP_NOOP) != SELECTOR_SUCCESS){
+                    log(LOG_ERROR, "Error setting interest");
+                    return FINISHED;
+                }
+                return ret_state;
+            }
+        }
+        //Escribimos lo que tenemos en el buffer de salida al socket
+        size_t  max = 0;
+        uint8_t* ptr = buffer_read_ptr(&(state->info_write_buff),&max);
+        ssize_t sent_count = send(key->fd,ptr,max,MSG_NOSIGNAL);
+        PROBE2(send, key->fd, sent_count);
+
+        if(sent_count == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                //El socket esta lleno, el selector nos avisa cuando se pueda escribir
+                return WRITING_RESPONSE;
+            }
+            log(LOG_ERROR, "Error writing in socket");
+            return FINISHED;
+        }
+        bytes_sent += sent_count;
+        budget_sent += sent_count;
+        response_sent(state,sent_count);
+        buffer_read_adv(&(state->info_write_buff),sent_count);
+        //Si ya no hay mas para escribir y el comando termino de generar la respuesta
+        if(!buffer_can_read(&(state->info_write_buff)) && state->finished){
+            state->finished = false;
+            command_done(state);
+            if(state->deliver != NULL){
+                //Terminamos de responder al PASS, falta mover los mails nuevos y leer el maildir
+                if(selector_set_interest(key->s,key->fd,OP_NOOP) != SELECTOR_SUCCESS){
+                    log(LOG_ERROR, "Error setting interest to OP_NOOP before delivering new emails");
+                    return FINISHED;
+                }
+                return DELIVERING_MAILS;
+            }
+            if(state->scanner != NULL){
+                //Terminamos de responder al PASS, falta leer el maildir antes del proximo comando
+                return LOADING_MAILDIR;
+            }
+            unsigned int next = next_request(key);
+            if(next != WRITING_RESPONSE){
+                return next;
+            }
+            //Habia otro comando en el buffer de entrada (pipelining), lo respondemos en esta misma llamada
+        }
+    }
+    //Cortamos antes de EAGAIN: sigue en la proxima iteracion, despues de las conexiones que estan listas
+    write_budget_yields++;
+    if(selector_schedule(key->s,key->fd) != SELECTOR_SUCCESS){
+        return FINISHED;
+    }
+    //Va a volver a donde esta, tiene que seguir escribiendo
+    return WRITING_RESPONSE;
+}
+
+/*
+ * Busca el proximo comando en el buffer de entrada luego de terminar de responder al anterior
+ * Si no hay un comando completo, vuelve a leer del socket
+ */
+unsigned int next_request(struct selector_key* key){
+    pop3* state = GET_POP3(key);
+    size_t  max = 0;
+    uint8_t* ptr = buffer_read_ptr(&(state->info_read_buff),&max);
     for(size_t i = 0; i<max; i++){
         parser_state parser = parser_feed(state->pop3_parser, ptr[i]);
         if(parser == PARSER_FINISHED || parser == PARSER_ERROR){
@@ -505,107 +963,208 @@ unsigned int read_request(struct selector_key* key){
             buffer_read_adv(&(state->info_read_buff),i+1);
             get_pop3_cmd(state->pop3_parser,state->cmd,MAX_CMD);
             pop3_command command = get_command(state->cmd);
-            logf(LOG_DEBUG,"Reading request for cmd: '%s'", command>=0 ? commands[command].name : "invalid command");
             state->command = command;
+            command_received(state);
             get_pop3_arg(state->pop3_parser,state->arg,MAX_ARG);
-            if(parser == PARSER_ERROR || command == ERROR_COMMAND){
-                log(LOG_ERROR, "Unknown command");
-                state->command = ERROR_COMMAND;
-            }
-            if(!commands[command].check(state->arg)){
-                log(LOG_ERROR, "Bad arguments");
+            if(parser == PARSER_ERROR || command == ERROR_COMMAND || !commands[command].check(state->arg)){
                 state->command = ERROR_COMMAND;
+                log(LOG_ERROR, "Unknown command");
             }
             if(!check_command_for_protocol_state(state->pop3_protocol_state, command)){
                 logf(LOG_ERROR,"Command '%s' not allowed in this state",commands[command].name);
                 state->command = ERROR_COMMAND;
             }
             parser_reset(state->pop3_parser);
-            //Vamos a procesar la respuesta
             if(selector_set_interest(key->s,key->fd,OP_WRITE) != SELECTOR_SUCCESS){
-                log(LOG_ERROR, "Error setting interest to OP_WRITE after reading request");
+                log(LOG_ERROR, "Error setting interest");
                 return FINISHED;
             }
             return WRITING_RESPONSE; //vamos a escribir la respuesta
         }
     }
-    //Avanzamos en el buffer, leimos lo que tenia
-    buffer_read_adv(&(state->info_read_buff), (ssize_t) max);
-    return READING_REQUEST; //vamos a seguir leyendo el request
+    buffer_read_adv(&(state->info_read_buff),(ssize_t ) max);
+    //No hay un comando completo, volvemos a leer
+    if(selector_set_interest(key->s,key->fd,OP_READ) != SELECTOR_SUCCESS){
+        log(LOG_ERROR, "Error setting interest");
+        return FINISHED;
+    }
+    return READING_REQUEST;
 }
-unsigned int write_response(struct selector_key* key){
-    pop3* state = GET_POP3(key);
-    //ejecutamos la funcion para generar la respuesta, que va a setear a state->finished como corresponda
-    command current_command = commands[state->command];
-    if(!state->finished) {
-        unsigned int ret_state = current_command.action(state); //ejecutamos la accion
-        //Si tengo que irme de este estado (para leer del archivo) me voy
-        if(ret_state == ERROR){ //me mantengo en escritura
-            return ERROR;
+
+/*
+ * Se llama al terminar de leer un comando, marca el inicio de su latencia
+ */
+static void command_received(pop3* state){
+    state->stats.commands++;
+    state->stats.command_start_us = timing_now_us();
+    state->stats.command_bytes = state->stats.bytes_sent;
+    state->stats.first_byte_sent = false;
+    PROBE2(command_parsed, state->connection_fd, state->command);
+}
+
+/*
+ * Se llama luego de cada send de una respuesta, con el primero se registra el ttfb del comando
+ */
+static void response_sent(pop3* state, ssize_t sent_count){
+    state->stats.bytes_sent += sent_count;
+    if(sent_count > 0 && !state->stats.first_byte_sent && state->stats.command_start_us != 0){
+        state->stats.first_byte_sent = true;
+        if(commands[state->command].metric){
+            histogram_record(&command_latencies[state->command].ttfb, timing_now_us() - state->stats.command_start_us);
         }
-        if(ret_state!=WRITING_RESPONSE){
-            //Dejo de suscribirme en donde estoy, tengo que ir a otro lado
-            if(selector_set_interest(key->s,key->fd,OP_NOOP) != SELECTOR_SUCCESS){
-                log(LOG_ERROR, "Error setting interest");
-                return FINISHED;
-            }
-            return ret_state;
+    }
+}
+
+/*
+ * Se llama al terminar de mandar la respuesta de un comando
+ * Con el access log activo, cada -A comandos se loggea la latencia del comando (desde que se leyo hasta que se mando la respuesta)
+ */
+static void command_done(pop3* state){
+    if(state->stats.command_start_us == 0){
+        return;
+    }
+    uint64_t latency = timing_now_us() - state->stats.command_start_us;
+    PROBE4(command_done, state->connection_fd, state->command, latency, state->stats.bytes_sent - state->stats.command_bytes);
+    if(commands[state->command].metric){
+        histogram_record(&command_latencies[state->command].total, latency);
+    }
+    unsigned long sample = state->pop3_args->access_sample;
+    if(state->pop3_args->access_log && sample != 0 && ++access_sample_counter % sample == 0){
+        logf(LOG_INFO, "[ACCESS] cmd=%s fd=%d latency_us=%lu bytes=%lu", commands[state->command].name, state->connection_fd,
+             (unsigned long) latency, state->stats.bytes_sent - state->stats.command_bytes);
+    }
+    state->stats.command_start_us = 0;
+}
+
+/*
+ * Registro del access log con el resumen de la sesion, se emite al liberar la conexion
+ */
+static void log_session(pop3* state){
+    const char* user = state->stats.authenticated && state->user_s != NULL ? state->user_s->name : "-";
+    logf(LOG_INFO, "[ACCESS] user=%s fd=%d duration_us=%lu commands=%lu bytes=%lu retr=%lu dele=%ld", user, state->connection_fd,
+         (unsigned long) (timing_now_us() - state->stats.start_us), state->stats.commands, state->stats.bytes_sent,
+         state->stats.retrs, state->stats.deleted);
+}
+
+/*
+ * Arma la tarea que mueve los mails de new/ a cur/
+ * Retorna NULL si no hay nada que mover (o si no hay memoria), y entonces se pasa directo a leer el maildir
+ */
+static struct deliver_task* deliver_task_create(pop3* state){
+    struct deliver_task* task = calloc(1,sizeof(struct deliver_task));
+    if(task == NULL){
+        log(LOG_ERROR,"Error reserving memory for deliver task, new emails will not be seen");
+        return NULL;
+    }
+    task->new_path = usersADT_get_user_mail_subdir(state->pop3_args->users,state->pop3_args->maildir_path,state->state_data.authorization.user,NEW_PATH);
+    task->cur_path = strdup(state->path_to_user_maildir);
+    if(task->new_path == NULL || task->cur_path == NULL){
+        log(LOG_ERROR,"Error reserving memory for deliver task, new emails will not be seen");
+        deliver_task_destroy(task);
+        return NULL;
+    }
+    //Casi siempre new/ esta vacio: lo miramos aca y solo pasamos por el worker si hay algo que mover
+    if(!maildir_has_new(task->new_path)){
+        deliver_task_destroy(task);
+        return NULL;
+    }
+    return task;
+}
+
+static void deliver_task_run(void* data){
+    //Corre en el worker: no puede tocar el estado de la conexion ni el selector
+    struct deliver_task* task = data;
+    task->moved = deliver_new_maildir(task->new_path,task->cur_path);
+}
+
+static void deliver_task_destroy(void* data){
+    struct deliver_task* task = data;
+    free(task->new_path);
+    free(task->cur_path);
+    free(task);
+}
+
+void deliver_start(const unsigned state, struct selector_key *key){
+    pop3* data = GET_POP3(key);
+    data->job = worker_submit(key->s,data->connection_fd,deliver_task_run,deliver_task_destroy,data->deliver);
+    if(data->job == NULL){
+        //La cola de los workers esta llena: no movemos nada (quedan en new/ para el proximo login) y seguimos
+        logf(LOG_ERROR,"Error submitting deliver task, new emails of user '%s' will not be seen",data->user_s->name);
+        if(selector_set_interest(key->s,data->connection_fd,OP_WRITE) != SELECTOR_SUCCESS){
+            log(LOG_ERROR,"Error setting interest to OP_WRITE after delivering new emails");
         }
     }
-    //Escribimos lo que tenemos en el buffer de salida al socket
-    size_t  max = 0;
-    uint8_t* ptr = buffer_read_ptr(&(state->info_write_buff),&max);
-    ssize_t sent_count = send(key->fd,ptr,max,MSG_NOSIGNAL);
-    bytes_sent += sent_count;
+}
 
-    if(sent_count == -1){
-        log(LOG_ERROR, "Error writing in socket");
+unsigned int deliver_done(struct selector_key* key){
+    pop3* state = GET_POP3(key);
+    struct deliver_task* task = state->deliver;
+    //Tomamos los resultados antes de soltar el trabajo (puede liberar la tarea)
+    if(task->moved < 0){
+        logf(LOG_ERROR,"Error moving new emails of user '%s' to cur",state->user_s->name);
+    }else if(task->moved > 0){
+        logf(LOG_DEBUG,"Moved %ld new emails of user '%s' to cur",task->moved,state->user_s->name);
+        delivered_emails += task->moved;
+    }
+    state->deliver = NULL;
+    if(state->job != NULL){
+        worker_release(state->job);
+        state->job = NULL;
+    }else{
+        deliver_task_destroy(task);
+    }
+    //Seguimos leyendo el maildir en las proximas iteraciones del selector
+    if(selector_set_interest(key->s,state->connection_fd,OP_WRITE) != SELECTOR_SUCCESS){
         return FINISHED;
     }
-    buffer_read_adv(&(state->info_write_buff),sent_count);
-    //Si ya no hay mas para escribir y el comando termino de generar la respuesta
-    if(!buffer_can_read(&(state->info_write_buff)) && state->finished){
-        state->finished = false;
-        //Terminamos de mandar la respuesta para el comando, vemos si nos queda otro
-        size_t  max = 0;
-        uint8_t* ptr = buffer_read_ptr(&(state->info_read_buff),&max);
-        for(size_t i = 0; i<max; i++){
-            parser_state parser = parser_feed(state->pop3_parser, ptr[i]);
-            if(parser == PARSER_FINISHED || parser == PARSER_ERROR){
-                //avanzamos solo hasta el fin del comando
-                buffer_read_adv(&(state->info_read_buff),i+1);
-                get_pop3_cmd(state->pop3_parser,state->cmd,MAX_CMD);
-                pop3_command command = get_command(state->cmd);
-                state->command = command;
-                get_pop3_arg(state->pop3_parser,state->arg,MAX_ARG);
-                if(parser == PARSER_ERROR || command == ERROR_COMMAND || !commands[command].check(state->arg)){
-                    state->command = ERROR_COMMAND;
-                    log(LOG_ERROR, "Unknown command");
-                }
-                if(!check_command_for_protocol_state(state->pop3_protocol_state, command)){
-                    logf(LOG_ERROR,"Command '%s' not allowed in this state",commands[command].name);
-                    state->command = ERROR_COMMAND;
-                }
-                parser_reset(state->pop3_parser);
-                return WRITING_RESPONSE; //vamos a escribir la respuesta
+    return LOADING_MAILDIR;
+}
+
+void load_maildir_start(const unsigned state, struct selector_key *key){
+    GET_POP3(key)->stats.scan_start_us = timing_now_us();
+    //El socket ya estaba listo para escribir: con -E no vuelve a avisar si no se lo pedimos
+    selector_schedule(key->s,GET_POP3(key)->connection_fd);
+}
+
+/*
+ * Lee una parte del maildir del usuario. Se mantiene suscripto a escritura en el socket para que
+ * el selector lo vuelva a llamar en la proxima iteracion, luego de atender al resto de las conexiones
+ */
+unsigned int load_maildir(struct selector_key* key){
+    pop3* state = GET_POP3(key);
+    switch (maildir_scan_step(state->scanner, MAILDIR_SCAN_CHUNK)) {
+        case MAILDIR_SCAN_PENDING:
+            if(selector_schedule(key->s,key->fd) != SELECTOR_SUCCESS){
+                return FINISHED;
             }
-        }
-        buffer_read_adv(&(state->info_read_buff),(ssize_t ) max);
-        //No hay un comando completo, volvemos a leer
-        if(selector_set_interest(key->s,key->fd,OP_READ) != SELECTOR_SUCCESS){
-            log(LOG_ERROR, "Error setting interest");
-            return FINISHED;
-        }
-        return READING_REQUEST;
+            return LOADING_MAILDIR;
+        case MAILDIR_SCAN_ERROR:
+            maildir_scan_close(state->scanner);
+            state->scanner = NULL;
+            state->final_error_message = NO_MAILDIR_MESSAGE;
+            return ERROR;
+        default:
+            break;
     }
-    //Va a volver a donde esta, tiene que seguir escribiendo
-    return WRITING_RESPONSE;
+    maildir_stats_avoided += maildir_scan_hinted(state->scanner);
+    state->emails = maildir_scan_finish(state->scanner, &(state->emails_count));
+    maildir_scans++;
+    maildir_entries += state->emails_count;
+    histogram_record(&maildir_scan_latency, timing_now_us() - state->stats.scan_start_us);
+    state->scanner = NULL;
+    logf(LOG_DEBUG, "Loaded %zu emails of user '%s'", state->emails_count, state->user_s->name);
+    unsigned int next = next_request(key);
+    //Si habia un comando esperando, el interes sigue en escritura: con -E hay que pedir que avise igual
+    if(next == WRITING_RESPONSE && selector_schedule(key->s,key->fd) != SELECTOR_SUCCESS){
+        return FINISHED;
+    }
+    return next;
 }
 
 void finish_connection(const unsigned state, struct selector_key *key){
     pop3 * data = GET_POP3(key);
     if(data->pop3_protocol_state == TRANSACTION){
-        logf(LOG_INFO, "Finishing connection of user '%s'", data->user_s->name);
+        logf(LOG_DEBUG, "Finishing connection of user '%s'", data->user_s->name);
         //Liberamos la casilla del usuario
         data->user_s->logged=false;
     }
@@ -689,6 +1248,11 @@ try_state try_write(const char* str, buffer* buff){
     return TRY_DONE;
 }
 
+void error_start(const unsigned state, struct selector_key *key){
+    //Se llega desde estados que ya escribian (o que recien piden escritura), con -E hay que pedir que avise igual
+    selector_schedule(key->s,GET_POP3(key)->connection_fd);
+}
+
 unsigned finish_error(struct  selector_key* key){
     //Si llego aca tengo que estar en escritura
     pop3* state = GET_POP3(key);
@@ -706,14 +1270,24 @@ unsigned finish_error(struct  selector_key* key){
     size_t  max = 0;
     uint8_t* ptr = buffer_read_ptr(&(state->info_write_buff),&max);
     ssize_t sent_count = send(key->fd,ptr,max,MSG_NOSIGNAL);
-    bytes_sent += sent_count;
+    PROBE2(send, key->fd, sent_count);
 
     if(sent_count == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return ERROR; //el selector avisa cuando se pueda escribir
+        }
         return FINISHED; //para que vaya a .on_departure, nunca deberia llegar a hello
     }
+    bytes_sent += sent_count;
+    response_sent(state,sent_count);
     buffer_read_adv(&(state->info_write_buff),sent_count);
     //Si ya no hay mas para escribir y el comando termino de generar la respuesta
     if(!buffer_can_read(&(state->info_write_buff))){
+        //Si el error es la respuesta a un comando (como QUIT), termina aca
+        command_done(state);
+        return FINISHED;
+    }
+    if(selector_schedule(key->s,key->fd) != SELECTOR_SUCCESS){
         return FINISHED;
     }
     return ERROR;//vuelvo a intentar
@@ -724,13 +1298,11 @@ unsigned finish_error(struct  selector_key* key){
  */
 int user_action(pop3* state){
     char * msj = USER_INVALID_MESSAGE;
-    for(unsigned int i=0; i<state->pop3_args->users->users_count; i++){
-        if(strcmp(state->arg, state->pop3_args->users->users_array[i].name) == 0){
-            state->state_data.authorization.user = state->pop3_args->users->users_array[i].name;
-            state->state_data.authorization.pass = state->pop3_args->users->users_array[i].pass;
-            state->user_s = state->pop3_args->users->users_array + i;
-            msj = USER_VALID_MESSAGE;
-        }
+    user_t * user = usersADT_get_user(state->pop3_args->users, state->arg);
+    if(user != NULL){
+        state->state_data.authorization.user = user->name;
+        state->user_s = user;
+        msj = USER_VALID_MESSAGE;
     }
     if(try_write(msj,&(state->info_write_buff)) == TRY_PENDING){
         //No deberia pasar nunca, si llego aca es porque el buffer de salida esta vacio
@@ -742,23 +1314,26 @@ int user_action(pop3* state){
 
 int pass_action(pop3* state){
     char * msj = PASS_INVALID_MESSAGE;
-    if(state->state_data.authorization.pass != NULL && strcmp(state->arg, state->state_data.authorization.pass) == 0){
+    //La contraseña se toma recien ahora, porque se puede cambiar desde el admin
+    if(state->user_s != NULL && strcmp(state->arg, state->user_s->pass) == 0){
         if(state->user_s->logged){
             logf(LOG_INFO,"User '%s' already logged", state->state_data.authorization.user)
             msj = USER_LOGGED;
         }else{
             logf(LOG_INFO,"User '%s' logged in", state->state_data.authorization.user)
             msj = PASS_VALID_MESSAGE;
+            state->stats.authenticated = true;
             state->user_s->logged = true;
             state->pop3_protocol_state = TRANSACTION;
             state->path_to_user_maildir = usersADT_get_user_mail_path(state->pop3_args->users,state->pop3_args->maildir_path, state->state_data.authorization.user);
-            size_t mails_max = state->pop3_args->max_mails;
-            state->emails = read_maildir(state->path_to_user_maildir,&mails_max);
-            if(state->emails == NULL){
+            //Solo abrimos el maildir, se lee de a partes luego de responder (ver LOADING_MAILDIR)
+            state->scanner = maildir_scan_open(state->path_to_user_maildir,state->pop3_args->max_mails,state->pop3_args->size_hints);
+            if(state->scanner == NULL){
                 state->final_error_message = NO_MAILDIR_MESSAGE;
                 return ERROR;
             }
-            state->emails_count = mails_max;
+            //Antes de leerlo, si hay mails en new/ los mueve un worker (ver DELIVERING_MAILS)
+            state->deliver = deliver_task_create(state);
             reset_structures(state);
         }
     }
@@ -884,26 +1459,6 @@ int list_action(pop3* state){
     return WRITING_RESPONSE;
 }
 
-typedef enum{
-    BYTE_STUFFING_CR,
-    BYTE_STUFFING_LF,
-    BYTE_STUFFING_DOT,
-    BYTE_STUFFING_NOTHING
-}byte_stuffing_state;
-
-byte_stuffing_state get_flag(byte_stuffing_state curr_flag, char curr_char){
-    switch (curr_char) {
-        case '\r':
-            return BYTE_STUFFING_CR;
-        case '\n':
-            return curr_flag==BYTE_STUFFING_CR?BYTE_STUFFING_LF:BYTE_STUFFING_NOTHING;
-        case '.':
-            return curr_flag==BYTE_STUFFING_LF?BYTE_STUFFING_DOT:BYTE_STUFFING_NOTHING;
-        default:
-            return BYTE_STUFFING_NOTHING;
-    }
-}
-
 int retr_action(pop3* state){
     if(!state->state_data.transaction.arg_processed && strlen(state->arg) != 0){
         state->state_data.transaction.has_arg = true;
@@ -970,17 +1525,10 @@ int retr_action(pop3* state){
         uint8_t *write_ptr = buffer_write_ptr(&(state->info_write_buff), &write_max);
         size_t file_max = 0;
         uint8_t *file_ptr = buffer_read_ptr(&(state->info_file_buff), &file_max);
-        //siempre me quedo con al menos 2 espacios en el de write por si tengo que hacer byte stuffing
-        size_t write = 0, file = 0;
-        for (; file < file_max && write < write_max - 1; write++, file++) {
-            state->state_data.transaction.flag = get_flag(state->state_data.transaction.flag,(char) file_ptr[file]);
-            if(state->state_data.transaction.flag == BYTE_STUFFING_DOT) { //para ver si mejora la velocidad
-                //tengo que hacer byte stuffing, vi un punto al inicio de una linea nueva
-                logf(LOG_DEBUG, "Doing byte stuffing in file %ld and position %ld ", state->state_data.transaction.arg,file);
-                write_ptr[write++] = '.'; //agrego un punto al principio
-            }
-            write_ptr[write] = file_ptr[file];
-        }
+        size_t file = 0;
+        byte_stuffing_state flag = state->state_data.transaction.flag;
+        size_t write = byte_stuffing_copy(write_ptr, write_max, file_ptr, file_max, &file, &flag);
+        state->state_data.transaction.flag = flag;
         //No avanzar el maximo, por si se queda un caracter en el buffer del archivo que no se procesa por no tener 2 espacios en el de salida
         buffer_write_adv(&(state->info_write_buff), (ssize_t)write);
         buffer_read_adv(&(state->info_file_buff), (ssize_t)file);
@@ -1002,6 +1550,7 @@ int retr_action(pop3* state){
 //        }
         parser_reset(state->byte_stuffing_parser);
         reset_structures(state);
+        state->stats.retrs++;
         state->finished = true;
     }
 
@@ -1031,6 +1580,7 @@ void process_open_file(const unsigned state, struct selector_key *key){
         close(dir_fd);//cerramos el directorio, ya no nos sirve
         data->state_data.transaction.file_fd = file_fd; //lo guardamos para ir y volver
         data->state_data.transaction.file_opened = true;
+        PROBE3(retr_open, data->connection_fd, data->state_data.transaction.arg, file_fd);
         selector_register(key->s,file_fd,&handler,OP_READ,data);
         (data->references)++; //importante para no liberar si se usa
         return;
@@ -1039,39 +1589,50 @@ void process_open_file(const unsigned state, struct selector_key *key){
     selector_set_interest(key->s,data->state_data.transaction.file_fd,OP_READ);
 }
 
-unsigned int process_response(struct  selector_key* key){
-    pop3* state = GET_POP3(key);
-    if(!state->state_data.transaction.file_opened){
-        log(LOG_ERROR, "Error opening file");
-        return FINISHED;//cerramos la conexion, no pudimos abrir el archivo
-    }
-    //Leer del archivo y mandarlo a el buffer intermedio
+/*
+ * Lee una parte del archivo del RETR al buffer intermedio. Al terminar lo saca del selector (y lo cierra)
+ * Es un archivo regular, asi que se puede leer directamente desde write_response sin pasar por el selector
+ */
+static bool read_file(fd_selector s, pop3* state){
     size_t max = 0;
     uint8_t* ptr = buffer_write_ptr(&(state->info_file_buff), &max);
-    //Estoy leyendo del archivo, y me deberian llamar aca con key en el archivo
-    ssize_t read_count = read(key->fd, ptr, max);
+    int file_fd = state->state_data.transaction.file_fd;
+    ssize_t read_count = read(file_fd, ptr, max);
+    PROBE3(file_read, state->connection_fd, file_fd, read_count);
+    if(read_count<0){
+        log(LOG_ERROR, "Error reading file");
+        return false;
+    }
     if(read_count==0){
         log(LOG_DEBUG, "Finished reading file");
         //terminamos de leer el archivo, lo señalo para no volver aca
         state->state_data.transaction.file_ended = true;
-    }
-    if(read_count<0){
-        log(LOG_ERROR, "Error reading file");
-        return FINISHED;
+        //Es la ultima vez que voy a venir al archivo, lo cerramos
+        if(selector_unregister_fd(s,file_fd)!= SELECTOR_SUCCESS){
+            log(LOG_ERROR, "Error unregistering file fd");
+            return false;
+        }
     }
     //Avanzamos la escritura en el buffer
     buffer_write_adv(&(state->info_file_buff), read_count);
+    return true;
+}
+
+unsigned int process_response(struct  selector_key* key){
+    pop3* state = GET_POP3(key);
+    if(!state->state_data.transaction.file_opened){
+        log(LOG_ERROR, "Error opening file");
+        return FINISHED;//cerramos la conexion, no pudimos abrir el archivo
+    }
+    //Estoy leyendo del archivo, y me deberian llamar aca con key en el archivo
     if(selector_set_interest(key->s,state->connection_fd, OP_WRITE) != SELECTOR_SUCCESS
         || selector_set_interest(key->s,state->state_data.transaction.file_fd,OP_NOOP)!= SELECTOR_SUCCESS){
         log(LOG_ERROR, "Error setting interest");
         return FINISHED;
     }
-    if(state->state_data.transaction.file_ended == true){
-        //Es la ultima vez que voy a venir al archivo, lo cerramos
-        if(selector_unregister_fd(key->s,state->state_data.transaction.file_fd)!= SELECTOR_SUCCESS){
-            log(LOG_ERROR, "Error unregistering file fd");
-            return FINISHED;
-        }
+    //Leer del archivo y mandarlo a el buffer intermedio
+    if(!read_file(key->s, state)){
+        return FINISHED;
     }
     //aprovecho que es la misma maquina de estados
     return WRITING_RESPONSE;
@@ -1081,7 +1642,7 @@ int dele_action(pop3* state){
     char * msj_ret = ERROR_MESSSAGE;
     long index = strtol(state->arg, NULL,10);
     if( errno!= EINVAL && errno != ERANGE && index <= (long)state->emails_count &&  index>0 &&  !state->emails[index-1].deleted){
-        logf(LOG_INFO, "Marking to delete email with index %ld", index);
+        logf(LOG_DEBUG, "Marking to delete email with index %ld", index);
         state->emails[index-1].deleted = true;
         msj_ret = OK_MESSSAGE;
     }
@@ -1095,7 +1656,7 @@ int dele_action(pop3* state){
 int rset_action(pop3* state){
     //computamos el total de size
     for(size_t i=0; i<state->emails_count ; i++){
-        logf(LOG_INFO,"Unmarking to delete file %lu",i+1);
+        logf(LOG_DEBUG,"Unmarking to delete file %lu",i+1);
         state->emails[i].deleted = false;
     }
     if(try_write(OK_MESSSAGE, &(state->info_write_buff)) == TRY_PENDING){
@@ -1116,29 +1677,100 @@ int noop_action(pop3* state){
 int quit_action(pop3* state){
     state->final_error_message = QUIT_MESSAGE;
     if(state->pop3_protocol_state == AUTHORIZATION){
-        logf(LOG_INFO, "Quitting in Authorization state for fd %d", state->connection_fd);
+        logf(LOG_DEBUG, "Quitting in Authorization state for fd %d", state->connection_fd);
         return ERROR;//cierro la conexion
     }
-    logf(LOG_INFO, "Finishing connection of user '%s'", state->user_s->name);
-    state->user_s->logged=false;
+    logf(LOG_DEBUG, "Finishing connection of user '%s'", state->user_s->name);
     //Estamos en transaction, tengo que eliminar todos los archivos que marcaron para eliminar
-    int dir_fd = open(state->path_to_user_maildir,O_DIRECTORY);
-    if(dir_fd == -1){
-        log(LOG_ERROR,"Error opening mail directory to delete mails");
-        return FINISHED;
+    bool has_deleted = false;
+    for(size_t i = 0; i<state->emails_count && !has_deleted; i++){
+        has_deleted = state->emails[i].deleted;
     }
-    for(size_t i = 0; i<state->emails_count; i++){
-        if(state->emails[i].deleted){
-            logf(LOG_INFO, "Deleting email %zu",i+1);
-            //elimnamos el archivo (cuando ningun proceso lo tenga abierto, lo va a sacar)
-            unlinkat(dir_fd,state->emails[i].name,0);
+    if(has_deleted){
+        struct expunge_task* task = calloc(1,sizeof(struct expunge_task));
+        if(task != NULL){
+            //la conexion ya no necesita los mails, se los pasamos a la tarea
+            task->path = state->path_to_user_maildir;
+            task->emails = state->emails;
+            task->emails_count = state->emails_count;
+            state->path_to_user_maildir = NULL;
+            state->emails = NULL;
+            state->emails_count = 0;
+            state->expunge = task;
+            //lo hacemos en un worker, y al terminar mandamos el mensaje de QUIT
+            return EXPUNGING;
         }
+        log(LOG_ERROR,"Error reserving memory for expunge task, deleted emails were not removed");
+        state->final_error_message = EXPUNGE_REJECTED_MESSAGE;
     }
+    state->user_s->logged=false;
     state->pop3_protocol_state = AUTHORIZATION;
-    close(dir_fd);
     return ERROR;
 }
 
+static void expunge_task_run(void* data){
+    //Corre en el worker: no puede tocar el estado de la conexion ni el selector
+    struct expunge_task* task = data;
+    uint64_t start = timing_now_us();
+    task->deleted = expunge_maildir(task->path,task->emails,task->emails_count);
+    task->elapsed_us = timing_now_us() - start;
+}
+
+static void expunge_task_destroy(void* data){
+    struct expunge_task* task = data;
+    free_emails(task->emails,task->emails_count);
+    free(task->path);
+    free(task);
+}
+
+void expunge_start(const unsigned state, struct selector_key *key){
+    pop3* data = GET_POP3(key);
+    logf(LOG_DEBUG,"Expunging emails of user '%s' in worker",data->user_s->name);
+    data->job = worker_submit(key->s,data->connection_fd,expunge_task_run,expunge_task_destroy,data->expunge);
+    if(data->job == NULL){
+        //La cola de los workers esta llena: no borramos nada y se lo decimos al cliente, que puede volver a intentar
+        logf(LOG_ERROR,"Error submitting expunge task, deleted emails of user '%s' were not removed",data->user_s->name);
+        data->expunge->rejected = true;
+        if(selector_set_interest(key->s,data->connection_fd,OP_WRITE) != SELECTOR_SUCCESS){
+            log(LOG_ERROR,"Error setting interest to OP_WRITE after rejecting expunge task");
+        }
+    }
+}
+
+unsigned int expunge_done(struct selector_key* key){
+    pop3* state = GET_POP3(key);
+    struct expunge_task* task = state->expunge;
+    //Tomamos los resultados antes de soltar el trabajo (puede liberar la tarea)
+    if(task->rejected){
+        state->final_error_message = EXPUNGE_REJECTED_MESSAGE;
+    }else if(task->deleted < 0){
+        log(LOG_ERROR,"Error opening mail directory to delete mails");
+    }else{
+        logf(LOG_DEBUG,"Deleted %ld emails of user '%s' in %lu us",task->deleted,state->user_s->name,(unsigned long) task->elapsed_us);
+        state->stats.deleted = task->deleted;
+        expunge_count++;
+        expunged_emails += task->deleted;
+        expunge_total_us += task->elapsed_us;
+        if(task->elapsed_us > expunge_max_us){
+            expunge_max_us = task->elapsed_us;
+        }
+    }
+    state->expunge = NULL;
+    if(state->job != NULL){
+        worker_release(state->job);
+        state->job = NULL;
+    }else{
+        expunge_task_destroy(task);
+    }
+    //Liberamos la casilla recien ahora, para que no se vean los mails que se estaban borrando
+    state->user_s->logged=false;
+    state->pop3_protocol_state = AUTHORIZATION;
+    if(selector_set_interest(key->s,state->connection_fd,OP_WRITE) != SELECTOR_SUCCESS){
+        return FINISHED;
+    }
+    return ERROR; //escribe el mensaje de QUIT y cierra la conexion
+}
+
 int capa_action(pop3* state){
     if(try_write(CAPA_MESSAGE, &(state->info_write_buff)) == TRY_PENDING){
         log(LOG_ERROR,"Writing to exit buffer was not possible when it should be empty")
@@ -1147,3 +1779,74 @@ int capa_action(pop3* state){
     state->finished = true;
     return WRITING_RESPONSE;
 }
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Metricas de latencia (ver STAT_LATENCY en admin.c)
+ * --------------------------------------------------------------------------------------
+ */
+static int latency_line(char* buff, size_t size, const char* name, const struct histogram* ttfb, const struct histogram* total){
+    if(ttfb != NULL){
+        return snprintf(buff,size,"%s n=%lu ttfb=%lu/%lu/%lu total=%lu/%lu/%lu max=%lu\n",name,(unsigned long) total->count,
+                        (unsigned long) histogram_percentile(ttfb,50),(unsigned long) histogram_percentile(ttfb,90),(unsigned long) histogram_percentile(ttfb,99),
+                        (unsigned long) histogram_percentile(total,50),(unsigned long) histogram_percentile(total,90),(unsigned long) histogram_percentile(total,99),
+                        (unsigned long) total->max);
+    }
+    return snprintf(buff,size,"%s n=%lu total=%lu/%lu/%lu max=%lu\n",name,(unsigned long) total->count,
+                    (unsigned long) histogram_percentile(total,50),(unsigned long) histogram_percentile(total,90),(unsigned long) histogram_percentile(total,99),
+                    (unsigned long) total->max);
+}
+
+void pop3_latency_foreach(pop3_latency_visitor visitor, void* data){
+    for(pop3_command command = USER; command < ERROR_COMMAND; command++){
+        if(commands[command].metric){
+            visitor(commands[command].name,&command_latencies[command].ttfb,&command_latencies[command].total,data);
+        }
+    }
+}
+
+void pop3_state_profile_foreach(pop3_state_profile_visitor visitor, void* data){
+    for(pop3_state state = HELLO; state <= ERROR; state++){
+        if(state_profile[state].calls != 0){
+            visitor(state_names[state],&state_profile[state],data);
+        }
+    }
+}
+
+const struct histogram* pop3_maildir_scan_latency(void){
+    return &maildir_scan_latency;
+}
+
+void pop3_accept_errors_foreach(pop3_accept_error_visitor visitor, void* data){
+    for(size_t i = 0; i < sizeof(accept_errors) / sizeof(accept_errors[0]); i++){
+        visitor(accept_errors[i].name,accept_errors[i].count,data);
+    }
+}
+
+int pop3_latency_report(char* buff, size_t size){
+    size_t written = 0;
+    int ret = snprintf(buff,size,"p50/p90/p99 us\n");
+    if(ret < 0){
+        return -1;
+    }
+    written += ret;
+    for(pop3_command command = USER; command < ERROR_COMMAND && written < size; command++){
+        //los comandos que no se usaron no se informan, para que entre en un datagrama
+        if(!commands[command].metric || command_latencies[command].total.count == 0){
+            continue;
+        }
+        ret = latency_line(buff + written,size - written,commands[command].name,&command_latencies[command].ttfb,&command_latencies[command].total);
+        if(ret < 0){
+            return -1;
+        }
+        written += ret;
+    }
+    if(written < size){
+        ret = latency_line(buff + written,size - written,"SCAN",NULL,&maildir_scan_latency);
+        if(ret < 0){
+            return -1;
+        }
+        written += ret;
+    }
+    return (int) written;
+}
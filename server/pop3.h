@@ -1,10 +1,15 @@
 #ifndef __POP3_H__
 #define __POP3_H__
 
+#include <stddef.h>
+#include "histogram.h"
+#include "profile.h"
+
 typedef struct pop3 pop3;
 
 #define GET_POP3(key) ((pop3*) (key)->data)
 #define BUFFER_SIZE 4096
+#define POP3_CONNECTION_BUFFERS 3 //lectura, escritura y archivo, cada uno de BUFFER_SIZE
 
 
 //Funciones llamadas por selector
@@ -12,5 +17,35 @@ void pop3_read(struct selector_key* key);
 void pop3_write(struct selector_key* key);
 void pop3_passive_accept(struct selector_key* key);
 void pop3_close(struct selector_key* key);
+void pop3_block(struct selector_key* key);
+
+/*
+ * Escribe en buff (de tamaño size) los percentiles de latencia de cada comando y de la lectura del maildir,
+ * una linea por cada uno. Retorna lo que se queria escribir (como snprintf), o -1 si hubo un error
+ */
+int pop3_latency_report(char* buff, size_t size);
+
+/*
+ * Llama a visitor con las latencias de cada comando que las guarda (aunque no se haya usado)
+ */
+typedef void (*pop3_latency_visitor)(const char* command, const struct histogram* ttfb, const struct histogram* total, void* data);
+void pop3_latency_foreach(pop3_latency_visitor visitor, void* data);
+
+/*
+ * Con -P, llama a visitor con el tiempo acumulado en los handlers de cada estado de las conexiones (los que se usaron)
+ */
+typedef void (*pop3_state_profile_visitor)(const char* state, const struct profile_counter* counter, void* data);
+void pop3_state_profile_foreach(pop3_state_profile_visitor visitor, void* data);
+
+/*
+ * Latencia de la lectura del maildir al hacer PASS
+ */
+const struct histogram* pop3_maildir_scan_latency(void);
+
+/*
+ * Llama a visitor con la cantidad de fallos de accept de cada errno que se cuenta por separado (y "other" con el resto)
+ */
+typedef void (*pop3_accept_error_visitor)(const char* error, unsigned long count, void* data);
+void pop3_accept_errors_foreach(pop3_accept_error_visitor visitor, void* data);
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef PROBES_H_Jm3VxQ8rTz5KcW2nLp7YdB4sH
+#define PROBES_H_Jm3VxQ8rTz5KcW2nLp7YdB4sH
+
+/*
+ * Puntos de traza estaticos (USDT) del proveedor popserver, para perf o bpftrace sobre el binario de produccion
+ * sin recompilar con logs de DEBUG. Desactivados cuestan un nop; se listan con
+ *   bpftrace -l 'usdt:./bin/popserver:*'
+ * y por ejemplo la latencia de cada comando (en us) con
+ *   bpftrace -e 'usdt:./bin/popserver:popserver:command_done { @[arg1] = hist(arg2); }'
+ *
+ * Necesitan sys/sdt.h (paquete systemtap-sdt-dev); si no esta o se compila con -DDISABLE_PROBES no hacen nada
+ *
+ *   session_accept(fd)
+ *   command_parsed(fd, command)
+ *   command_done(fd, command, latency_us, bytes)
+ *   retr_open(fd, message, file_fd)
+ *   file_read(fd, file_fd, bytes)               bytes es lo que retorno read (0 al final, -1 si fallo)
+ *   send(fd, bytes)                             bytes es lo que retorno send
+ *   session_close(fd, duration_us, commands, bytes)
+ *
+ * command es el indice en la tabla de comandos de pop3.c (USER, PASS, STAT, LIST, RETR, DELE, NOOP, RSET, QUIT, ...)
+ */
+#if !defined(DISABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE1(name, a)             STAP_PROBE1(popserver, name, a)
+#define PROBE2(name, a, b)          STAP_PROBE2(popserver, name, a, b)
+#define PROBE3(name, a, b, c)       STAP_PROBE3(popserver, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    STAP_PROBE4(popserver, name, a, b, c, d)
+#else
+// Los argumentos no se evaluan, pero se usan para que no queden variables sin usar
+#define PROBE1(name, a)             do { (void) sizeof(a); } while(0)
+#define PROBE2(name, a, b)          do { (void) sizeof(a); (void) sizeof(b); } while(0)
+#define PROBE3(name, a, b, c)       do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while(0)
+#define PROBE4(name, a, b, c, d)    do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); (void) sizeof(d); } while(0)
+#endif
+
+#endif
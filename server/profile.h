@@ -0,0 +1,25 @@
+#ifndef PROFILE_H_Qv6NzK2wRm8TxJ4bLc9HdY3pS
+#define PROFILE_H_Qv6NzK2wRm8TxJ4bLc9HdY3pS
+
+#include <stdint.h>
+
+/*
+ * Tiempo acumulado de algo que se ejecuta muchas veces (un handler del selector, un estado de la stm),
+ * para el self-profiling del loop que se activa con -P
+ */
+struct profile_counter {
+    unsigned long calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+static inline void
+profile_add(struct profile_counter *counter, uint64_t ns) {
+    counter->calls++;
+    counter->total_ns += ns;
+    if(ns > counter->max_ns) {
+        counter->max_ns = ns;
+    }
+}
+
+#endif
@@ -15,10 +15,22 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/signal.h>
+#include <sys/epoll.h>
 #include "selector.h"
+#include "timing.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
+/** cantidad de fd_handler distintos que se miden, el resto se suma en el último */
+#define PROFILE_HANDLERS 16
+#define PROFILE_OTHER_NAME "other"
+#define PROFILE_UNNAMED "unnamed"
+
+/** eventos que se piden a epoll_pwait por iteración */
+#define EPOLL_EVENTS 256
+#define MS_PER_SECOND 1000
+#define NS_PER_MS 1000000
+
 #define ERROR_DEFAULT_MSG "something failed"
 
 /** retorna una descripción humana del fallo */
@@ -106,6 +118,10 @@ struct item {
    fd_interest         interest;
    const fd_handler   *handler;
    void *              data;
+   /** con epoll: es un archivo regular, no está en epoll y está siempre listo */
+   bool                plain;
+   /** está en la cola de selector_schedule */
+   bool                scheduled;
 };
 
 /* tarea bloqueante */
@@ -157,6 +173,22 @@ struct fdselector {
      * notificados.
      */
     struct blocking_job    *resolution_jobs;
+
+    /** con el backend epoll (conf.epoll), -1 si no */
+    int                     epoll_fd;
+    struct epoll_event     *events;
+    /** fds de items plain, para despacharlos en cada iteración */
+    int                    *plain_fds;
+    size_t                  plain_count;
+    size_t                  plain_size;
+
+    /**
+     * fds con trabajo pendiente (selector_schedule), se despachan al final
+     * de la próxima iteración. -1 si se desregistró mientras esperaba.
+     */
+    int                    *run_fds;
+    size_t                  run_count;
+    size_t                  run_size;
 };
 
 /** cantidad máxima de file descriptors que la plataforma puede manejar */
@@ -295,10 +327,18 @@ selector_new(const size_t initial_elements) {
         ret->master_t.tv_nsec = conf.select_timeout.tv_nsec;
         assert(ret->max_fd == 0);
         ret->resolution_jobs  = 0;
+        ret->epoll_fd         = -1;
         pthread_mutex_init(&ret->resolution_mutex, 0);
         if(0 != ensure_capacity(ret, initial_elements)) {
             selector_destroy(ret);
             ret = NULL;
+        } else if(conf.epoll) {
+            ret->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            ret->events   = calloc(EPOLL_EVENTS, sizeof(*ret->events));
+            if(ret->epoll_fd == -1 || ret->events == NULL) {
+                selector_destroy(ret);
+                ret = NULL;
+            }
         }
     }
     return ret;
@@ -325,12 +365,74 @@ selector_destroy(fd_selector s) {
             s->fds     = NULL;
             s->fd_size = 0;
         }
+        if(s->epoll_fd != -1) {
+            close(s->epoll_fd);
+        }
+        free(s->events);
+        free(s->plain_fds);
+        free(s->run_fds);
         free(s);
     }
 }
 
 #define INVALID_FD(fd)  ((fd) < 0 || (fd) >= ITEMS_MAX_SIZE)
 
+// backend epoll ///////////////////////////////////////////////////////////////
+
+static selector_status
+epoll_ctl_item(fd_selector s, const struct item *item, const int op) {
+    struct epoll_event ev = {
+        .events  = 0,
+        .data.fd = item->fd,
+    };
+    if(item->interest & OP_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if(item->interest & OP_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+    if(item->handler->edge_triggered) {
+        ev.events |= EPOLLET;
+    }
+    return -1 == epoll_ctl(s->epoll_fd, op, item->fd, &ev) ? SELECTOR_IO : SELECTOR_SUCCESS;
+}
+
+/** agrega un fd a una lista que crece según haga falta */
+static selector_status
+fd_list_append(int **fds, size_t *count, size_t *size, const int fd) {
+    if(*count == *size) {
+        const size_t new_size = *size == 0 ? 8 : *size * 2;
+        int *tmp = realloc(*fds, new_size * sizeof(*tmp));
+        if(NULL == tmp) {
+            return SELECTOR_ENOMEM;
+        }
+        *fds  = tmp;
+        *size = new_size;
+    }
+    (*fds)[(*count)++] = fd;
+    return SELECTOR_SUCCESS;
+}
+
+/** epoll no acepta archivos regulares: quedan en una lista y se despachan siempre */
+static selector_status
+plain_add(fd_selector s, struct item *item) {
+    const selector_status ret = fd_list_append(&s->plain_fds, &s->plain_count, &s->plain_size, item->fd);
+    if(SELECTOR_SUCCESS == ret) {
+        item->plain = true;
+    }
+    return ret;
+}
+
+static void
+plain_remove(fd_selector s, const int fd) {
+    for(size_t i = 0; i < s->plain_count; i++) {
+        if(s->plain_fds[i] == fd) {
+            s->plain_fds[i] = s->plain_fds[--s->plain_count];
+            return;
+        }
+    }
+}
+
 selector_status
 selector_register(fd_selector        s,
                      const int          fd,
@@ -363,6 +465,15 @@ selector_register(fd_selector        s,
         item->interest = interest;
         item->data     = data;
 
+        if(s->epoll_fd != -1 && SELECTOR_SUCCESS != epoll_ctl_item(s, item, EPOLL_CTL_ADD)) {
+            ret = EPERM == errno ? plain_add(s, item) : SELECTOR_IO;
+            if(SELECTOR_SUCCESS != ret) {
+                memset(item, 0x00, sizeof(*item));
+                item_init(item);
+                goto finally;
+            }
+        }
+
         // actualizo colaterales
         if(fd > s->max_fd) {
             s->max_fd = fd;
@@ -390,6 +501,22 @@ selector_unregister_fd(fd_selector       s,
         goto finally;
     }
 
+    if(item->scheduled) {
+        for(size_t i = 0; i < s->run_count; i++) {
+            if(s->run_fds[i] == fd) {
+                s->run_fds[i] = -1;
+            }
+        }
+    }
+    if(s->epoll_fd != -1) {
+        // antes de handle_close, que seguramente cierre el fd
+        if(item->plain) {
+            plain_remove(s, fd);
+        } else {
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        }
+    }
+
     if(item->handler->handle_close != NULL) {
         struct selector_key key = {
             .s    = s,
@@ -422,12 +549,32 @@ selector_set_interest(fd_selector s, int fd, fd_interest i) {
         ret = SELECTOR_IARGS;
         goto finally;
     }
+    const fd_interest previous = item->interest;
     item->interest = i;
     items_update_fdset_for_fd(s, item);
+    if(s->epoll_fd != -1 && !item->plain && previous != i) {
+        ret = epoll_ctl_item(s, item, EPOLL_CTL_MOD);
+    }
 finally:
     return ret;
 }
 
+selector_status
+selector_schedule(fd_selector s, int fd) {
+    if(NULL == s || INVALID_FD(fd) || !ITEM_USED(s->fds + fd)) {
+        return SELECTOR_IARGS;
+    }
+    struct item *item = s->fds + fd;
+    if(item->scheduled) {
+        return SELECTOR_SUCCESS;
+    }
+    const selector_status ret = fd_list_append(&s->run_fds, &s->run_count, &s->run_size, fd);
+    if(SELECTOR_SUCCESS == ret) {
+        item->scheduled = true;
+    }
+    return ret;
+}
+
 selector_status
 selector_set_interest_key(struct selector_key *key, fd_interest i) {
     selector_status ret;
@@ -445,6 +592,84 @@ selector_set_interest_key(struct selector_key *key, fd_interest i) {
  * se encarga de manejar los resultados del select.
  * se encuentra separado para facilitar el testing
  */
+// self-profiling ////////////////////////////////////////////////////////////
+
+typedef enum {
+    PROFILE_READ,
+    PROFILE_WRITE,
+    PROFILE_BLOCK,
+    PROFILE_EVENTS,
+} profile_event;
+
+struct handler_profile {
+    const fd_handler       *handler;
+    struct profile_counter  events[PROFILE_EVENTS];
+};
+
+static bool                    profiling = false;
+static struct handler_profile  handler_profiles[PROFILE_HANDLERS];
+static struct profile_counter  loop_wait, loop_busy;
+
+void
+selector_profile_enable(bool enabled) {
+    profiling = enabled;
+}
+
+/** busca (o agrega) las estadísticas del manejador; si no hay lugar, van al último */
+static struct handler_profile *
+handler_profile(const fd_handler *handler) {
+    size_t i;
+    for(i = 0; i < N(handler_profiles) - 1; i++) {
+        if(handler_profiles[i].handler == NULL) {
+            handler_profiles[i].handler = handler;
+        }
+        if(handler_profiles[i].handler == handler) {
+            break;
+        }
+    }
+    return handler_profiles + i;
+}
+
+/** llama a un manejador, y si está activo el profiling mide cuánto tarda */
+static inline void
+dispatch(const fd_handler *handler, void (*callback)(struct selector_key *),
+         const profile_event event, struct selector_key *key) {
+    if(!profiling) {
+        callback(key);
+        return;
+    }
+    const uint64_t start = timing_now_ns();
+    callback(key);
+    profile_add(handler_profile(handler)->events + event, timing_now_ns() - start);
+}
+
+void
+selector_profile_foreach(selector_profile_visitor visitor, void *data) {
+    for(size_t i = 0; i < N(handler_profiles); i++) {
+        const struct handler_profile *profile = handler_profiles + i;
+        const char *name;
+        if(i == N(handler_profiles) - 1) {
+            name = PROFILE_OTHER_NAME;
+        } else if(profile->handler == NULL) {
+            continue;
+        } else {
+            name = profile->handler->name == NULL ? PROFILE_UNNAMED : profile->handler->name;
+        }
+        if(profile->events[PROFILE_READ].calls + profile->events[PROFILE_WRITE].calls
+           + profile->events[PROFILE_BLOCK].calls == 0) {
+            continue;
+        }
+        visitor(name, profile->events + PROFILE_READ, profile->events + PROFILE_WRITE,
+                profile->events + PROFILE_BLOCK, data);
+    }
+}
+
+void
+selector_profile_loop(struct profile_counter *wait, struct profile_counter *busy) {
+    *wait = loop_wait;
+    *busy = loop_busy;
+}
+
 static void
 handle_iteration(fd_selector s) {
     int n = s->max_fd;
@@ -453,7 +678,8 @@ handle_iteration(fd_selector s) {
     };
     for (int i = 0; i <= n; i++) {
         struct item *item = s->fds + i;
-        if(ITEM_USED(item)) {
+        // los que están en la cola los atiende handle_run_queue
+        if(ITEM_USED(item) && !item->scheduled) {
             key.fd   = item->fd;
             key.data = item->data;
             if(FD_ISSET(item->fd, &s->slave_r)) {
@@ -461,7 +687,7 @@ handle_iteration(fd_selector s) {
                     if(0 == item->handler->handle_read) {
                         assert(("OP_READ arrived but no handler. bug!" == 0));
                     } else {
-                        item->handler->handle_read(&key);
+                        dispatch(item->handler, item->handler->handle_read, PROFILE_READ, &key);
                     }
                 }
             }
@@ -470,7 +696,7 @@ handle_iteration(fd_selector s) {
                     if(0 == item->handler->handle_write) {
                         assert(("OP_WRITE arrived but no handler. bug!" == 0));
                     } else {
-                        item->handler->handle_write(&key);
+                        dispatch(item->handler, item->handler->handle_write, PROFILE_WRITE, &key);
                     }
                 }
             }
@@ -491,7 +717,7 @@ handle_block_notifications(fd_selector s) {
         if (ITEM_USED(item)) {
             key.fd = item->fd;
             key.data = item->data;
-            item->handler->handle_block(&key);
+            dispatch(item->handler, item->handler->handle_block, PROFILE_BLOCK, &key);
         }
 
         struct blocking_job* aux = j;
@@ -530,18 +756,117 @@ finally:
     return ret;
 }
 
+/** despacha los eventos que devolvió epoll_pwait y los archivos regulares */
+static void
+handle_epoll_iteration(fd_selector s, const int n) {
+    struct selector_key key = {
+        .s = s,
+    };
+    for(int i = 0; i < n; i++) {
+        const uint32_t events = s->events[i].events;
+        struct item *item = s->fds + s->events[i].data.fd;
+        if(!ITEM_USED(item) || item->scheduled) {
+            continue; // lo desregistró el manejador de otro fd en esta iteración, o lo atiende handle_run_queue
+        }
+        key.fd   = item->fd;
+        key.data = item->data;
+        if((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && (OP_READ & item->interest)) {
+            dispatch(item->handler, item->handler->handle_read, PROFILE_READ, &key);
+        }
+        if(ITEM_USED(item) && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && (OP_WRITE & item->interest)) {
+            dispatch(item->handler, item->handler->handle_write, PROFILE_WRITE, &key);
+        }
+    }
+    // si se saca el actual de la lista, en su lugar queda otro que todavía no se atendió
+    for(size_t i = 0; i < s->plain_count;) {
+        const int fd = s->plain_fds[i];
+        struct item *item = s->fds + fd;
+        key.fd   = fd;
+        key.data = item->data;
+        if(!item->scheduled && (OP_READ & item->interest)) {
+            dispatch(item->handler, item->handler->handle_read, PROFILE_READ, &key);
+        }
+        if(ITEM_USED(item) && item->plain && !item->scheduled && (OP_WRITE & item->interest)) {
+            dispatch(item->handler, item->handler->handle_write, PROFILE_WRITE, &key);
+        }
+        if(i < s->plain_count && s->plain_fds[i] == fd) {
+            i++;
+        }
+    }
+}
+
+/**
+ * despacha los fds encolados con selector_schedule según su interés, después
+ * de los que estaban listos: lo que se corta por un presupuesto espera a que
+ * se atienda al resto. Los que se vuelven a encolar quedan para la próxima
+ * iteración.
+ */
+static void
+handle_run_queue(fd_selector s) {
+    struct selector_key key = {
+        .s = s,
+    };
+    const size_t n = s->run_count;
+    for(size_t i = 0; i < n; i++) {
+        const int fd = s->run_fds[i];
+        if(fd == -1) {
+            continue;
+        }
+        s->run_fds[i] = -1;
+        struct item *item = s->fds + fd;
+        item->scheduled = false;
+        key.fd   = fd;
+        key.data = item->data;
+        if((OP_READ & item->interest) && item->handler->handle_read != NULL) {
+            dispatch(item->handler, item->handler->handle_read, PROFILE_READ, &key);
+        }
+        if(ITEM_USED(item) && !item->scheduled && (OP_WRITE & item->interest) && item->handler->handle_write != NULL) {
+            dispatch(item->handler, item->handler->handle_write, PROFILE_WRITE, &key);
+        }
+    }
+    s->run_count -= n;
+    memmove(s->run_fds, s->run_fds + n, s->run_count * sizeof(*s->run_fds));
+}
+
+/** con archivos regulares o fds encolados esperando, no hay que bloquearse */
+static int
+epoll_timeout(fd_selector s) {
+    if(s->run_count > 0) {
+        return 0;
+    }
+    for(size_t i = 0; i < s->plain_count; i++) {
+        if(s->fds[s->plain_fds[i]].interest != OP_NOOP) {
+            return 0;
+        }
+    }
+    return (int) (s->master_t.tv_sec * MS_PER_SECOND + s->master_t.tv_nsec / NS_PER_MS);
+}
+
 selector_status
 selector_select(fd_selector s) {
     selector_status ret = SELECTOR_SUCCESS;
 
-    memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
-    memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
-    memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
-
     s->selector_thread = pthread_self();
 
-    int fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &s->slave_t,
+    const uint64_t wait_start = profiling ? timing_now_ns() : 0;
+    int fds;
+    if(s->epoll_fd != -1) {
+        fds = epoll_pwait(s->epoll_fd, s->events, EPOLL_EVENTS, epoll_timeout(s), &emptyset);
+    } else {
+        memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
+        memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
+        memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
+        if(s->run_count > 0) {
+            s->slave_t.tv_sec  = 0;
+            s->slave_t.tv_nsec = 0;
+        }
+        fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &s->slave_t,
                       &emptyset);
+    }
+    const uint64_t busy_start = profiling ? timing_now_ns() : 0;
+    if(profiling) {
+        profile_add(&loop_wait, busy_start - wait_start);
+    }
     if(-1 == fds) {
         switch(errno) {
             case EAGAIN:
@@ -565,11 +890,17 @@ selector_select(fd_selector s) {
                 goto finally;
 
         }
+    } else if(s->epoll_fd != -1) {
+        handle_epoll_iteration(s, fds);
     } else {
         handle_iteration(s);
     }
     if(ret == SELECTOR_SUCCESS) {
         handle_block_notifications(s);
+        handle_run_queue(s);
+    }
+    if(profiling) {
+        profile_add(&loop_busy, timing_now_ns() - busy_start);
     }
 finally:
     return ret;
@@ -578,7 +909,7 @@ finally:
 int
 selector_fd_set_nio(const int fd) {
     int ret = 0;
-    int flags = fcntl(fd, F_GETFD, 0);
+    int flags = fcntl(fd, F_GETFL, 0);
     if(flags == -1) {
         ret = -1;
     } else {
@@ -3,6 +3,7 @@
 
 #include <sys/time.h>
 #include <stdbool.h>
+#include "profile.h"
 
 /**
  * selector.c - un muliplexor de entrada salida
@@ -71,6 +72,14 @@ struct selector_init {
 
     /** tiempo máximo de bloqueo durante `selector_iteratate' */
     struct timespec select_timeout;
+
+    /**
+     * usar epoll en lugar de pselect. Los fd de los manejadores con
+     * `edge_triggered' se registran con EPOLLET, el resto se comporta igual
+     * que con pselect. Los archivos regulares (que epoll no acepta) se
+     * consideran siempre listos, como con pselect.
+     */
+    bool epoll;
 };
 
 /** inicializa la librería */
@@ -134,6 +143,17 @@ typedef struct fd_handler {
    */
   void (*handle_close)     (struct selector_key *key);
 
+  /** nombre del manejador en las estadisticas de selector_profile_foreach */
+  const char *name;
+
+  /**
+   * con el backend epoll, avisar solo cuando el fd pasa a estar listo. El
+   * manejador tiene que leer/escribir hasta EAGAIN, o llamar a
+   * selector_schedule si corta antes (por ejemplo por un presupuesto);
+   * cambiar el interés también vuelve a avisar si el fd ya está listo.
+   */
+  bool edge_triggered;
+
 } fd_handler;
 
 /**
@@ -169,6 +189,16 @@ selector_set_interest(fd_selector s, int fd, fd_interest i);
 selector_status
 selector_set_interest_key(struct selector_key *key, fd_interest i);
 
+/**
+ * encola el fd para que en la próxima iteración se llame a su manejador de
+ * lectura o escritura (según el interés) aunque no esté listo, después de
+ * atender a los que sí lo están. Es para el que corta antes de EAGAIN con
+ * trabajo pendiente: no bloquea al resto y, edge-triggered, no se pierde.
+ * Mientras haya fds encolados la espera de la iteración es cero.
+ */
+selector_status
+selector_schedule(fd_selector s, int fd);
+
 
 /**
  * se bloquea hasta que hay eventos disponible y los despacha.
@@ -190,4 +220,30 @@ selector_status
 selector_notify_block(fd_selector s,
                  const int   fd);
 
+/**
+ * Self-profiling del loop: con `enabled' se mide el tiempo de cada llamada a
+ * un manejador (agrupado por fd_handler) y de cada iteración. Las
+ * estadísticas son del proceso, no de un selector en particular.
+ */
+void
+selector_profile_enable(bool enabled);
+
+typedef void (*selector_profile_visitor)(const char *name,
+                                         const struct profile_counter *read,
+                                         const struct profile_counter *write,
+                                         const struct profile_counter *block,
+                                         void *data);
+
+/** recorre los manejadores que se llamaron al menos una vez */
+void
+selector_profile_foreach(selector_profile_visitor visitor, void *data);
+
+/**
+ * `wait' es el tiempo bloqueado en pselect y `busy' el que se tardó en
+ * despachar los eventos de cada iteración, que es cuánto puede demorarse
+ * en atender un fd listo (lag del loop).
+ */
+void
+selector_profile_loop(struct profile_counter *wait, struct profile_counter *busy);
+
 #endif
@@ -4,6 +4,8 @@
  */
 #include <stdlib.h>
 #include "stm.h"
+#include "profile.h"
+#include "timing.h"
 #include "logging/logger.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
@@ -62,6 +64,14 @@ void jump(struct state_machine *stm, unsigned next, struct selector_key *key) {
     }
 }
 
+// Suma el tiempo desde start al estado en el que se llamo al handler (antes del jump, que puede liberar la maquina)
+inline static void
+profile_state(struct state_machine *stm, const unsigned state, const uint64_t start) {
+    if(stm->profile != NULL) {
+        profile_add(stm->profile + state, timing_now_ns() - start);
+    }
+}
+
 unsigned
 stm_handler_read(struct state_machine *stm, struct selector_key *key) {
     // Comprueba si es la primera vez que se llama a la maquina de estados
@@ -72,7 +82,10 @@ stm_handler_read(struct state_machine *stm, struct selector_key *key) {
         abort();
     }
     // Ejecuta la funcion de lectura del estado actual
+    const unsigned state = stm->current->state;
+    const uint64_t start = stm->profile != NULL ? timing_now_ns() : 0;
     const unsigned int ret = stm->current->on_read_ready(key);
+    profile_state(stm, state, start);
     // El resultado de la funcion de lectura es el proximo estado, el cual puede ser el mismo (se mantiene en el mismo estado)
     // o puede ser otro (en cuyo caso se hara el "jump" al nuevo estado)
     jump(stm, ret, key);
@@ -90,7 +103,10 @@ stm_handler_write(struct state_machine *stm, struct selector_key *key) {
         abort();
     }
     // Ejecuta la funcion de escritura del estado actual
+    const unsigned state = stm->current->state;
+    const uint64_t start = stm->profile != NULL ? timing_now_ns() : 0;
     const unsigned int ret = stm->current->on_write_ready(key);
+    profile_state(stm, state, start);
     // El resultado de la funcion de escritura es el proximo estado, el cual puede ser el mismo (se mantiene en el mismo estado)
     // o puede ser otro (en cuyo caso se hara el "jump" al nuevo estado)
     jump(stm, ret, key);
@@ -105,7 +121,10 @@ stm_handler_block(struct state_machine *stm, struct selector_key *key) {
         logf(LOG_FATAL, "Current state %d does not support block", stm->current->state);
         abort();
     }
+    const unsigned state = stm->current->state;
+    const uint64_t start = stm->profile != NULL ? timing_now_ns() : 0;
     const unsigned int ret = stm->current->on_block_ready(key);
+    profile_state(stm, state, start);
     jump(stm, ret, key);
 
     return ret;
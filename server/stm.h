@@ -32,6 +32,11 @@ struct state_machine {
     unsigned                      max_state;
     /** estado actual */
     const struct state_definition *current;
+    /**
+     * opcional: si no es NULL, se acumula el tiempo de cada on_*_ready en
+     * profile[estado] (max_state + 1 elementos, se pueden compartir entre máquinas)
+     */
+    struct profile_counter        *profile;
 };
 
 typedef struct selector_key *key;
@@ -0,0 +1,33 @@
+#include "stuffing.h"
+
+byte_stuffing_state byte_stuffing_next(byte_stuffing_state curr_flag, char curr_char){
+    switch (curr_char) {
+        case '\r':
+            return BYTE_STUFFING_CR;
+        case '\n':
+            return curr_flag==BYTE_STUFFING_CR?BYTE_STUFFING_LF:BYTE_STUFFING_NOTHING;
+        case '.':
+            return curr_flag==BYTE_STUFFING_LF?BYTE_STUFFING_DOT:BYTE_STUFFING_NOTHING;
+        default:
+            return BYTE_STUFFING_NOTHING;
+    }
+}
+
+size_t byte_stuffing_copy(uint8_t * dst, size_t dst_max, const uint8_t * src, size_t src_max, size_t * consumed, byte_stuffing_state * flag){
+    size_t write = 0, file = 0;
+    //siempre me quedo con al menos 2 espacios en el de write por si tengo que hacer byte stuffing
+    if(dst_max < 2){
+        *consumed = 0;
+        return 0;
+    }
+    for (; file < src_max && write < dst_max - 1; write++, file++) {
+        *flag = byte_stuffing_next(*flag, (char) src[file]);
+        if(*flag == BYTE_STUFFING_DOT) {
+            //vi un punto al inicio de una linea nueva
+            dst[write++] = '.';
+        }
+        dst[write] = src[file];
+    }
+    *consumed = file;
+    return write;
+}
@@ -0,0 +1,33 @@
+#ifndef STUFFING_H_Wd5KpR9mVx2NcT7bLq4ZsJ8hF
+#define STUFFING_H_Wd5KpR9mVx2NcT7bLq4ZsJ8hF
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Byte stuffing de RETR: a cada linea del mail que empieza con '.' se le agrega otro '.' adelante
+ *
+ * El estado es lo ultimo que se vio (\r, \r\n, el '.' al inicio de una linea, o cualquier otra cosa) y se guarda
+ * entre llamadas, porque el mail se lee de a partes. Para el primer byte del mail hay que empezar en BYTE_STUFFING_LF
+ */
+typedef enum{
+    BYTE_STUFFING_CR,
+    BYTE_STUFFING_LF,
+    BYTE_STUFFING_DOT,
+    BYTE_STUFFING_NOTHING
+}byte_stuffing_state;
+
+/*
+ * Estado despues de ver curr_char
+ */
+byte_stuffing_state byte_stuffing_next(byte_stuffing_state curr_flag, char curr_char);
+
+/*
+ * Copia de src a dst haciendo byte stuffing, hasta terminar src o llenar dst
+ * Siempre deja lugar para el '.' extra, asi que puede quedar un byte libre en dst
+ *
+ * Deja en *consumed cuantos bytes de src copio y retorna cuantos escribio en dst
+ */
+size_t byte_stuffing_copy(uint8_t * dst, size_t dst_max, const uint8_t * src, size_t src_max, size_t * consumed, byte_stuffing_state * flag);
+
+#endif
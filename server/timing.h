@@ -0,0 +1,28 @@
+#ifndef TIMING_H_c8XbN2rVq5TfLw9KsEy3JmPd7
+#define TIMING_H_c8XbN2rVq5TfLw9KsEy3JmPd7
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Tiempo de un reloj monotonico (no salta si cambian la hora del sistema),
+ * para medir latencias. No tiene relacion con la hora real.
+ */
+static inline uint64_t
+timing_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + (uint64_t) ts.tv_nsec / 1000u;
+}
+
+/*
+ * Igual que timing_now_us, en nanosegundos (para medir llamadas cortas, como un handler del selector)
+ */
+static inline uint64_t
+timing_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+#endif
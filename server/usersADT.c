@@ -1,10 +1,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include "usersADT.h"
 #include "logging/logger.h"
 
+#define INDEX_INITIAL_SIZE 32 //potencia de 2, se duplica para que quede a lo sumo a la mitad
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
 static int usersADT_find_user(usersADT u, const char * user_name);
+static int usersADT_reserve(usersADT u, size_t extra_users);
+static void usersADT_rebuild_index(usersADT u);
 
 usersADT usersADT_init(void){
     log(LOG_INFO, "Initializing usersADT");
@@ -15,73 +22,150 @@ usersADT usersADT_init(void){
     }
     u->array_length = CHUNK;
     u->users_count = 0;
-    u->users_array = calloc(CHUNK, sizeof(user_t));
-    if(u->users_array == NULL || errno == ENOMEM){
+    u->users_array = calloc(CHUNK, sizeof(user_t *));
+    u->index_size = INDEX_INITIAL_SIZE;
+    u->index = calloc(INDEX_INITIAL_SIZE, sizeof(unsigned int));
+    if(u->users_array == NULL || u->index == NULL || errno == ENOMEM){
         log(LOG_FATAL, "Unable to allocate memory for users_array");
+        free(u->users_array);
+        free(u->index);
         free(u);
         return NULL;
     }
     return u;
 }
 
+static void free_user(user_t * user) {
+    free(user->name);
+    free(user->pass);
+    free(user);
+}
+
 void usersADT_destroy(usersADT u) {
     log(LOG_INFO, "Destroying usersADT");
     for(unsigned int i = 0; i < u->users_count; i++) {
-        logf(LOG_INFO, "Destroying usersADT '%s'", u->users_array[i].name);
-        free(u->users_array[i].name);
-        free(u->users_array[i].pass);
+        logf(LOG_DEBUG, "Destroying usersADT '%s'", u->users_array[i]->name);
+        free_user(u->users_array[i]);
     }
     free(u->users_array);
+    free(u->index);
     free(u);
 }
 
 int usersADT_add(usersADT u, const char * user_name, const char * user_pass) {
-    if(usersADT_find_user(u,user_name) != -1){
+    users_op op = {.type = USERS_OP_ADD, .name = user_name, .pass = user_pass};
+    if(usersADT_apply(u, &op, 1) < 0) {
+        logf(LOG_ERROR, "Unable to allocate memory for user '%s'", user_name);
+        return -2;
+    }
+    if(op.result != 0) {
         logf(LOG_ERROR, "User '%s' already in ADT", user_name);
-        return -1;
-    }
-    char * name = NULL;
-    char * pass = NULL;
-    unsigned int name_length = strlen(user_name);
-    name = calloc(name_length + 1, sizeof(char));
-    if(name == NULL || errno == ENOMEM) {
-        logf(LOG_ERROR, "Unable to allocate memory for name of user '%s'", user_name);
-        goto error;
-    }
-    strncpy(name, user_name, name_length);
-    unsigned int pass_length = strlen(user_pass);
-    pass = calloc(pass_length + 1, sizeof(char));
-    if(pass == NULL  || errno == ENOMEM) {
-        logf(LOG_ERROR, "Unable to allocate memory for pass of user '%s'", user_name);
-        goto error;
-    }
-    strncpy(pass, user_pass, pass_length);
-    if(u->users_count == u->array_length){
-        user_t * aux = realloc(u->users_array, sizeof(user_t)*(u->array_length + CHUNK));
-        if(aux == NULL) {
-            logf(LOG_FATAL, "Unable to reallocate memory for usersADT, current size: %d", u->array_length);
-            goto error;
-        }
-        u->users_array = aux;
-        u->array_length += CHUNK;
     }
-    u->users_array[u->users_count].name = name;
-    u->users_array[u->users_count].pass = pass;
-    u->users_array[u->users_count].logged = false;
-    u->users_count++;
-    return 0;
+    return op.result;
+}
 
-    error:
-        if(name != NULL) {
-            free(name);
+/*
+ * Deshace las primeras count operaciones de ops (las que se aplicaron)
+ * old_pass tiene la contraseña anterior de cada CHANGE_PASS aplicado
+ */
+static void rollback(usersADT u, users_op * ops, char ** old_pass, size_t count) {
+    // Primero las contraseñas, en orden inverso (un usuario puede cambiar varias veces), con el indice todavia completo
+    for(size_t i = count; i > 0; i--) {
+        if(ops[i - 1].result == 0 && ops[i - 1].type == USERS_OP_CHANGE_PASS) {
+            user_t * user = u->users_array[usersADT_find_user(u, ops[i - 1].name)];
+            free(user->pass);
+            user->pass = old_pass[i - 1];
+            old_pass[i - 1] = NULL;
         }
-        if(pass != NULL) {
-            free(pass);
+    }
+    // Los ADD se agregan al final, el ultimo aplicado es el ultimo del arreglo
+    for(size_t i = count; i > 0; i--) {
+        if(ops[i - 1].result == 0 && ops[i - 1].type == USERS_OP_ADD) {
+            u->users_count--;
+            free_user(u->users_array[u->users_count]);
         }
+    }
+    usersADT_rebuild_index(u);
+}
+
+static void index_insert(usersADT u, unsigned int position);
+
+long usersADT_apply(usersADT u, users_op * ops, size_t count) {
+    size_t adds = 0;
+    for(size_t i = 0; i < count; i++) {
+        adds += ops[i].type == USERS_OP_ADD;
+    }
+    // Reservamos todo antes, asi lo unico que puede fallar despues son los strings de cada usuario
+    char ** old_pass = calloc(count == 0 ? 1 : count, sizeof(char *));
+    if(old_pass == NULL || usersADT_reserve(u, adds) != 0) {
+        free(old_pass);
         return -2;
+    }
+    long applied = 0;
+    size_t i;
+    for(i = 0; i < count; i++) {
+        users_op * op = ops + i;
+        int position = usersADT_find_user(u, op->name);
+        op->result = -1;
+        if(op->type == USERS_OP_ADD) {
+            if(position != -1) {
+                continue;
+            }
+            user_t * user = calloc(1, sizeof(user_t));
+            if(user == NULL) {
+                goto error;
+            }
+            user->name = strdup(op->name);
+            user->pass = strdup(op->pass);
+            if(user->name == NULL || user->pass == NULL) {
+                free_user(user);
+                goto error;
+            }
+            u->users_array[u->users_count] = user;
+            index_insert(u, u->users_count);
+            u->users_count++;
+        } else {
+            if(position == -1) {
+                continue;
+            }
+            char * pass = strdup(op->pass);
+            if(pass == NULL) {
+                goto error;
+            }
+            logf(LOG_DEBUG, "Updating pass for user '%s'", op->name);
+            old_pass[i] = u->users_array[position]->pass;
+            u->users_array[position]->pass = pass;
+        }
+        op->result = 0;
+        applied++;
+    }
+    // Ya no se puede deshacer, liberamos las contraseñas viejas
+    for(i = 0; i < count; i++) {
+        free(old_pass[i]);
+    }
+    free(old_pass);
+    return applied;
+
+error:
+    ops[i].result = -1;
+    rollback(u, ops, old_pass, i);
+    for(size_t j = 0; j < count; j++) {
+        ops[j].result = -1;
+    }
+    free(old_pass);
+    return -2;
+}
+
+user_t * usersADT_get_user(usersADT u, const char * user_name) {
+    int position = usersADT_find_user(u, user_name);
+    return position == -1 ? NULL : u->users_array[position];
 }
 
 char * usersADT_get_user_mail_path(usersADT u, const char * base_path, const char * user_name) {
+    return usersADT_get_user_mail_subdir(u, base_path, user_name, CURL_PATH);
+}
+
+char * usersADT_get_user_mail_subdir(usersADT u, const char * base_path, const char * user_name, const char * subdir) {
     int user_index = usersADT_find_user(u, user_name);
     if(user_index == -1) {
         logf(LOG_ERROR, "Cannot find user '%s' to get mail path", user_name);
@@ -89,7 +173,7 @@ char * usersADT_get_user_mail_path(usersADT u, const char * base_path, const cha
     }
     unsigned int base_path_len = strlen(base_path);
     unsigned int user_name_len = strlen(user_name);
-    unsigned int curl_len = strlen(CURL_PATH);
+    unsigned int curl_len = strlen(subdir);
     char * user_mail_path = calloc(base_path_len + user_name_len + curl_len + 2, sizeof(char));
     if(user_mail_path == NULL || errno == ENOMEM) {
         log(LOG_ERROR,"Error allocating memory for user mail path");
@@ -98,7 +182,7 @@ char * usersADT_get_user_mail_path(usersADT u, const char * base_path, const cha
     strncpy(user_mail_path, base_path, base_path_len);
 //    user_mail_path[base_path_len] = '/';
     strncat(user_mail_path, user_name, user_name_len);
-    strncat(user_mail_path, CURL_PATH, curl_len);
+    strncat(user_mail_path, subdir, curl_len);
     return user_mail_path;
 }
 
@@ -108,32 +192,86 @@ bool usersADT_validate(usersADT u, const char * user_name, const char * user_pas
         logf(LOG_ERROR, "Cannot find user '%s' to validate", user_name);
         return false;
     }
-    return strcmp(u->users_array[user_index].pass, user_pass);
+    return strcmp(u->users_array[user_index]->pass, user_pass);
 }
 
 bool usersADT_update_pass(usersADT u, const char * user_name, const char * new_pass){
-    for(unsigned int i = 0; i < u->users_count; i++){
-        if(strcmp(u->users_array[i].name, user_name) == 0){
-            logf(LOG_DEBUG, "Updating pass for user '%s'", user_name);
-            free(u->users_array[i].pass);
-            unsigned int pass_length = strlen(new_pass);
-            char* pass = calloc(pass_length + 1, sizeof(char));
-            if(pass == NULL  || errno == ENOMEM) {
-                return false;
-            }
-            strncpy(pass, new_pass, pass_length);
-            u->users_array[i].pass = pass;
-            return true;
+    users_op op = {.type = USERS_OP_CHANGE_PASS, .name = user_name, .pass = new_pass};
+    return usersADT_apply(u, &op, 1) == 1;
+}
+
+/*
+ * --------------------------------------------------------------------------------------
+ * Indice de los usuarios por nombre
+ * --------------------------------------------------------------------------------------
+ */
+static uint32_t hash_name(const char * name) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for(; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static void index_insert(usersADT u, unsigned int position) {
+    unsigned int mask = u->index_size - 1;
+    unsigned int slot = hash_name(u->users_array[position]->name) & mask;
+    while(u->index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    u->index[slot] = position + 1;
+}
+
+static void usersADT_rebuild_index(usersADT u) {
+    memset(u->index, 0, u->index_size * sizeof(unsigned int));
+    for(unsigned int i = 0; i < u->users_count; i++) {
+        index_insert(u, i);
+    }
+}
+
+/*
+ * Deja lugar para extra_users usuarios mas en el arreglo y en el indice
+ * Retorna 0 si pudo, -2 si no hubo memoria (y no cambia nada de lo que ya esta)
+ */
+static int usersADT_reserve(usersADT u, size_t extra_users) {
+    size_t needed = (size_t) u->users_count + extra_users;
+    if(needed > u->array_length) {
+        size_t length = (needed + CHUNK - 1) / CHUNK * CHUNK;
+        user_t ** aux = realloc(u->users_array, sizeof(user_t *) * length);
+        if(aux == NULL) {
+            logf(LOG_FATAL, "Unable to reallocate memory for usersADT, current size: %d", u->array_length);
+            return -2;
         }
+        u->users_array = aux;
+        u->array_length = length;
+    }
+    size_t index_size = u->index_size;
+    while(needed * 2 > index_size) {
+        index_size *= 2;
+    }
+    if(index_size != u->index_size) {
+        unsigned int * index = calloc(index_size, sizeof(unsigned int));
+        if(index == NULL) {
+            log(LOG_FATAL, "Unable to allocate memory for usersADT index");
+            return -2;
+        }
+        free(u->index);
+        u->index = index;
+        u->index_size = index_size;
+        usersADT_rebuild_index(u);
     }
-    return false;
+    return 0;
 }
 
 static int usersADT_find_user(usersADT u, const char * user_name) {
-    for(unsigned int i = 0; i < u->users_count; i++) {
-        if(strcmp(u->users_array[i].name, user_name) == 0) {
-            return i;
+    unsigned int mask = u->index_size - 1;
+    unsigned int slot = hash_name(user_name) & mask;
+    while(u->index[slot] != 0) {
+        unsigned int position = u->index[slot] - 1;
+        if(strcmp(u->users_array[position]->name, user_name) == 0) {
+            return position;
         }
+        slot = (slot + 1) & mask;
     }
     return -1;
 }
@@ -2,9 +2,11 @@
 #define TP_USERSADT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define CHUNK 10
 #define CURL_PATH "/cur"
+#define NEW_PATH "/new"
 
 typedef struct{
     char *name;
@@ -12,12 +14,34 @@ typedef struct{
     bool logged;
 } user_t;
 
+/*
+ * users_array tiene punteros para que los user_t no se muevan al agregar usuarios
+ * (las conexiones guardan el user_t* de su usuario)
+ * index es una tabla de hash (open addressing) con la posicion + 1 de cada usuario en users_array, 0 si esta libre
+ */
 struct usersCDT {
-    user_t * users_array;
+    user_t ** users_array;
     unsigned int array_length;
     unsigned int users_count;
+    unsigned int * index;
+    unsigned int index_size;
 };
 
+/*
+ * Operacion sobre un usuario para usersADT_apply
+ */
+typedef enum {
+    USERS_OP_ADD,
+    USERS_OP_CHANGE_PASS,
+} users_op_type;
+
+typedef struct {
+    users_op_type type;
+    const char * name;
+    const char * pass;
+    int result; // lo completa usersADT_apply: 0 si se aplico, -1 si el usuario ya existe (ADD) o no existe (CHANGE_PASS)
+} users_op;
+
 typedef struct usersCDT * usersADT;
 
 /*
@@ -41,6 +65,22 @@ void usersADT_destroy(usersADT u);
  */
 int usersADT_add(usersADT u, const char * user_name, const char * user_pass);
 
+/*
+ * Aplica las operaciones en orden, como una sola transaccion
+ * Las operaciones invalidas (agregar un usuario que existe o cambiar la contraseña de uno que no) se saltean
+ * y quedan con result -1; el resto se aplica. Si falta memoria no se aplica ninguna
+ *
+ * Retorna la cantidad de operaciones aplicadas
+ * Retorna -2 si hubo problemas de memoria (y no cambia nada)
+ */
+long usersADT_apply(usersADT u, users_op * ops, size_t count);
+
+/*
+ * Devuelve el usuario, o NULL si no existe
+ * El puntero sigue siendo valido aunque se agreguen usuarios
+ */
+user_t * usersADT_get_user(usersADT u, const char * user_name);
+
 /*
  * Dado el basepath del directorio, devuelve el path al Maildir del usuario
  *
@@ -48,6 +88,14 @@ int usersADT_add(usersADT u, const char * user_name, const char * user_pass);
  */
 char * usersADT_get_user_mail_path(usersADT u, const char * base_path, const char * user_name);
 
+/*
+ * Dado el basepath del directorio, devuelve el path a un subdirectorio del Maildir del usuario
+ * (subdir es por ejemplo CURL_PATH o NEW_PATH)
+ *
+ * En caso de error, devuelve NULL
+ */
+char * usersADT_get_user_mail_subdir(usersADT u, const char * base_path, const char * user_name, const char * subdir);
+
 /*
  * Verifica que el usuario exista y las credenciales sean validas
  *
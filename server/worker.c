@@ -0,0 +1,204 @@
+/**
+ * worker.c - trabajos bloqueantes fuera del hilo del selector
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <signal.h>
+#include "worker.h"
+
+struct worker_job {
+    fd_selector     s;
+    int             fd;
+    worker_task     task;
+    worker_destroy  destroy;
+    void *          data;
+
+    /** protege references y released */
+    pthread_mutex_t mutex;
+    /** dueño + hilo */
+    unsigned        references;
+    /** el dueño ya no espera la notificación */
+    bool            released;
+};
+
+/** hilos que corren los trabajos, y la cola (circular) de los que esperan */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  not_empty;
+    worker_job *    queue;
+    /** capacidad de queue, 0 si no hay pool */
+    unsigned        size;
+    unsigned        head;
+    unsigned        count;
+    /** no se aceptan mas trabajos, los hilos terminan al vaciar la cola */
+    bool            closing;
+
+    pthread_t *     threads;
+    unsigned        started;
+    unsigned long   rejected;
+} pool = {
+    .mutex     = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+};
+
+// descuenta una referencia, y libera si era la ultima. Se llama con el mutex tomado
+static void
+job_unref_locked(worker_job job) {
+    bool last = --job->references == 0;
+    pthread_mutex_unlock(&job->mutex);
+    if(last) {
+        if(job->destroy != NULL) {
+            job->destroy(job->data);
+        }
+        pthread_mutex_destroy(&job->mutex);
+        free(job);
+    }
+}
+
+static void
+job_finish(worker_job job) {
+    pthread_mutex_lock(&job->mutex);
+    if(!job->released) {
+        // el dueño sigue vivo, le avisamos al selector que ya esta el resultado
+        selector_notify_block(job->s, job->fd);
+    }
+    job_unref_locked(job);
+}
+
+// un trabajo por vez desde la cola, hasta que worker_close la cierre y se vacie
+static void *
+worker_run(void * arg) {
+    (void) arg;
+    pthread_mutex_lock(&pool.mutex);
+    for(;;) {
+        while(pool.count == 0 && !pool.closing) {
+            pthread_cond_wait(&pool.not_empty, &pool.mutex);
+        }
+        if(pool.count == 0) {
+            break;
+        }
+        worker_job job = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % pool.size;
+        pool.count--;
+        pthread_mutex_unlock(&pool.mutex);
+
+        job->task(job->data);
+        job_finish(job);
+
+        pthread_mutex_lock(&pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+int
+worker_init(unsigned threads, unsigned queue_size) {
+    if(threads == 0 || queue_size == 0) {
+        return -1;
+    }
+    pool.queue   = calloc(queue_size, sizeof(*pool.queue));
+    pool.threads = calloc(threads, sizeof(*pool.threads));
+    if(pool.queue == NULL || pool.threads == NULL) {
+        goto fail;
+    }
+    pool.size    = queue_size;
+    pool.head    = 0;
+    pool.count   = 0;
+    pool.closing = false;
+
+    // los hilos heredan la mascara: bloqueamos todas las señales para que las
+    // reciba siempre el hilo del selector (SIGTERM, SIGINT, la de notificacion)
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for(pool.started = 0; pool.started < threads; pool.started++) {
+        if(pthread_create(&pool.threads[pool.started], NULL, worker_run, NULL) != 0) {
+            // nos quedamos con los que se pudieron crear
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(pool.started == 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    free(pool.queue);
+    free(pool.threads);
+    pool.queue   = NULL;
+    pool.threads = NULL;
+    pool.size    = 0;
+    return -1;
+}
+
+worker_job
+worker_submit(fd_selector s, int fd, worker_task task, worker_destroy destroy, void * data) {
+    worker_job job = calloc(1, sizeof(*job));
+    if(job == NULL) {
+        return NULL;
+    }
+    job->s          = s;
+    job->fd         = fd;
+    job->task       = task;
+    job->destroy    = destroy;
+    job->data       = data;
+    job->references = 2;
+    job->released   = false;
+    pthread_mutex_init(&job->mutex, NULL);
+
+    pthread_mutex_lock(&pool.mutex);
+    bool full = pool.count == pool.size || pool.closing;
+    if(!full) {
+        pool.queue[(pool.head + pool.count) % pool.size] = job;
+        pool.count++;
+        pthread_cond_signal(&pool.not_empty);
+    } else {
+        pool.rejected++;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    if(full) {
+        // no se ejecuta: data sigue siendo del llamador
+        pthread_mutex_destroy(&job->mutex);
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+void
+worker_release(worker_job job) {
+    if(job == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&job->mutex);
+    job->released = true;
+    job_unref_locked(job);
+}
+
+void
+worker_close(void) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.closing = true;
+    pthread_cond_broadcast(&pool.not_empty);
+    pthread_mutex_unlock(&pool.mutex);
+    for(unsigned i = 0; i < pool.started; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.queue);
+    free(pool.threads);
+    pool.queue   = NULL;
+    pool.threads = NULL;
+    pool.size    = 0;
+    pool.started = 0;
+}
+
+unsigned long
+worker_rejected(void) {
+    pthread_mutex_lock(&pool.mutex);
+    unsigned long rejected = pool.rejected;
+    pthread_mutex_unlock(&pool.mutex);
+    return rejected;
+}
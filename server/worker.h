@@ -0,0 +1,69 @@
+#ifndef WORKER_H_Qm3VtZp8LrK2xWn7HdYc4EsJ9
+#define WORKER_H_Qm3VtZp8LrK2xWn7HdYc4EsJ9
+
+#include "selector.h"
+
+/**
+ * worker.c - trabajos bloqueantes fuera del hilo del selector
+ *
+ * Ejecuta las tareas en un grupo fijo de hilos (`worker_init') que las toma
+ * de una cola acotada y, cuando termina cada una, lo notifica con
+ * `selector_notify_block' sobre el fd dueño del trabajo. El resultado se
+ * procesa luego en el `handle_block' del handler de ese fd, dentro de la
+ * iteración normal del selector, por lo que los handlers no se tienen que
+ * preocupar por la concurrencia.
+ *
+ * La tarea corre en otro hilo: solo puede tocar su propio `data' (no el
+ * estado de la conexión ni el selector). Puede loggear, cada hilo escribe
+ * en su propio buffer del logger.
+ */
+typedef struct worker_job * worker_job;
+
+/** tarea a ejecutar en el hilo del worker */
+typedef void (*worker_task)(void * data);
+
+/** libera `data' cuando ya nadie usa el trabajo */
+typedef void (*worker_destroy)(void * data);
+
+/**
+ * Crea los `threads' hilos del pool, con una cola de hasta `queue_size'
+ * trabajos esperando. Se llama una vez, antes del primer `worker_submit'.
+ *
+ * Retorna 0 si pudo crear al menos un hilo, o -1.
+ */
+int
+worker_init(unsigned threads, unsigned queue_size);
+
+/**
+ * Encola `task(data)' para que la corra un hilo del pool, que notifica al
+ * selector `s' sobre `fd' cuando termina.
+ *
+ * Retorna NULL si la cola está llena (o no hay memoria, o no hay pool): la
+ * tarea no se ejecuta, no se llama a `destroy' y `data' sigue siendo del
+ * llamador, que decide si responde con un error o lo reintenta.
+ */
+worker_job
+worker_submit(fd_selector s, int fd, worker_task task, worker_destroy destroy, void * data);
+
+/**
+ * El dueño deja de usar el trabajo. Se llama luego de procesar el resultado
+ * en `handle_block', o antes si el dueño se destruye: en ese caso el
+ * trabajo termina igual pero ya no se notifica al selector.
+ * `data' se libera con `destroy' cuando terminan el dueño y el hilo.
+ */
+void
+worker_release(worker_job job);
+
+/**
+ * Espera a que se terminen los trabajos encolados y a los hilos del pool.
+ * Se llama luego de destruir el selector (los dueños ya soltaron sus
+ * trabajos, así que no se notifica a nadie).
+ */
+void
+worker_close(void);
+
+/** trabajos que no se encolaron porque la cola estaba llena */
+unsigned long
+worker_rejected(void);
+
+#endif